@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "asset_cache.h"
+
+typedef enum asset_type_t
+{
+	ASSET_TEXTURE,
+	ASSET_MESH
+} AssetType;
+
+typedef struct asset_entry_t
+{
+	char* path;
+	AssetType type;
+	int flags;			// Load flags, part of the key for textures
+	void* asset;
+	int ref_count;
+	struct asset_entry_t* next;
+} AssetEntry;
+
+static AssetEntry* asset_buckets[ASSET_CACHE_BUCKET_COUNT];
+
+/*
+	FNV-1a
+*/
+static unsigned int hash_path(const char* path)
+{
+	unsigned int result = 2166136261u;
+
+	for (const unsigned char* c = (const unsigned char*)path; *c; c++)
+	{
+		result ^= *c;
+		result *= 16777619u;
+	}
+
+	return result;
+}
+
+static AssetEntry** find_entry(const char* path, AssetType type, int flags)
+{
+	AssetEntry** result = &asset_buckets[hash_path(path) % ASSET_CACHE_BUCKET_COUNT];
+
+	while (*result)
+	{
+		AssetEntry* entry = *result;
+		if (entry->type == type && entry->flags == flags && strcmp(entry->path, path) == 0)
+		{
+			break;
+		}
+		result = &entry->next;
+	}
+
+	return result;
+}
+
+static void add_entry(AssetEntry** link, const char* path, AssetType type, int flags, void* asset)
+{
+	AssetEntry* entry = (AssetEntry*)malloc(sizeof(AssetEntry));
+
+	size_t path_length = strlen(path);
+	entry->path = (char*)malloc(path_length + 1);
+	memcpy(entry->path, path, path_length + 1);
+
+	entry->type = type;
+	entry->flags = flags;
+	entry->asset = asset;
+	entry->ref_count = 1;
+	entry->next = NULL;
+
+	*link = entry;
+}
+
+/*
+	Releases are by object, not by path, so every bucket may need
+	to be searched.  The cache holds few distinct assets, it is the
+	references to them that are many.
+
+	@returns: 1 if this was the last reference and the entry was removed
+*/
+static int release_entry(void* asset)
+{
+	for (int i = 0; i < ASSET_CACHE_BUCKET_COUNT; i++)
+	{
+		for (AssetEntry** link = &asset_buckets[i]; *link; link = &(*link)->next)
+		{
+			AssetEntry* entry = *link;
+			if (entry->asset != asset) continue;
+
+			entry->ref_count--;
+			if (entry->ref_count > 0) return 0;
+
+			*link = entry->next;
+			free(entry->path);
+			free(entry);
+			return 1;
+		}
+	}
+
+	// Not from the cache, the caller owns it
+	return 1;
+}
+
+Texture* acquire_texture(const char* path, TextureLoadFlags flags)
+{
+	AssetEntry** link = find_entry(path, ASSET_TEXTURE, flags);
+
+	if (*link)
+	{
+		(*link)->ref_count++;
+		return (Texture*)(*link)->asset;
+	}
+
+	Texture* result = load_texture(path, flags);
+	add_entry(link, path, ASSET_TEXTURE, flags, result);
+
+	return result;
+}
+
+void release_texture(Texture* texture)
+{
+	if (texture && release_entry(texture))
+	{
+		free_texture(texture);
+	}
+}
+
+Mesh* acquire_mesh(const char* path)
+{
+	AssetEntry** link = find_entry(path, ASSET_MESH, 0);
+
+	if (*link)
+	{
+		(*link)->ref_count++;
+		return (Mesh*)(*link)->asset;
+	}
+
+	Mesh* result = load_mesh(path);
+
+	// Failed loads are not cached, a later acquire retries
+	if (result)
+	{
+		add_entry(link, path, ASSET_MESH, 0, result);
+	}
+
+	return result;
+}
+
+void release_mesh(Mesh* mesh)
+{
+	if (mesh && release_entry(mesh))
+	{
+		free_mesh(mesh);
+	}
+}
@@ -0,0 +1,26 @@
+#ifndef ASSET_CACHE_H
+#define ASSET_CACHE_H
+
+#include "texture.h"
+#include "obj_model_loader.h"
+#include "mesh_cache.h"
+
+/*
+	Path-keyed, reference counted cache in front of load_texture and
+	load_mesh.  Every acquire of an already loaded path returns
+	the same object and bumps its count, the object is freed when the
+	last reference is released.
+
+	Shared objects must be treated as read-only, except for lazily
+	derived data such as calculate_tangents().
+*/
+
+#define ASSET_CACHE_BUCKET_COUNT 64
+
+Texture* acquire_texture(const char* path, TextureLoadFlags flags);
+void release_texture(Texture* texture);
+
+Mesh* acquire_mesh(const char* path);
+void release_mesh(Mesh* mesh);
+
+#endif // !ASSET_CACHE_H
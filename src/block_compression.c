@@ -0,0 +1,462 @@
+#include "block_compression.h"
+
+static uint32_t pack_ARGB32(uint32_t a, uint32_t r, uint32_t g, uint32_t b)
+{
+	uint32_t result = a << 24 | r << 16 | g << 8 | b;
+
+	return result;
+}
+
+static uint32_t rgb565_to_ARGB32(uint16_t color)
+{
+	uint32_t r = (color >> 11) & 0x1F;
+	uint32_t g = (color >> 5) & 0x3F;
+	uint32_t b = color & 0x1F;
+
+	// Replicate the high bits into the low bits, so 0x1F -> 0xFF
+	r = (r << 3) | (r >> 2);
+	g = (g << 2) | (g >> 4);
+	b = (b << 3) | (b >> 2);
+
+	uint32_t result = pack_ARGB32(0xFF, r, g, b);
+
+	return result;
+}
+
+/*
+	(weight_a * a + weight_b * b) / divisor for every channel
+*/
+static uint32_t blend_ARGB32(uint32_t a, uint32_t b, uint32_t weight_a, uint32_t weight_b, uint32_t divisor)
+{
+	uint32_t result = 0;
+
+	for (int shift = 0; shift < 32; shift += 8)
+	{
+		uint32_t channel = (((a >> shift) & 0xFF) * weight_a + ((b >> shift) & 0xFF) * weight_b) / divisor;
+		result |= channel << shift;
+	}
+
+	return result;
+}
+
+/*
+	BC1 color block: two RGB565 endpoints and 2-bit indices.
+
+	punchthrough - if set, c0 <= c1 selects the 3 color mode where
+	               index 3 is transparent black (BC1).  BC3 color
+	               blocks always use the 4 color mode.
+*/
+static void decode_color_block(const uint8_t* block, uint32_t texels[16], int punchthrough)
+{
+	uint16_t c0 = block[0] | block[1] << 8;
+	uint16_t c1 = block[2] | block[3] << 8;
+
+	uint32_t palette[4];
+	palette[0] = rgb565_to_ARGB32(c0);
+	palette[1] = rgb565_to_ARGB32(c1);
+
+	if (c0 > c1 || !punchthrough)
+	{
+		palette[2] = blend_ARGB32(palette[0], palette[1], 2, 1, 3);
+		palette[3] = blend_ARGB32(palette[0], palette[1], 1, 2, 3);
+	}
+	else
+	{
+		palette[2] = blend_ARGB32(palette[0], palette[1], 1, 1, 2);
+		palette[3] = 0;
+	}
+
+	uint32_t indices = block[4] | block[5] << 8 | block[6] << 16 | (uint32_t)block[7] << 24;
+
+	for (int i = 0; i < 16; i++)
+	{
+		texels[i] = palette[(indices >> (2 * i)) & 3];
+	}
+}
+
+void decode_bc1_block(const uint8_t* block, uint32_t texels[16])
+{
+	decode_color_block(block, texels, 1);
+}
+
+/*
+	BC3: an 8 byte alpha block (two endpoints, 3-bit indices) followed
+	by a BC1 color block.
+*/
+void decode_bc3_block(const uint8_t* block, uint32_t texels[16])
+{
+	uint32_t alpha0 = block[0];
+	uint32_t alpha1 = block[1];
+
+	uint32_t alphas[8];
+	alphas[0] = alpha0;
+	alphas[1] = alpha1;
+
+	if (alpha0 > alpha1)
+	{
+		for (int i = 1; i < 7; i++)
+		{
+			alphas[i + 1] = ((7 - i) * alpha0 + i * alpha1) / 7;
+		}
+	}
+	else
+	{
+		for (int i = 1; i < 5; i++)
+		{
+			alphas[i + 1] = ((5 - i) * alpha0 + i * alpha1) / 5;
+		}
+		alphas[6] = 0;
+		alphas[7] = 255;
+	}
+
+	uint64_t alpha_indices = 0;
+	for (int i = 0; i < 6; i++)
+	{
+		alpha_indices |= (uint64_t)block[2 + i] << (8 * i);
+	}
+
+	decode_color_block(block + 8, texels, 0);
+
+	for (int i = 0; i < 16; i++)
+	{
+		uint32_t alpha = alphas[(alpha_indices >> (3 * i)) & 7];
+		texels[i] = (texels[i] & 0x00FFFFFF) | alpha << 24;
+	}
+}
+
+/*
+	BC7 tables, from the format specification.
+*/
+typedef struct bc7_mode_info_t
+{
+	int subset_count;
+	int partition_bits;
+	int rotation_bits;
+	int index_selection_bits;
+	int color_bits;
+	int alpha_bits;
+	int endpoint_pbits;		// One p-bit per endpoint
+	int shared_pbits;		// One p-bit per subset
+	int index_bits;
+	int index2_bits;		// Secondary index, modes 4 and 5
+} Bc7ModeInfo;
+
+static const Bc7ModeInfo bc7_modes[8] =
+{
+	{ 3, 4, 0, 0, 4, 0, 1, 0, 3, 0 },
+	{ 2, 6, 0, 0, 6, 0, 0, 1, 3, 0 },
+	{ 3, 6, 0, 0, 5, 0, 0, 0, 2, 0 },
+	{ 2, 6, 0, 0, 7, 0, 1, 0, 2, 0 },
+	{ 1, 0, 2, 1, 5, 6, 0, 0, 2, 3 },
+	{ 1, 0, 2, 0, 7, 8, 0, 0, 2, 2 },
+	{ 1, 0, 0, 0, 7, 7, 1, 0, 4, 0 },
+	{ 2, 6, 0, 0, 5, 5, 1, 0, 2, 0 },
+};
+
+// Bit i set: pixel i belongs to subset 1
+static const uint16_t bc7_partitions2[64] =
+{
+	0xCCCC, 0x8888, 0xEEEE, 0xECC8, 0xC880, 0xFEEC, 0xFEC8, 0xEC80,
+	0xC800, 0xFFEC, 0xFE80, 0xE800, 0xFFE8, 0xFF00, 0xFFF0, 0xF000,
+	0xF710, 0x008E, 0x7100, 0x08CE, 0x008C, 0x7310, 0x3100, 0x8CCE,
+	0x088C, 0x3110, 0x6666, 0x366C, 0x17E8, 0x0FF0, 0x718E, 0x399C,
+	0xAAAA, 0xF0F0, 0x5A5A, 0x33CC, 0x3C3C, 0x55AA, 0x9696, 0xA55A,
+	0x73CE, 0x13C8, 0x324C, 0x3BDC, 0x6996, 0xC33C, 0x9966, 0x0660,
+	0x0272, 0x04E4, 0x4E40, 0x2720, 0xC936, 0x936C, 0x39C6, 0x639C,
+	0x9336, 0x9CC6, 0x817E, 0xE718, 0xCCF0, 0x0FCC, 0x7744, 0xEE22,
+};
+
+static const uint8_t bc7_partitions3[64][16] =
+{
+	{ 0, 0, 1, 1, 0, 0, 1, 1, 0, 2, 2, 1, 2, 2, 2, 2 },
+	{ 0, 0, 0, 1, 0, 0, 1, 1, 2, 2, 1, 1, 2, 2, 2, 1 },
+	{ 0, 0, 0, 0, 2, 0, 0, 1, 2, 2, 1, 1, 2, 2, 1, 1 },
+	{ 0, 2, 2, 2, 0, 0, 2, 2, 0, 0, 1, 1, 0, 1, 1, 1 },
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 2, 2, 1, 1, 2, 2 },
+	{ 0, 0, 1, 1, 0, 0, 1, 1, 0, 0, 2, 2, 0, 0, 2, 2 },
+	{ 0, 0, 2, 2, 0, 0, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1 },
+	{ 0, 0, 1, 1, 0, 0, 1, 1, 2, 2, 1, 1, 2, 2, 1, 1 },
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2 },
+	{ 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2 },
+	{ 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2 },
+	{ 0, 0, 1, 2, 0, 0, 1, 2, 0, 0, 1, 2, 0, 0, 1, 2 },
+	{ 0, 1, 1, 2, 0, 1, 1, 2, 0, 1, 1, 2, 0, 1, 1, 2 },
+	{ 0, 1, 2, 2, 0, 1, 2, 2, 0, 1, 2, 2, 0, 1, 2, 2 },
+	{ 0, 0, 1, 1, 0, 1, 1, 2, 1, 1, 2, 2, 1, 2, 2, 2 },
+	{ 0, 0, 1, 1, 2, 0, 0, 1, 2, 2, 0, 0, 2, 2, 2, 0 },
+	{ 0, 0, 0, 1, 0, 0, 1, 1, 0, 1, 1, 2, 1, 1, 2, 2 },
+	{ 0, 1, 1, 1, 0, 0, 1, 1, 2, 0, 0, 1, 2, 2, 0, 0 },
+	{ 0, 0, 0, 0, 1, 1, 2, 2, 1, 1, 2, 2, 1, 1, 2, 2 },
+	{ 0, 0, 2, 2, 0, 0, 2, 2, 0, 0, 2, 2, 1, 1, 1, 1 },
+	{ 0, 1, 1, 1, 0, 1, 1, 1, 0, 2, 2, 2, 0, 2, 2, 2 },
+	{ 0, 0, 0, 1, 0, 0, 0, 1, 2, 2, 2, 1, 2, 2, 2, 1 },
+	{ 0, 0, 0, 0, 0, 0, 1, 1, 0, 1, 2, 2, 0, 1, 2, 2 },
+	{ 0, 0, 0, 0, 1, 1, 0, 0, 2, 2, 1, 0, 2, 2, 1, 0 },
+	{ 0, 1, 2, 2, 0, 1, 2, 2, 0, 0, 1, 1, 0, 0, 0, 0 },
+	{ 0, 0, 1, 2, 0, 0, 1, 2, 1, 1, 2, 2, 2, 2, 2, 2 },
+	{ 0, 1, 1, 0, 1, 2, 2, 1, 1, 2, 2, 1, 0, 1, 1, 0 },
+	{ 0, 0, 0, 0, 0, 1, 1, 0, 1, 2, 2, 1, 1, 2, 2, 1 },
+	{ 0, 0, 2, 2, 1, 1, 0, 2, 1, 1, 0, 2, 0, 0, 2, 2 },
+	{ 0, 1, 1, 0, 0, 1, 1, 0, 2, 0, 0, 2, 2, 2, 2, 2 },
+	{ 0, 0, 1, 1, 0, 1, 2, 2, 0, 1, 2, 2, 0, 0, 1, 1 },
+	{ 0, 0, 0, 0, 2, 0, 0, 0, 2, 2, 1, 1, 2, 2, 2, 1 },
+	{ 0, 0, 0, 0, 0, 0, 0, 2, 1, 1, 2, 2, 1, 2, 2, 2 },
+	{ 0, 2, 2, 2, 0, 0, 2, 2, 0, 0, 1, 2, 0, 0, 1, 1 },
+	{ 0, 0, 1, 1, 0, 0, 1, 2, 0, 0, 2, 2, 0, 2, 2, 2 },
+	{ 0, 1, 2, 0, 0, 1, 2, 0, 0, 1, 2, 0, 0, 1, 2, 0 },
+	{ 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 0, 0, 0, 0 },
+	{ 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0 },
+	{ 0, 1, 2, 0, 2, 0, 1, 2, 1, 2, 0, 1, 0, 1, 2, 0 },
+	{ 0, 0, 1, 1, 2, 2, 0, 0, 1, 1, 2, 2, 0, 0, 1, 1 },
+	{ 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 0, 0, 0, 0, 1, 1 },
+	{ 0, 1, 0, 1, 0, 1, 0, 1, 2, 2, 2, 2, 2, 2, 2, 2 },
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 2, 1, 2, 1, 2, 1, 2, 1 },
+	{ 0, 0, 2, 2, 1, 1, 2, 2, 0, 0, 2, 2, 1, 1, 2, 2 },
+	{ 0, 0, 2, 2, 0, 0, 1, 1, 0, 0, 2, 2, 0, 0, 1, 1 },
+	{ 0, 2, 2, 0, 1, 2, 2, 1, 0, 2, 2, 0, 1, 2, 2, 1 },
+	{ 0, 1, 0, 1, 2, 2, 2, 2, 2, 2, 2, 2, 0, 1, 0, 1 },
+	{ 0, 0, 0, 0, 2, 1, 2, 1, 2, 1, 2, 1, 2, 1, 2, 1 },
+	{ 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 2, 2, 2, 2 },
+	{ 0, 2, 2, 2, 0, 1, 1, 1, 0, 2, 2, 2, 0, 1, 1, 1 },
+	{ 0, 0, 0, 2, 1, 1, 1, 2, 0, 0, 0, 2, 1, 1, 1, 2 },
+	{ 0, 0, 0, 0, 2, 1, 1, 2, 2, 1, 1, 2, 2, 1, 1, 2 },
+	{ 0, 2, 2, 2, 0, 1, 1, 1, 0, 1, 1, 1, 0, 2, 2, 2 },
+	{ 0, 0, 0, 2, 1, 1, 1, 2, 1, 1, 1, 2, 0, 0, 0, 2 },
+	{ 0, 1, 1, 0, 0, 1, 1, 0, 0, 1, 1, 0, 2, 2, 2, 2 },
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 2, 1, 1, 2, 2, 1, 1, 2 },
+	{ 0, 1, 1, 0, 0, 1, 1, 0, 2, 2, 2, 2, 2, 2, 2, 2 },
+	{ 0, 0, 2, 2, 0, 0, 1, 1, 0, 0, 1, 1, 0, 0, 2, 2 },
+	{ 0, 0, 2, 2, 1, 1, 2, 2, 1, 1, 2, 2, 0, 0, 2, 2 },
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 1, 1, 2 },
+	{ 0, 0, 0, 2, 0, 0, 0, 1, 0, 0, 0, 2, 0, 0, 0, 1 },
+	{ 0, 2, 2, 2, 1, 2, 2, 2, 0, 2, 2, 2, 1, 2, 2, 2 },
+	{ 0, 1, 0, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2 },
+	{ 0, 1, 1, 1, 2, 0, 1, 1, 2, 2, 0, 1, 2, 2, 2, 0 },
+};
+
+// Anchor pixel of subset 1 in 2 subset partitions
+static const uint8_t bc7_anchors2[64] =
+{
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15,  2,  8,  2,  2,  8,  8, 15,  2,  8,  2,  2,  8,  8,  2,  2,
+	15, 15,  6,  8,  2,  8, 15, 15,  2,  8,  2,  2,  2, 15, 15,  6,
+	 6,  2,  6,  8, 15, 15,  2,  2, 15, 15, 15, 15, 15,  2,  2, 15,
+};
+
+// Anchor pixels of subsets 1 and 2 in 3 subset partitions
+static const uint8_t bc7_anchors3_1[64] =
+{
+	 3,  3, 15, 15,  8,  3, 15, 15,  8,  8,  6,  6,  6,  5,  3,  3,
+	 3,  3,  8, 15,  3,  3,  6, 10,  5,  8,  8,  6,  8,  5, 15, 15,
+	 8, 15,  3,  5,  6, 10,  8, 15, 15,  3, 15,  5, 15, 15, 15, 15,
+	 3, 15,  5,  5,  5,  8,  5, 10,  5, 10,  8, 13, 15, 12,  3,  3,
+};
+
+static const uint8_t bc7_anchors3_2[64] =
+{
+	15,  8,  8,  3, 15, 15,  3,  8, 15, 15, 15, 15, 15, 15, 15,  8,
+	15,  8, 15,  3, 15,  8, 15,  8,  3, 15,  6, 10, 15, 15, 10,  8,
+	15,  3, 15, 10, 10,  8,  9, 10,  6, 15,  8, 15,  3,  6,  6,  8,
+	15,  3, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,  3, 15, 15,  8,
+};
+
+static const uint8_t bc7_weights2[4] = { 0, 21, 43, 64 };
+static const uint8_t bc7_weights3[8] = { 0, 9, 18, 27, 37, 46, 55, 64 };
+static const uint8_t bc7_weights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+typedef struct bit_reader_t
+{
+	const uint8_t* data;
+	unsigned int position;	// In bits, from the LSB of data[0]
+} BitReader;
+
+static unsigned int read_bits(BitReader* reader, int count)
+{
+	unsigned int result = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		unsigned int position = reader->position++;
+		unsigned int bit = (reader->data[position >> 3] >> (position & 7)) & 1;
+		result |= bit << i;
+	}
+
+	return result;
+}
+
+static uint32_t bc7_interpolate(uint32_t e0, uint32_t e1, int index, int index_bits)
+{
+	const uint8_t* weights = index_bits == 2 ? bc7_weights2 : (index_bits == 3 ? bc7_weights3 : bc7_weights4);
+	uint32_t weight = weights[index];
+
+	uint32_t result = ((64 - weight) * e0 + weight * e1 + 32) >> 6;
+
+	return result;
+}
+
+void decode_bc7_block(const uint8_t* block, uint32_t texels[16])
+{
+	int mode = 0;
+	while (mode < 8 && !(block[0] & (1 << mode)))
+	{
+		mode++;
+	}
+
+	if (mode == 8)
+	{
+		// Reserved mode, decodes to transparent black
+		for (int i = 0; i < 16; i++) texels[i] = 0;
+		return;
+	}
+
+	const Bc7ModeInfo* info = &bc7_modes[mode];
+	BitReader reader = { block, (unsigned int)mode + 1 };
+
+	int partition = read_bits(&reader, info->partition_bits);
+	int rotation = read_bits(&reader, info->rotation_bits);
+	int index_selection = read_bits(&reader, info->index_selection_bits);
+
+	// endpoints[subset][endpoint][channel], channels are r, g, b, a
+	uint32_t endpoints[3][2][4];
+
+	for (int channel = 0; channel < 3; channel++)
+	{
+		for (int subset = 0; subset < info->subset_count; subset++)
+		{
+			endpoints[subset][0][channel] = read_bits(&reader, info->color_bits);
+			endpoints[subset][1][channel] = read_bits(&reader, info->color_bits);
+		}
+	}
+
+	for (int subset = 0; subset < info->subset_count; subset++)
+	{
+		endpoints[subset][0][3] = read_bits(&reader, info->alpha_bits);
+		endpoints[subset][1][3] = read_bits(&reader, info->alpha_bits);
+	}
+
+	int color_precision = info->color_bits;
+	int alpha_precision = info->alpha_bits;
+
+	if (info->endpoint_pbits || info->shared_pbits)
+	{
+		uint32_t pbits[3][2];
+		for (int subset = 0; subset < info->subset_count; subset++)
+		{
+			if (info->endpoint_pbits)
+			{
+				pbits[subset][0] = read_bits(&reader, 1);
+				pbits[subset][1] = read_bits(&reader, 1);
+			}
+			else
+			{
+				pbits[subset][0] = pbits[subset][1] = read_bits(&reader, 1);
+			}
+		}
+
+		for (int subset = 0; subset < info->subset_count; subset++)
+		{
+			for (int e = 0; e < 2; e++)
+			{
+				for (int channel = 0; channel < 4; channel++)
+				{
+					endpoints[subset][e][channel] = endpoints[subset][e][channel] << 1 | pbits[subset][e];
+				}
+			}
+		}
+
+		color_precision++;
+		if (alpha_precision) alpha_precision++;
+	}
+
+	// Expand to 8 bits by replicating the high bits
+	for (int subset = 0; subset < info->subset_count; subset++)
+	{
+		for (int e = 0; e < 2; e++)
+		{
+			for (int channel = 0; channel < 3; channel++)
+			{
+				uint32_t value = endpoints[subset][e][channel] << (8 - color_precision);
+				endpoints[subset][e][channel] = value | (value >> color_precision);
+			}
+
+			if (alpha_precision)
+			{
+				uint32_t value = endpoints[subset][e][3] << (8 - alpha_precision);
+				endpoints[subset][e][3] = value | (value >> alpha_precision);
+			}
+			else
+			{
+				endpoints[subset][e][3] = 255;
+			}
+		}
+	}
+
+	uint8_t subsets[16];
+	for (int i = 0; i < 16; i++)
+	{
+		if (info->subset_count == 1) subsets[i] = 0;
+		else if (info->subset_count == 2) subsets[i] = (bc7_partitions2[partition] >> i) & 1;
+		else subsets[i] = bc7_partitions3[partition][i];
+	}
+
+	// Anchor pixels store their index with the top bit implicitly 0
+	uint8_t indices[16];
+	for (int i = 0; i < 16; i++)
+	{
+		int is_anchor =
+			i == 0 ||
+			(info->subset_count == 2 && i == bc7_anchors2[partition]) ||
+			(info->subset_count == 3 && (i == bc7_anchors3_1[partition] || i == bc7_anchors3_2[partition]));
+
+		indices[i] = read_bits(&reader, info->index_bits - is_anchor);
+	}
+
+	uint8_t indices2[16] = { 0 };
+	if (info->index2_bits)
+	{
+		for (int i = 0; i < 16; i++)
+		{
+			indices2[i] = read_bits(&reader, info->index2_bits - (i == 0));
+		}
+	}
+
+	for (int i = 0; i < 16; i++)
+	{
+		const uint32_t* e0 = endpoints[subsets[i]][0];
+		const uint32_t* e1 = endpoints[subsets[i]][1];
+
+		int color_index = indices[i];
+		int color_index_bits = info->index_bits;
+		int alpha_index = indices[i];
+		int alpha_index_bits = info->index_bits;
+
+		if (info->index2_bits)
+		{
+			if (index_selection)
+			{
+				color_index = indices2[i];
+				color_index_bits = info->index2_bits;
+			}
+			else
+			{
+				alpha_index = indices2[i];
+				alpha_index_bits = info->index2_bits;
+			}
+		}
+
+		uint32_t r = bc7_interpolate(e0[0], e1[0], color_index, color_index_bits);
+		uint32_t g = bc7_interpolate(e0[1], e1[1], color_index, color_index_bits);
+		uint32_t b = bc7_interpolate(e0[2], e1[2], color_index, color_index_bits);
+		uint32_t a = bc7_interpolate(e0[3], e1[3], alpha_index, alpha_index_bits);
+
+		uint32_t swap = a;
+		switch (rotation)
+		{
+			case 1: a = r; r = swap; break;
+			case 2: a = g; g = swap; break;
+			case 3: a = b; b = swap; break;
+		}
+
+		texels[i] = pack_ARGB32(a, r, g, b);
+	}
+}
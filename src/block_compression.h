@@ -0,0 +1,23 @@
+#ifndef BLOCK_COMPRESSION_H
+#define BLOCK_COMPRESSION_H
+
+#include <stdint.h>
+
+/*
+	Decoders for 4x4 block compressed texels.
+
+	Every decoder writes 16 texels in the ARGB32 layout used by
+	textures and the frame buffer, row by row as the block stores
+	them: texels[y * 4 + x].
+*/
+
+#define BC_BLOCK_DIM 4
+#define BC1_BLOCK_BYTES 8
+#define BC3_BLOCK_BYTES 16
+#define BC7_BLOCK_BYTES 16
+
+void decode_bc1_block(const uint8_t* block, uint32_t texels[16]);
+void decode_bc3_block(const uint8_t* block, uint32_t texels[16]);
+void decode_bc7_block(const uint8_t* block, uint32_t texels[16]);
+
+#endif // !BLOCK_COMPRESSION_H
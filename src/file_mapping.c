@@ -0,0 +1,114 @@
+#include "file_mapping.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/*
+	@returns: 1 on success, 0 if the file can't be opened or mapped
+*/
+int map_file(const char* path, FileMapping* mapping)
+{
+	mapping->data = NULL;
+	mapping->size = 0;
+
+#if defined(_WIN32) || defined(_WIN64)
+	mapping->file_handle = NULL;
+	mapping->mapping_handle = NULL;
+
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return 0;
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size))
+	{
+		CloseHandle(file);
+		return 0;
+	}
+
+	mapping->file_handle = file;
+	mapping->size = (size_t)size.QuadPart;
+
+	// Empty files can't be mapped
+	if (mapping->size == 0)
+	{
+		return 1;
+	}
+
+	HANDLE file_mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (file_mapping == NULL)
+	{
+		unmap_file(mapping);
+		return 0;
+	}
+	mapping->mapping_handle = file_mapping;
+
+	mapping->data = (const char*)MapViewOfFile(file_mapping, FILE_MAP_READ, 0, 0, 0);
+	if (mapping->data == NULL)
+	{
+		unmap_file(mapping);
+		return 0;
+	}
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		return 0;
+	}
+
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0)
+	{
+		close(fd);
+		return 0;
+	}
+
+	mapping->size = (size_t)file_stat.st_size;
+
+	// Empty files can't be mapped
+	if (mapping->size > 0)
+	{
+		void* data = mmap(NULL, mapping->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED)
+		{
+			close(fd);
+			mapping->size = 0;
+			return 0;
+		}
+
+		madvise(data, mapping->size, MADV_SEQUENTIAL);
+		mapping->data = (const char*)data;
+	}
+
+	// The mapping stays valid after the descriptor is closed
+	close(fd);
+#endif
+
+	return 1;
+}
+
+void unmap_file(FileMapping* mapping)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	if (mapping->data) UnmapViewOfFile(mapping->data);
+	if (mapping->mapping_handle) CloseHandle(mapping->mapping_handle);
+	if (mapping->file_handle) CloseHandle(mapping->file_handle);
+
+	mapping->file_handle = NULL;
+	mapping->mapping_handle = NULL;
+#else
+	if (mapping->data) munmap((void*)mapping->data, mapping->size);
+#endif
+
+	mapping->data = NULL;
+	mapping->size = 0;
+}
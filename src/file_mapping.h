@@ -0,0 +1,24 @@
+#ifndef FILE_MAPPING_H
+#define FILE_MAPPING_H
+
+#include <stddef.h>
+
+/*
+	Read-only memory mapping of a whole file.  The pages are loaded by
+	the OS as they are touched, nothing is copied into a user buffer.
+*/
+typedef struct file_mapping_t
+{
+	const char* data;	// NULL for an empty file
+	size_t size;
+
+#if defined(_WIN32) || defined(_WIN64)
+	void* file_handle;
+	void* mapping_handle;
+#endif
+} FileMapping;
+
+int map_file(const char* path, FileMapping* mapping);
+void unmap_file(FileMapping* mapping);
+
+#endif // !FILE_MAPPING_H
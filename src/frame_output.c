@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame_output.h"
+#include "png_writer.h"
+#include "qoi_writer.h"
+
+FrameOutputFormat frame_output_format_from_path(const char* filename)
+{
+	FrameOutputFormat result = FRAME_OUTPUT_TGA_RLE;
+
+	const char* extension = strrchr(filename, '.');
+	if (extension)
+	{
+		if (strcmp(extension, ".png") == 0 || strcmp(extension, ".PNG") == 0)
+		{
+			result = FRAME_OUTPUT_PNG;
+		}
+		else if (strcmp(extension, ".qoi") == 0 || strcmp(extension, ".QOI") == 0)
+		{
+			result = FRAME_OUTPUT_QOI;
+		}
+	}
+
+	return result;
+}
+
+static void write_file(FrameOutputFormat format, const FrameBuffer* buffer, const char* filename)
+{
+	TGA_ImageDataType data_type = buffer->bytes_per_pixel == 4 ? RGBA : RGB;
+	const unsigned char* pixels = (const unsigned char*)buffer->memory;
+
+	if (format == FRAME_OUTPUT_AUTO)
+	{
+		format = frame_output_format_from_path(filename);
+	}
+
+	int written = 1;
+
+	switch (format)
+	{
+	case FRAME_OUTPUT_AUTO:
+	case FRAME_OUTPUT_TGA_RLE:
+		written = write_tga_image_rle(filename, buffer->width, buffer->height, data_type, pixels);
+		break;
+	case FRAME_OUTPUT_TGA:
+		written = write_tga_image(filename, buffer->width, buffer->height, data_type, pixels);
+		break;
+	case FRAME_OUTPUT_QOI:
+		written = write_qoi_image(filename, buffer->width, buffer->height, data_type, pixels);
+		break;
+	case FRAME_OUTPUT_PNG:
+		written = write_png_image(filename, buffer->width, buffer->height, data_type, pixels);
+		break;
+	}
+
+	if (!written)
+	{
+		fprintf(stderr, "Can't write %s\n", filename);
+	}
+}
+
+/*
+	Writes a slot in the writing state, to a file or the stream.
+
+	@returns: the state the slot is left in
+*/
+static FrameOutputState write_frame(FrameOutput* output, FrameOutputSlot* slot)
+{
+	FrameOutputState result = FRAME_FREE;
+
+	const FrameBuffer* frame = &slot->buffer;
+	if (!frame_buffer_is_linear(frame))
+	{
+		linearize_frame_buffer(frame, output->linear.memory);
+		frame = &output->linear;
+	}
+
+	if (!output->has_stream)
+	{
+		write_file(output->format, frame, slot->filename);
+	}
+	else if (write_stream_frame(&output->stream, frame) == FRAME_STREAM_SPLICED)
+	{
+		result = FRAME_SPLICED;
+	}
+
+	return result;
+}
+
+/*
+	Called with the mutex held once a slot has been written.  A frame
+	written after a spliced one pushed it out of the pipe, so the
+	spliced slot is free again.
+*/
+static void finish_frame(FrameOutput* output, FrameOutputSlot* slot, FrameOutputState state)
+{
+	if (output->spliced)
+	{
+		output->spliced->state = FRAME_FREE;
+		output->spliced = NULL;
+	}
+
+	slot->state = state;
+	if (state == FRAME_SPLICED)
+	{
+		output->spliced = slot;
+	}
+
+	broadcast_condition(&output->changed);
+}
+
+/*
+	@returns: the queued slot submitted first, or NULL
+*/
+static FrameOutputSlot* find_queued_slot(FrameOutput* output)
+{
+	FrameOutputSlot* result = NULL;
+
+	for (int i = 0; i < output->buffer_count; i++)
+	{
+		FrameOutputSlot* slot = &output->slots[i];
+		if (slot->state == FRAME_QUEUED && (!result || slot->sequence - result->sequence > 0x80000000u))
+		{
+			result = slot;
+		}
+	}
+
+	return result;
+}
+
+static void writer_main(void* data)
+{
+	FrameOutput* output = (FrameOutput*)data;
+
+	lock_mutex(&output->mutex);
+
+	for (;;)
+	{
+		FrameOutputSlot* slot = find_queued_slot(output);
+
+		if (!slot)
+		{
+			if (output->quit) break;
+
+			wait_condition(&output->changed, &output->mutex);
+			continue;
+		}
+
+		slot->state = FRAME_WRITING;
+		unlock_mutex(&output->mutex);
+
+		FrameOutputState state = write_frame(output, slot);
+
+		lock_mutex(&output->mutex);
+		finish_frame(output, slot, state);
+	}
+
+	unlock_mutex(&output->mutex);
+}
+
+/*
+	stream is NULL for output to files.
+*/
+static FrameOutput* init_frame_output(
+	int width,
+	int height,
+	int bytes_per_pixel,
+	FrameBufferLayout layout,
+	DepthFormat depth_format,
+	int sample_count,
+	int buffer_count,
+	FrameOutputFormat format,
+	const FrameStream* stream)
+{
+	FrameOutput* result = (FrameOutput*)calloc(1, sizeof(FrameOutput));
+
+	result->format = format;
+	result->buffer_count = buffer_count;
+
+	if (stream)
+	{
+		result->stream = *stream;
+		result->has_stream = 1;
+	}
+
+	for (int i = 0; i < buffer_count; i++)
+	{
+		init_frame_buffer_format(&result->slots[i].buffer, width, height, bytes_per_pixel, layout, depth_format, sample_count);
+		result->slots[i].state = FRAME_FREE;
+	}
+
+	if (!frame_buffer_is_linear(&result->slots[0].buffer))
+	{
+		result->linear.width = width;
+		result->linear.height = height;
+		result->linear.bytes_per_pixel = bytes_per_pixel;
+		result->linear.layout = FRAME_BUFFER_LINEAR;
+		result->linear.memory = malloc((size_t)width * height * bytes_per_pixel);
+	}
+
+	init_mutex(&result->mutex);
+	init_condition(&result->changed);
+
+	result->has_writer = start_thread(&result->writer, writer_main, result);
+
+	return result;
+}
+
+FrameOutput* create_frame_output(
+	int width,
+	int height,
+	int bytes_per_pixel,
+	FrameBufferLayout layout,
+	DepthFormat depth_format,
+	int sample_count,
+	FrameOutputFormat format)
+{
+	return init_frame_output(width, height, bytes_per_pixel, layout, depth_format, sample_count, FRAME_OUTPUT_BUFFER_COUNT, format, NULL);
+}
+
+FrameOutput* create_frame_stream_output(
+	const char* path,
+	int width,
+	int height,
+	int bytes_per_pixel,
+	FrameBufferLayout layout,
+	DepthFormat depth_format,
+	int sample_count,
+	FrameStreamFormat format,
+	int frames_per_second)
+{
+	FrameStream stream;
+	if (!open_frame_stream(&stream, path, width, height, bytes_per_pixel, format, frames_per_second))
+	{
+		return NULL;
+	}
+
+	// The linearized copy is reused for every frame, the pipe can't keep it
+	if (layout != FRAME_BUFFER_LINEAR || sample_count > 1)
+	{
+		stream.use_splice = 0;
+	}
+
+	int buffer_count = stream.use_splice ? FRAME_OUTPUT_SPLICE_BUFFER_COUNT : FRAME_OUTPUT_BUFFER_COUNT;
+
+	return init_frame_output(width, height, bytes_per_pixel, layout, depth_format, sample_count, buffer_count, FRAME_OUTPUT_AUTO, &stream);
+}
+
+void free_frame_output(FrameOutput* output)
+{
+	if (!output) return;
+
+	lock_mutex(&output->mutex);
+	output->quit = 1;
+	broadcast_condition(&output->changed);
+	unlock_mutex(&output->mutex);
+
+	if (output->has_writer)
+	{
+		join_thread(&output->writer);
+	}
+
+	// Waits for the reader to take the spliced pages before they are freed
+	if (output->has_stream)
+	{
+		close_frame_stream(&output->stream);
+	}
+
+	for (int i = 0; i < output->buffer_count; i++)
+	{
+		free_frame_buffer(&output->slots[i].buffer);
+	}
+
+	free(output->linear.memory);
+
+	destroy_condition(&output->changed);
+	destroy_mutex(&output->mutex);
+
+	free(output);
+}
+
+FrameBuffer* acquire_output_frame(FrameOutput* output)
+{
+	FrameOutputSlot* slot = NULL;
+
+	lock_mutex(&output->mutex);
+
+	while (!slot)
+	{
+		for (int i = 0; i < output->buffer_count && !slot; i++)
+		{
+			if (output->slots[i].state == FRAME_FREE)
+			{
+				slot = &output->slots[i];
+			}
+		}
+
+		if (!slot)
+		{
+			wait_condition(&output->changed, &output->mutex);
+		}
+	}
+
+	slot->state = FRAME_RENDERING;
+
+	unlock_mutex(&output->mutex);
+
+	FrameBuffer* result = &slot->buffer;
+	clear_z_buffer(result);
+
+	return result;
+}
+
+void submit_output_frame(FrameOutput* output, FrameBuffer* buffer, const char* filename)
+{
+	FrameOutputSlot* slot = (FrameOutputSlot*)buffer;
+	assert(slot >= output->slots && slot < output->slots + output->buffer_count);
+	assert(slot->state == FRAME_RENDERING);
+
+	snprintf(slot->filename, sizeof(slot->filename), "%s", filename ? filename : "");
+
+	if (!output->has_writer)
+	{
+		FrameOutputState state = write_frame(output, slot);
+
+		lock_mutex(&output->mutex);
+		finish_frame(output, slot, state);
+		unlock_mutex(&output->mutex);
+		return;
+	}
+
+	lock_mutex(&output->mutex);
+
+	slot->sequence = output->next_sequence++;
+	slot->state = FRAME_QUEUED;
+	broadcast_condition(&output->changed);
+
+	unlock_mutex(&output->mutex);
+}
+
+void flush_frame_output(FrameOutput* output)
+{
+	lock_mutex(&output->mutex);
+
+	for (;;)
+	{
+		int pending = 0;
+		for (int i = 0; i < output->buffer_count; i++)
+		{
+			FrameOutputState state = output->slots[i].state;
+			pending |= state == FRAME_QUEUED || state == FRAME_WRITING;
+		}
+
+		if (!pending) break;
+
+		wait_condition(&output->changed, &output->mutex);
+	}
+
+	unlock_mutex(&output->mutex);
+}
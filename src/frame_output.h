@@ -0,0 +1,134 @@
+#ifndef FRAME_OUTPUT_H
+#define FRAME_OUTPUT_H
+
+#include "render.h"
+#include "frame_stream.h"
+#include "thread.h"
+
+/*
+	Asynchronous frame output.  Frames are rendered into buffers owned
+	by the output and handed to a writer thread, which encodes and
+	saves them while the next frame renders into another buffer.  A
+	sequence then takes max(render, write) per frame instead of the
+	sum of both.
+
+	acquire_output_frame blocks only when every buffer is still queued
+	or being written, i.e. when the disk can't keep up.
+
+	Frames can also go to a FrameStream instead of files.  A spliced
+	stream keeps a third buffer, since the pipe holds on to the last
+	frame written until the next one has gone out.
+*/
+
+#define FRAME_OUTPUT_BUFFER_COUNT 2
+#define FRAME_OUTPUT_SPLICE_BUFFER_COUNT 3
+#define FRAME_OUTPUT_MAX_PATH 260
+
+typedef enum frame_output_format_t
+{
+	FRAME_OUTPUT_AUTO,		// Chosen per frame from the file extension
+	FRAME_OUTPUT_TGA,
+	FRAME_OUTPUT_TGA_RLE,
+	FRAME_OUTPUT_QOI,
+	FRAME_OUTPUT_PNG
+} FrameOutputFormat;
+
+typedef enum frame_output_state_t
+{
+	FRAME_FREE,
+	FRAME_RENDERING,
+	FRAME_QUEUED,
+	FRAME_WRITING,
+	FRAME_SPLICED			// Written, but still referenced by a pipe
+} FrameOutputState;
+
+typedef struct frame_output_slot_t
+{
+	FrameBuffer buffer;
+	FrameOutputState state;
+	char filename[FRAME_OUTPUT_MAX_PATH];
+	unsigned int sequence;		// Submission order, frames are written in it
+} FrameOutputSlot;
+
+typedef struct frame_output_t
+{
+	FrameOutputFormat format;
+	FrameOutputSlot slots[FRAME_OUTPUT_SPLICE_BUFFER_COUNT];
+	int buffer_count;
+	unsigned int next_sequence;
+
+	FrameBuffer linear;		// Tiled frames are linearized here to be written
+
+	FrameStream stream;
+	int has_stream;			// Frames go to stream rather than files
+	FrameOutputSlot* spliced;	// Slot the stream still references
+	int quit;
+
+	Mutex mutex;
+	Condition changed;		// Any slot changed state, or quit was set
+	Thread writer;
+	int has_writer;			// Else frames are written on submit
+} FrameOutput;
+
+/*
+	.png, .qoi, and RLE TGA for anything else.
+*/
+FrameOutputFormat frame_output_format_from_path(const char* filename);
+
+/*
+	layout, depth_format and sample_count are the ones of the buffers
+	handed out for rendering, frames are always written linear and
+	resolved.
+*/
+FrameOutput* create_frame_output(
+	int width,
+	int height,
+	int bytes_per_pixel,
+	FrameBufferLayout layout,
+	DepthFormat depth_format,
+	int sample_count,
+	FrameOutputFormat format);
+
+/*
+	Output to open_frame_stream(path, ...), the file names given on
+	submit are ignored.  Tiled and multisampled frames are never
+	spliced, they go out from the linearized copy.
+
+	@returns: NULL if the stream can't be opened
+*/
+FrameOutput* create_frame_stream_output(
+	const char* path,
+	int width,
+	int height,
+	int bytes_per_pixel,
+	FrameBufferLayout layout,
+	DepthFormat depth_format,
+	int sample_count,
+	FrameStreamFormat format,
+	int frames_per_second);
+
+/*
+	Writes all frames still queued, stops the writer thread and frees
+	the buffers.
+*/
+void free_frame_output(FrameOutput* output);
+
+/*
+	Returns a buffer to render the next frame into, with its z-buffer
+	cleared.  The color is left as the writer last saw it.
+*/
+FrameBuffer* acquire_output_frame(FrameOutput* output);
+
+/*
+	Queues a buffer from acquire_output_frame to be saved as filename,
+	or NULL for a stream.  The buffer must not be touched again until it
+	is acquired anew.
+*/
+void submit_output_frame(FrameOutput* output, FrameBuffer* buffer, const char* filename);
+
+/*
+	Blocks until every submitted frame is on disk.
+*/
+void flush_frame_output(FrameOutput* output);
+
+#endif // !FRAME_OUTPUT_H
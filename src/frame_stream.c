@@ -0,0 +1,364 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		// vmsplice, F_GETPIPE_SZ
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame_stream.h"
+#include "thread.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#endif
+
+#if defined(IOV_MAX)
+#define FRAME_STREAM_MAX_IOV IOV_MAX
+#else
+#define FRAME_STREAM_MAX_IOV 1024
+#endif
+
+/*
+	A range of bytes to output, an iovec on POSIX.
+*/
+typedef struct stream_span_t
+{
+	const unsigned char* data;
+	size_t size;
+} StreamSpan;
+
+#if defined(_WIN32) || defined(_WIN64)
+
+static int write_spans(FrameStream* stream, StreamSpan* spans, int count, int splice)
+{
+	(void)splice;
+
+	for (int i = 0; i < count; i++)
+	{
+		const unsigned char* data = spans[i].data;
+		size_t size = spans[i].size;
+
+		while (size > 0)
+		{
+			unsigned int chunk = size > (1u << 30) ? (1u << 30) : (unsigned int)size;
+			int written = _write(stream->fd, data, chunk);
+			if (written <= 0)
+			{
+				return 0;
+			}
+			data += written;
+			size -= written;
+		}
+	}
+
+	return 1;
+}
+
+#else
+
+/*
+	Writes spans in order with as few system calls as possible,
+	resuming after partial writes.
+*/
+static int write_spans(FrameStream* stream, StreamSpan* spans, int count, int splice)
+{
+	struct iovec iov[FRAME_STREAM_MAX_IOV];
+	int first = 0;
+
+	while (first < count)
+	{
+		int iov_count = count - first;
+		if (iov_count > FRAME_STREAM_MAX_IOV) iov_count = FRAME_STREAM_MAX_IOV;
+
+		for (int i = 0; i < iov_count; i++)
+		{
+			iov[i].iov_base = (void*)spans[first + i].data;
+			iov[i].iov_len = spans[first + i].size;
+		}
+
+		ssize_t written;
+#if defined(__linux__)
+		if (splice)
+		{
+			written = vmsplice(stream->fd, iov, iov_count, 0);
+		}
+		else
+#endif
+		{
+			written = writev(stream->fd, iov, iov_count);
+		}
+
+		if (written < 0)
+		{
+			if (errno == EINTR) continue;
+			return 0;
+		}
+
+		// Skip what went out, the rest of a partial span is retried
+		while (first < count && (size_t)written >= spans[first].size)
+		{
+			written -= spans[first].size;
+			first++;
+		}
+		if (first < count)
+		{
+			spans[first].data += written;
+			spans[first].size -= written;
+		}
+	}
+
+	return 1;
+}
+
+#endif
+
+int open_frame_stream(
+	FrameStream* stream,
+	const char* path,
+	int width,
+	int height,
+	int bytes_per_pixel,
+	FrameStreamFormat format,
+	int frames_per_second)
+{
+	memset(stream, 0, sizeof(FrameStream));
+	stream->format = format;
+	stream->width = width;
+	stream->height = height;
+	stream->bytes_per_pixel = bytes_per_pixel;
+	stream->frames_per_second = frames_per_second > 0 ? frames_per_second : 30;
+	stream->fd = -1;
+
+	if (strcmp(path, "-") == 0)
+	{
+#if defined(_WIN32) || defined(_WIN64)
+		stream->fd = _fileno(stdout);
+		_setmode(stream->fd, _O_BINARY);
+#else
+		stream->fd = STDOUT_FILENO;
+#endif
+		fflush(stdout);
+	}
+	else
+	{
+#if defined(_WIN32) || defined(_WIN64)
+		stream->fd = _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, 0644);
+#else
+		stream->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+		stream->owns_fd = 1;
+	}
+
+	if (stream->fd < 0)
+	{
+		return 0;
+	}
+
+#if !defined(_WIN32) && !defined(_WIN64)
+	// A reader that goes away is reported as a failed write
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+#if defined(__linux__)
+	// Spliced pages stay shared with the pipe, which is only safe to
+	// track while a frame fills the whole pipe
+	struct stat status;
+	if (format == FRAME_STREAM_RAW && fstat(stream->fd, &status) == 0 && S_ISFIFO(status.st_mode))
+	{
+		int pipe_size = fcntl(stream->fd, F_GETPIPE_SZ);
+		size_t frame_size = (size_t)width * height * bytes_per_pixel;
+		stream->use_splice = pipe_size > 0 && (size_t)pipe_size <= frame_size;
+	}
+#endif
+
+	if (format == FRAME_STREAM_Y4M)
+	{
+		size_t luma = (size_t)width * height;
+		size_t chroma = (size_t)((width + 1) / 2) * ((height + 1) / 2);
+		stream->yuv = (unsigned char*)malloc(luma + 2 * chroma);
+
+		// C420jpeg only gives the chroma siting, readers assume limited
+		// range unless told otherwise
+		char header[128];
+		int length = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg XCOLORRANGE=FULL\n",
+			width, height, stream->frames_per_second);
+
+		StreamSpan span = { (const unsigned char*)header, (size_t)length };
+		if (!write_spans(stream, &span, 1, 0))
+		{
+			close_frame_stream(stream);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+void close_frame_stream(FrameStream* stream)
+{
+#if defined(__linux__)
+	// The reader may still be reading spliced pages, the caller frees
+	// them after this returns
+	if (stream->use_splice)
+	{
+		int pending = 0;
+		while (ioctl(stream->fd, FIONREAD, &pending) == 0 && pending > 0)
+		{
+			struct pollfd poll_fd = { stream->fd, 0, 0 };
+			if (poll(&poll_fd, 1, 10) > 0 && (poll_fd.revents & (POLLERR | POLLHUP)))
+			{
+				break;	// No reader left
+			}
+		}
+	}
+#endif
+
+	if (stream->owns_fd && stream->fd >= 0)
+	{
+#if defined(_WIN32) || defined(_WIN64)
+		_close(stream->fd);
+#else
+		close(stream->fd);
+#endif
+	}
+
+	free(stream->yuv);
+
+	stream->fd = -1;
+	stream->yuv = NULL;
+}
+
+typedef struct yuv_conversion_t
+{
+	const FrameStream* stream;
+	const unsigned char* pixels;
+	unsigned char* y_plane;
+	unsigned char* u_plane;
+	unsigned char* v_plane;
+} YuvConversion;
+
+static unsigned char clamp_byte(int value)
+{
+	return (unsigned char)(value > 255 ? 255 : value);
+}
+
+/*
+	Converts the two luma rows over chroma row index, top-down, with
+	BT.601 full range weights in 8.8 fixed point.  Chroma is taken from
+	the average color of each 2x2 block.
+*/
+static void convert_yuv_rows(void* data, int index)
+{
+	YuvConversion* conversion = (YuvConversion*)data;
+	const FrameStream* stream = conversion->stream;
+
+	int width = stream->width;
+	int height = stream->height;
+	int bytes = stream->bytes_per_pixel;
+	int chroma_width = (width + 1) / 2;
+
+	const unsigned char* rows[2];
+	for (int i = 0; i < 2; i++)
+	{
+		int y = 2 * index + i;
+		if (y >= height) y = height - 1;
+
+		rows[i] = conversion->pixels + (size_t)(height - 1 - y) * width * bytes;
+
+		if (2 * index + i < height)
+		{
+			unsigned char* out = conversion->y_plane + (size_t)y * width;
+			for (int x = 0; x < width; x++)
+			{
+				const unsigned char* p = rows[i] + (size_t)x * bytes;
+				out[x] = (unsigned char)((77 * p[2] + 150 * p[1] + 29 * p[0] + 128) >> 8);
+			}
+		}
+	}
+
+	unsigned char* u = conversion->u_plane + (size_t)index * chroma_width;
+	unsigned char* v = conversion->v_plane + (size_t)index * chroma_width;
+
+	for (int cx = 0; cx < chroma_width; cx++)
+	{
+		int x0 = 2 * cx;
+		int x1 = x0 + 1 < width ? x0 + 1 : x0;
+
+		int r = 0, g = 0, b = 0;
+		for (int i = 0; i < 2; i++)
+		{
+			const unsigned char* p0 = rows[i] + (size_t)x0 * bytes;
+			const unsigned char* p1 = rows[i] + (size_t)x1 * bytes;
+			r += p0[2] + p1[2];
+			g += p0[1] + p1[1];
+			b += p0[0] + p1[0];
+		}
+		r = (r + 2) >> 2;
+		g = (g + 2) >> 2;
+		b = (b + 2) >> 2;
+
+		u[cx] = clamp_byte((-43 * r - 85 * g + 128 * b + 32896) >> 8);
+		v[cx] = clamp_byte((128 * r - 107 * g - 21 * b + 32896) >> 8);
+	}
+}
+
+FrameStreamResult write_stream_frame(FrameStream* stream, const FrameBuffer* buffer)
+{
+	assert(buffer->width == stream->width && buffer->height == stream->height);
+	assert(buffer->bytes_per_pixel == stream->bytes_per_pixel);
+
+	FrameStreamResult result = FRAME_STREAM_ERROR;
+	const unsigned char* pixels = (const unsigned char*)buffer->memory;
+
+	if (stream->format == FRAME_STREAM_RAW)
+	{
+		size_t row_bytes = (size_t)stream->width * stream->bytes_per_pixel;
+		StreamSpan* spans = (StreamSpan*)malloc(stream->height * sizeof(StreamSpan));
+
+		for (int y = 0; y < stream->height; y++)
+		{
+			spans[y].data = pixels + (size_t)(stream->height - 1 - y) * row_bytes;
+			spans[y].size = row_bytes;
+		}
+
+		if (write_spans(stream, spans, stream->height, stream->use_splice))
+		{
+			result = stream->use_splice ? FRAME_STREAM_SPLICED : FRAME_STREAM_WRITTEN;
+		}
+
+		free(spans);
+	}
+	else
+	{
+		size_t luma = (size_t)stream->width * stream->height;
+		size_t chroma = (size_t)((stream->width + 1) / 2) * ((stream->height + 1) / 2);
+
+		YuvConversion conversion = { stream, pixels, stream->yuv, stream->yuv + luma, stream->yuv + luma + chroma };
+		parallel_for((stream->height + 1) / 2, convert_yuv_rows, &conversion);
+
+		static const char frame_header[] = "FRAME\n";
+		StreamSpan spans[2] = {
+			{ (const unsigned char*)frame_header, sizeof(frame_header) - 1 },
+			{ stream->yuv, luma + 2 * chroma }
+		};
+
+		if (write_spans(stream, spans, 2, 0))
+		{
+			result = FRAME_STREAM_WRITTEN;
+		}
+	}
+
+	return result;
+}
@@ -0,0 +1,78 @@
+#ifndef FRAME_STREAM_H
+#define FRAME_STREAM_H
+
+#include "render.h"
+
+/*
+	Continuous frame output to stdout, a named pipe or a file, for a
+	video encoder to read as it goes:
+
+	- FRAME_STREAM_RAW: bare top-down frames, B, G, R, A or B, G, R as
+	  in the frame buffer, e.g. for ffmpeg -f rawvideo -pix_fmt bgra.
+	- FRAME_STREAM_Y4M: YUV4MPEG2, 4:2:0 full range BT.601.
+
+	Raw rows go out straight from the frame buffer in one writev, in
+	reverse order since the buffer is bottom-up.  On Linux pipes they
+	are vmspliced instead, which hands the pages themselves to the
+	pipe: the buffer then must not change until the reader consumed
+	it, see FRAME_STREAM_SPLICED.  Y4M needs one color conversion pass,
+	done in parallel, then writes the planes the same way.
+*/
+
+typedef enum frame_stream_format_t
+{
+	FRAME_STREAM_RAW,
+	FRAME_STREAM_Y4M
+} FrameStreamFormat;
+
+typedef enum frame_stream_result_t
+{
+	FRAME_STREAM_ERROR,
+	FRAME_STREAM_WRITTEN,		// The buffer can be reused at once
+	FRAME_STREAM_SPLICED		// The pipe still references the buffer
+} FrameStreamResult;
+
+typedef struct frame_stream_t
+{
+	FrameStreamFormat format;
+	int width;
+	int height;
+	int bytes_per_pixel;
+	int frames_per_second;
+
+	int fd;
+	int owns_fd;				// Not stdout
+	int use_splice;				// Linux pipe at least as small as a frame
+
+	unsigned char* yuv;			// Y4M planes of the current frame
+} FrameStream;
+
+/*
+	Opens path for streaming, "-" is stdout.  A named pipe blocks here
+	until a reader opens it.
+
+	@returns: 0 if path can't be opened
+*/
+int open_frame_stream(
+	FrameStream* stream,
+	const char* path,
+	int width,
+	int height,
+	int bytes_per_pixel,
+	FrameStreamFormat format,
+	int frames_per_second);
+
+/*
+	Waits until a pipe has handed every spliced frame to its reader,
+	then closes the stream.
+*/
+void close_frame_stream(FrameStream* stream);
+
+/*
+	A FRAME_STREAM_SPLICED buffer is released once a later frame has
+	been written completely: the pipe can't hold more than one frame,
+	so the older one has been read by then.
+*/
+FrameStreamResult write_stream_frame(FrameStream* stream, const FrameBuffer* buffer);
+
+#endif // !FRAME_STREAM_H
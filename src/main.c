@@ -1,11 +1,27 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "render.h"
+#include "frame_output.h"
+#include "shared_frame_buffer.h"
 
 FILE* logfile;
 
-int main()
+/*
+	Usage: Software-Renderer [output]
+
+	output is an image file (.tga, .png, .qoi), or a raw (.raw, "-" for
+	stdout) or Y4M (.y4m) stream, which may be a named pipe, or
+	shm:/name to render into a shared memory segment.
+*/
+int main(int argc, char** argv)
 {
+	const char* output_path = argc > 1 ? argv[1] : "out_image.tga";
+	const char* extension = strrchr(output_path, '.');
+	int is_y4m = extension && strcmp(extension, ".y4m") == 0;
+	int is_raw = strcmp(output_path, "-") == 0 || (extension && strcmp(extension, ".raw") == 0);
+	int is_shared = strncmp(output_path, "shm:", 4) == 0;
+
 	logfile = fopen("log.txt", "w+");
 
 	Model* floor_model = load_model(
@@ -35,13 +51,14 @@ int main()
 	int width = 800;
 	int height = 800;
 	int bytes_per_pixel = 4;
+	int sample_count = 1;		// 2, 4 or 8 for multisampled anti-aliasing
 
+	// Frames render into the buffers of the output, the context has none
 	GraphicsContext g_ctx = { 0 };
-	init_graphics_context(
+	init_graphics_context_no_buffer(
 		&g_ctx,
 		width,
 		height,
-		bytes_per_pixel,		
 		Vec3(0.5f, 0.5f, 2.0f),		// camera position
 		Vec3(0.0f, 0.0f, 0.0f),		// camera target
 		Vec3(0.0f, 1.0f, 0.0f)		// world up
@@ -55,6 +72,40 @@ int main()
 	scene.models[0] = suzanne_model;
 	scene.light = light;
 
+	// The frame renders into a buffer of the output queue, which
+	// writes it on its own thread, in the format of the file extension,
+	// or straight into shared memory.  Frames for files and streams are
+	// tiled and resolved on output, consumers of shared memory expect
+	// linear, single sampled ones
+	FrameOutput* output = NULL;
+	SharedFrameBuffer shared = { 0 };
+	int opened;
+
+	if (is_shared)
+	{
+		opened = create_shared_frame_buffer(&shared, output_path + 4, width, height, bytes_per_pixel);
+	}
+	else if (is_y4m || is_raw)
+	{
+		output = create_frame_stream_output(
+			output_path, width, height, bytes_per_pixel, FRAME_BUFFER_TILED, DEPTH_FLOAT32, sample_count,
+			is_y4m ? FRAME_STREAM_Y4M : FRAME_STREAM_RAW, 30);
+		opened = output != NULL;
+	}
+	else
+	{
+		output = create_frame_output(width, height, bytes_per_pixel, FRAME_BUFFER_TILED, DEPTH_FLOAT32, sample_count, FRAME_OUTPUT_AUTO);
+		opened = output != NULL;
+	}
+
+	if (!opened)
+	{
+		fprintf(stderr, "Can't open %s\n", output_path);
+		return 1;
+	}
+
+	g_ctx.frame_buffer = is_shared ? acquire_shared_frame(&shared) : acquire_output_frame(output);
+
 	vec3 light_blue_color = { 0.23f, 0.65f, 0.82f };
 	render_buffer_fill(g_ctx.frame_buffer, width, height, light_blue_color);
 
@@ -64,19 +115,25 @@ int main()
 	
 	//render_coordinate_frame(&g_ctx);
 
-	write_tga_image(
-		"out_image.tga",
-		width,
-		height,
-		RGBA,
-		(unsigned char*)g_ctx.frame_buffer->memory
-	);
+	if (is_shared)
+	{
+		// The segment outlives us for consumers, until unlinked
+		publish_shared_frame(&shared);
+		close_shared_frame_buffer(&shared);
+	}
+	else
+	{
+		submit_output_frame(output, g_ctx.frame_buffer, output_path);
+	}
+	g_ctx.frame_buffer = NULL;
 		
 	free_model(suzanne_model);
 	free_model(cube_model);
 	free_graphics_context(g_ctx);
+	free_frame_output(output);
 	fclose(logfile);
 
-	printf("End\n");
+	// stdout may be carrying the frames
+	fprintf(stderr, "End\n");
 	return 0;
 }
\ No newline at end of file
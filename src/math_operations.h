@@ -688,6 +688,61 @@ static vec3 barycentric2(vec2 A, vec2 B, vec2 C, vec2 P)
 	return result;
 }
 
+/*
+	Solves for the triangle tangent (direction of increasing u) and
+	bitangent (direction of increasing v) in the space of p1, p2, p3.
+
+		Edge1 = delta_u1 * T + delta_v1 * B
+		Edge2 = delta_u2 * T + delta_v2 * B
+
+		|delta_u1, delta_v1|^(-1)  * |Ex1, Ey1, Ez1| = |Tx, Ty, Tz|
+		|delta_u2, delta_v2|         |Ex2, Ey2, Ez2|   |Bx, By, Bz|
+
+	@returns: 0 if the texture coordinates are degenerate. 1, otherwise.
+*/
+static int tangent_bitangent(
+	vec3 p1, vec3 p2, vec3 p3,
+	vec2 uv1, vec2 uv2, vec2 uv3,
+	vec3* tangent,
+	vec3* bitangent)
+{
+	vec3 edge1 = subtract_vec3(p2, p1);
+	vec3 edge2 = subtract_vec3(p3, p1);
+
+	vec2 delta_uv1 = subtract_vec2(uv2, uv1);
+	vec2 delta_uv2 = subtract_vec2(uv3, uv1);
+
+	float det = delta_uv1.x * delta_uv2.y - delta_uv2.x * delta_uv1.y;
+	float inv_det = 1.0f / det;
+
+	*tangent = multiply_scalar_vec3(inv_det,
+		subtract_vec3(multiply_scalar_vec3(delta_uv2.y, edge1), multiply_scalar_vec3(delta_uv1.y, edge2)));
+	*bitangent = multiply_scalar_vec3(inv_det,
+		subtract_vec3(multiply_scalar_vec3(delta_uv1.x, edge2), multiply_scalar_vec3(delta_uv2.x, edge1)));
+
+	int result = (det != 0.0f) ? 1 : 0;
+	return result;
+}
+
+/*
+	Approximate log2 for positive, normal x.  Splits the float into
+	exponent and mantissa, and fits log2 on the mantissa in [1, 2)
+	with a quadratic.  Max error is about 0.01.
+*/
+static float fast_log2(float x)
+{
+	union { float f; uint32_t i; } bits = { x };
+
+	float exponent = (float)((int)((bits.i >> 23) & 0xFF) - 127);
+
+	bits.i = (bits.i & 0x007FFFFF) | 0x3F800000;  // mantissa in [1, 2)
+	float m = bits.f;
+
+	float result = exponent + (-0.34484843f * m + 2.02466578f) * m - 1.67487759f;
+
+	return result;
+}
+
 /*
 	when t = 0.0f, min.
 	when t = 1.0f, max
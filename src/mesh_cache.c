@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "mesh_cache.h"
+
+static uint64_t align_offset(uint64_t offset)
+{
+	uint64_t result = (offset + MESH_CACHE_ALIGNMENT - 1) & ~(uint64_t)(MESH_CACHE_ALIGNMENT - 1);
+
+	return result;
+}
+
+static void write_stream(FILE* file, uint64_t* position, uint64_t offset, const void* data, size_t bytes)
+{
+	static const char padding[MESH_CACHE_ALIGNMENT] = { 0 };
+
+	fwrite(padding, 1, (size_t)(offset - *position), file);
+	if (bytes) fwrite(data, 1, bytes, file);
+
+	*position = offset + bytes;
+}
+
+/*
+	Writes to a temporary file first and renames it into place, so a
+	concurrent or interrupted run never leaves a half written cache.
+
+	@returns: 1 on success
+*/
+int write_mesh_cache(const Mesh* mesh, const char* cache_path, uint64_t source_size, int64_t source_mtime)
+{
+	MeshFileHeader header = { 0 };
+	header.magic = MESH_CACHE_MAGIC;
+	header.version = MESH_CACHE_VERSION;
+	header.source_size = source_size;
+	header.source_mtime = source_mtime;
+	header.vertex_count = mesh->vertex_count;
+	header.normal_count = mesh->normal_count;
+	header.tex_coord_count = mesh->text_coords_count;
+	header.face_count = mesh->face_count;
+	header.material_count = mesh->material_count;
+	header.material_range_count = mesh->material_range_count;
+
+	for (int k = 0; k < 3; k++)
+	{
+		header.bounds_min[k] = mesh->vertex_count ? mesh->vertices[0].e[k] : 0.0f;
+		header.bounds_max[k] = header.bounds_min[k];
+	}
+	for (unsigned int i = 1; i < mesh->vertex_count; i++)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			float value = mesh->vertices[i].e[k];
+			if (value < header.bounds_min[k]) header.bounds_min[k] = value;
+			if (value > header.bounds_max[k]) header.bounds_max[k] = value;
+		}
+	}
+
+	size_t vertex_bytes = mesh->vertex_count * sizeof(Vertex);
+	size_t normal_bytes = mesh->normal_count * sizeof(Normal);
+	size_t tex_coord_bytes = mesh->text_coords_count * sizeof(TextureCoordinate);
+	size_t face_bytes = mesh->face_count * sizeof(Face);
+	size_t material_bytes = mesh->material_count * sizeof(Material);
+	size_t material_range_bytes = mesh->material_range_count * sizeof(MaterialRange);
+
+	header.vertices_offset = align_offset(sizeof(MeshFileHeader));
+	header.normals_offset = align_offset(header.vertices_offset + vertex_bytes);
+	header.tex_coords_offset = align_offset(header.normals_offset + normal_bytes);
+	header.faces_offset = align_offset(header.tex_coords_offset + tex_coord_bytes);
+	header.materials_offset = align_offset(header.faces_offset + face_bytes);
+	header.material_ranges_offset = align_offset(header.materials_offset + material_bytes);
+
+	char temp_path[1024];
+	snprintf(temp_path, sizeof(temp_path), "%s.tmp", cache_path);
+
+	FILE* file = fopen(temp_path, "wb");
+	if (file == NULL)
+	{
+		return 0;
+	}
+
+	uint64_t position = 0;
+	write_stream(file, &position, 0, &header, sizeof(header));
+	write_stream(file, &position, header.vertices_offset, mesh->vertices, vertex_bytes);
+	write_stream(file, &position, header.normals_offset, mesh->normals, normal_bytes);
+	write_stream(file, &position, header.tex_coords_offset, mesh->tex_coords, tex_coord_bytes);
+	write_stream(file, &position, header.faces_offset, mesh->faces, face_bytes);
+	write_stream(file, &position, header.materials_offset, mesh->materials, material_bytes);
+	write_stream(file, &position, header.material_ranges_offset, mesh->material_ranges, material_range_bytes);
+
+	int result = ferror(file) == 0;
+	result &= fclose(file) == 0;
+
+	if (result)
+	{
+		// rename() doesn't replace an existing file on Windows
+		remove(cache_path);
+		result = rename(temp_path, cache_path) == 0;
+	}
+
+	if (!result)
+	{
+		remove(temp_path);
+	}
+
+	return result;
+}
+
+static int stream_fits(uint64_t offset, uint64_t count, size_t item_size, size_t file_size)
+{
+	int result = offset % MESH_CACHE_ALIGNMENT == 0 && offset <= file_size && count * item_size <= file_size - offset;
+
+	return result;
+}
+
+/*
+	@returns: mesh whose arrays point into the mapped file, NULL if the
+	          cache is missing, stale or damaged
+*/
+Mesh* map_mesh_cache(const char* cache_path, uint64_t source_size, int64_t source_mtime)
+{
+	FileMapping* mapping = (FileMapping*)malloc(sizeof(FileMapping));
+	if (!map_file(cache_path, mapping))
+	{
+		free(mapping);
+		return NULL;
+	}
+
+	const MeshFileHeader* header = (const MeshFileHeader*)mapping->data;
+	size_t size = mapping->size;
+
+	int valid =
+		size >= sizeof(MeshFileHeader) &&
+		header->magic == MESH_CACHE_MAGIC &&
+		header->version == MESH_CACHE_VERSION &&
+		header->source_size == source_size &&
+		header->source_mtime == source_mtime &&
+		stream_fits(header->vertices_offset, header->vertex_count, sizeof(Vertex), size) &&
+		stream_fits(header->normals_offset, header->normal_count, sizeof(Normal), size) &&
+		stream_fits(header->tex_coords_offset, header->tex_coord_count, sizeof(TextureCoordinate), size) &&
+		stream_fits(header->faces_offset, header->face_count, sizeof(Face), size) &&
+		stream_fits(header->materials_offset, header->material_count, sizeof(Material), size) &&
+		stream_fits(header->material_ranges_offset, header->material_range_count, sizeof(MaterialRange), size);
+
+	if (!valid)
+	{
+		unmap_file(mapping);
+		free(mapping);
+		return NULL;
+	}
+
+	// The mapping is read-only, the casts only drop const
+	char* data = (char*)mapping->data;
+
+	Mesh* mesh = (Mesh*)calloc(1, sizeof(Mesh));
+	mesh->mapping = mapping;
+
+	mesh->vertices = (Vertex*)(data + header->vertices_offset);
+	mesh->vertex_count = header->vertex_count;
+	mesh->normals = (Normal*)(data + header->normals_offset);
+	mesh->normal_count = header->normal_count;
+	mesh->tex_coords = (TextureCoordinate*)(data + header->tex_coords_offset);
+	mesh->text_coords_count = header->tex_coord_count;
+	mesh->faces = (Face*)(data + header->faces_offset);
+	mesh->face_count = header->face_count;
+	mesh->materials = (Material*)(data + header->materials_offset);
+	mesh->material_count = header->material_count;
+	mesh->material_ranges = (MaterialRange*)(data + header->material_ranges_offset);
+	mesh->material_range_count = header->material_range_count;
+
+	return mesh;
+}
+
+/*
+	Loads an OBJ through its mesh cache, parsing it and writing the
+	cache only when there is no up to date one.  A cache that can't be
+	written, e.g. in a read-only directory, is silently skipped.
+*/
+Mesh* load_mesh(const char* obj_path)
+{
+	struct stat source_stat;
+	if (stat(obj_path, &source_stat) != 0)
+	{
+		fprintf(stderr, "Can't open file\n");
+		return NULL;
+	}
+
+	uint64_t source_size = (uint64_t)source_stat.st_size;
+	int64_t source_mtime = (int64_t)source_stat.st_mtime;
+
+	char cache_path[1024];
+	snprintf(cache_path, sizeof(cache_path), "%s%s", obj_path, MESH_CACHE_EXTENSION);
+
+	Mesh* result = map_mesh_cache(cache_path, source_size, source_mtime);
+
+	if (result == NULL)
+	{
+		result = load_obj_from_file(obj_path);
+		if (result)
+		{
+			write_mesh_cache(result, cache_path, source_size, source_mtime);
+		}
+	}
+
+	return result;
+}
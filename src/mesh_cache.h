@@ -0,0 +1,61 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include <stdint.h>
+
+#include "obj_model_loader.h"
+
+/*
+	Binary mesh cache, written next to the OBJ it was parsed from
+	(path + MESH_CACHE_EXTENSION) and memory mapped on later loads.
+	The mesh arrays then point straight into the mapping, nothing is
+	parsed or copied.
+
+	A cache is used only if it was built from an OBJ of the same size
+	and modification time, and by the same MESH_CACHE_VERSION.  Material
+	libraries are cached with the mesh but not stamped, touch the OBJ
+	after editing its MTL files.
+
+	Layout, native byte order: MeshFileHeader, then the vertex, normal,
+	texture coordinate, face, material and material range arrays, each
+	at a MESH_CACHE_ALIGNMENT aligned offset.
+*/
+
+#define MESH_CACHE_EXTENSION ".mcache"
+#define MESH_CACHE_MAGIC 0x4853454Du	// "MESH"
+#define MESH_CACHE_VERSION 3
+#define MESH_CACHE_ALIGNMENT 64
+
+typedef struct mesh_file_header_t
+{
+	uint32_t magic;
+	uint32_t version;
+
+	// Identifies the source OBJ
+	uint64_t source_size;
+	int64_t source_mtime;
+
+	uint32_t vertex_count;
+	uint32_t normal_count;
+	uint32_t tex_coord_count;
+	uint32_t face_count;
+	uint32_t material_count;
+	uint32_t material_range_count;
+
+	float bounds_min[3];
+	float bounds_max[3];
+
+	// Byte offsets from the start of the file
+	uint64_t vertices_offset;
+	uint64_t normals_offset;
+	uint64_t tex_coords_offset;
+	uint64_t faces_offset;
+	uint64_t materials_offset;
+	uint64_t material_ranges_offset;
+} MeshFileHeader;
+
+Mesh* load_mesh(const char* obj_path);
+int write_mesh_cache(const Mesh* mesh, const char* cache_path, uint64_t source_size, int64_t source_mtime);
+Mesh* map_mesh_cache(const char* cache_path, uint64_t source_size, int64_t source_mtime);
+
+#endif // !MESH_CACHE_H
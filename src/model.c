@@ -14,7 +14,7 @@ Model* load_model(
 	char model_path[1024];
 
 	get_path(model_path, ROOT_DIR, obj);
-	Mesh* mesh = load_obj_from_file(model_path);
+	Mesh* mesh = acquire_mesh(model_path);
 	assert(mesh != NULL);
 	model->mesh = mesh;
 
@@ -23,24 +23,49 @@ Model* load_model(
 	if (diffuse_map)
 	{
 		get_path(texture_path, ROOT_DIR, diffuse_map);
-		Texture* diffuse_texture = load_texture(texture_path);
+		Texture* diffuse_texture = acquire_texture(texture_path, TEXTURE_LOAD_DEFAULT);
 		model->diffuse_map = diffuse_texture;
 	}
 
 	if (normal_map)
 	{
 		get_path(texture_path, ROOT_DIR, normal_map);
-		Texture* normal_texture = load_texture(texture_path);
+		Texture* normal_texture = acquire_texture(texture_path, TEXTURE_LOAD_DEFAULT);
 		model->normal_map = normal_texture;
+
+		// Tangent space normal maps need a TBN frame per vertex
+		calculate_tangents(mesh);
 	}
 
 	if (specular_map)
 	{
 		get_path(texture_path, ROOT_DIR, specular_map);
-		Texture* specular_texture = load_texture(texture_path);
+		Texture* specular_texture = acquire_texture(texture_path, TEXTURE_LOAD_DEFAULT);
 		model->specular_map = specular_texture;
 	}
 
+	// Materials from the OBJ's mtllib, map paths are already resolved
+	model->material_count = mesh->material_count;
+	model->materials = (ModelMaterial*)calloc(mesh->material_count, sizeof(ModelMaterial));
+
+	for (unsigned int i = 0; i < mesh->material_count; i++)
+	{
+		const Material* material = &mesh->materials[i];
+		ModelMaterial* model_material = &model->materials[i];
+
+		if (material->diffuse_map[0]) model_material->diffuse_map = acquire_texture(material->diffuse_map, TEXTURE_LOAD_DEFAULT);
+		if (material->normal_map[0]) model_material->normal_map = acquire_texture(material->normal_map, TEXTURE_LOAD_DEFAULT);
+		if (material->specular_map[0]) model_material->specular_map = acquire_texture(material->specular_map, TEXTURE_LOAD_DEFAULT);
+
+		model_material->diffuse_color = Vec3(material->diffuse_color[0], material->diffuse_color[1], material->diffuse_color[2]);
+		model_material->specular = (material->specular_color[0] + material->specular_color[1] + material->specular_color[2]) / 3.0f;
+
+		if (model_material->normal_map)
+		{
+			calculate_tangents(mesh);
+		}
+	}
+
 	return model;
 }
 
@@ -48,11 +73,20 @@ void free_model(Model* model)
 {
 	if (model)
 	{
-		if (model->diffuse_map) free_texture(model->diffuse_map);
-		if (model->normal_map) free_texture(model->normal_map);
-		if (model->specular_map) free_texture(model->specular_map);
+		// Textures and meshes may be shared with other models
+		release_texture(model->diffuse_map);
+		release_texture(model->normal_map);
+		release_texture(model->specular_map);
+
+		for (int i = 0; i < model->material_count; i++)
+		{
+			release_texture(model->materials[i].diffuse_map);
+			release_texture(model->materials[i].normal_map);
+			release_texture(model->materials[i].specular_map);
+		}
+		free(model->materials);
 
-		free_mesh(model->mesh);
+		release_mesh(model->mesh);
 
 		free(model);
 	}	
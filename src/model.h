@@ -5,16 +5,36 @@
 #include "tga_image_loader.h"
 #include "math_operations.h"
 #include "obj_model_loader.h"
+#include "asset_cache.h"
 
 #define MAX_MODEL_COUNT_PER_SCENE 10
 
+/*
+	Textures and constants the renderer binds for one material range
+*/
+typedef struct
+{
+	Texture* diffuse_map;
+	Texture* normal_map;
+	Texture* specular_map;
+
+	vec3 diffuse_color;		// Used when there is no diffuse map
+	float specular;			// Highlight strength when there is no specular map
+} ModelMaterial;
+
 typedef struct
 {
 	char* name;
 	Mesh* mesh;
+
+	// Maps passed to load_model, for faces without an MTL material
 	Texture* diffuse_map;
 	Texture* normal_map;
 	Texture* specular_map;
+
+	// One per mesh material
+	ModelMaterial* materials;
+	int material_count;
 } Model;
 
 typedef struct
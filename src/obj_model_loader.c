@@ -1,4 +1,10 @@
+#include <assert.h>
+#include <stdint.h>
+
 #include "obj_model_loader.h"
+#include "file_mapping.h"
+#include "thread.h"
+#include "math_operations.h"
 
 char* get_path(char* out,
 	const char* root_dir,
@@ -10,186 +16,1097 @@ char* get_path(char* out,
 	return out;
 }
 
-void parse_attribute(ObjAttributeType type,
-	void** memory,
-	size_t item_size,
-	int* count,
-	char* token,
-	char* delim,
-	char* next,
-	int* elem_idx)
+/*
+	Text parsing works directly on the mapped file, which is not zero
+	terminated, so every scan is bounded by an end pointer.
+*/
+
+static int is_blank(char c)
+{
+	int result = c == ' ' || c == '\t';
+
+	return result;
+}
+
+static int is_digit(char c)
+{
+	int result = c >= '0' && c <= '9';
+
+	return result;
+}
+
+static const char* skip_blanks(const char* c, const char* end)
+{
+	while (c < end && is_blank(*c)) c++;
+
+	return c;
+}
+
+/*
+	@returns: the start of the next line
+*/
+static const char* skip_line(const char* c, const char* end)
+{
+	while (c < end && *c != '\n') c++;
+	if (c < end) c++;
+
+	return c;
+}
+
+static int is_line_end(const char* c, const char* end)
 {
-	(*count)++;
-	*memory = realloc(*memory, item_size * (*count));
+	int result = c >= end || *c == '\n' || *c == '\r';
+
+	return result;
+}
+
+static const char* skip_token(const char* c, const char* end)
+{
+	while (c < end && !is_blank(*c) && *c != '\n' && *c != '\r') c++;
+
+	return c;
+}
 
-	while (token != NULL)
+// Every power of ten up to 1e22 is exact in a double
+static const double powers_of_10[] =
+{
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/*
+	Decimal floating point, [+-]digits[.digits][(e|E)[+-]digits].
+	Up to 19 significant digits are accumulated in an integer and scaled
+	once, which is exact for the short values OBJ exporters write.
+
+	@returns: pointer past the number, c itself if there is none
+*/
+static const char* parse_float(const char* c, const char* end, float* value)
+{
+	const char* start = c;
+
+	int negative = 0;
+	if (c < end && (*c == '-' || *c == '+'))
+	{
+		negative = *c == '-';
+		c++;
+	}
+
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	int has_digits = 0;
+
+	for (; c < end && is_digit(*c); c++)
 	{
-		int attrib_index = (*count) - 1;
-		token = strtok_r(NULL, delim, &next);
-		if (token != NULL)
+		has_digits = 1;
+		if (digits < 19)
 		{
-			float val = atof(token);
-			if (type == VERTEX)
+			mantissa = mantissa * 10 + (*c - '0');
+			if (mantissa) digits++;
+		}
+		else
+		{
+			exponent++;
+		}
+	}
+
+	if (c < end && *c == '.')
+	{
+		for (c++; c < end && is_digit(*c); c++)
+		{
+			has_digits = 1;
+			if (digits < 19)
 			{
-				Vertex* mem = (Vertex*)*memory;
-				mem[attrib_index].e[*elem_idx] = val;
+				mantissa = mantissa * 10 + (*c - '0');
+				if (mantissa) digits++;
+				exponent--;
 			}
-			else if (type == NORMAL)
+		}
+	}
+
+	if (!has_digits)
+	{
+		return start;
+	}
+
+	if (c < end && (*c == 'e' || *c == 'E'))
+	{
+		const char* e = c + 1;
+		int exponent_negative = 0;
+		if (e < end && (*e == '-' || *e == '+'))
+		{
+			exponent_negative = *e == '-';
+			e++;
+		}
+
+		if (e < end && is_digit(*e))
+		{
+			int explicit_exponent = 0;
+			for (; e < end && is_digit(*e); e++)
 			{
-				Normal* mem = (Normal*)*memory;
-				mem[attrib_index].e[*elem_idx] = val;
+				if (explicit_exponent < 10000) explicit_exponent = explicit_exponent * 10 + (*e - '0');
 			}
-			else if (type == TEXTURE_COORDINATE)
+			exponent += exponent_negative ? -explicit_exponent : explicit_exponent;
+			c = e;
+		}
+	}
+
+	double result = (double)mantissa;
+	if (mantissa != 0)
+	{
+		if (exponent >= 0)
+		{
+			result *= exponent <= 22 ? powers_of_10[exponent] : pow(10.0, exponent);
+		}
+		else
+		{
+			result /= -exponent <= 22 ? powers_of_10[-exponent] : pow(10.0, -exponent);
+		}
+	}
+
+	*value = (float)(negative ? -result : result);
+
+	return c;
+}
+
+/*
+	@returns: pointer past the number, c itself if there is none
+*/
+static const char* parse_int(const char* c, const char* end, int* value)
+{
+	const char* start = c;
+
+	int negative = 0;
+	if (c < end && (*c == '-' || *c == '+'))
+	{
+		negative = *c == '-';
+		c++;
+	}
+
+	if (c >= end || !is_digit(*c))
+	{
+		return start;
+	}
+
+	int result = 0;
+	for (; c < end && is_digit(*c); c++)
+	{
+		result = result * 10 + (*c - '0');
+	}
+
+	*value = negative ? -result : result;
+
+	return c;
+}
+
+/*
+	Ensures room for one more item, doubling the capacity when full, so
+	n items cost O(n) copying in total.
+*/
+static void* reserve_item(void* memory, unsigned int count, unsigned int* capacity, size_t item_size)
+{
+	void* result = memory;
+
+	if (count == *capacity)
+	{
+		*capacity = *capacity ? *capacity * 2 : 1024;
+		result = realloc(memory, item_size * (*capacity));
+	}
+
+	return result;
+}
+
+/*
+	Rest of the line without leading and trailing blanks, for names
+	and paths that may contain spaces.
+*/
+static const char* parse_rest_of_line(const char* c, const char* end, const char** text, size_t* length)
+{
+	c = skip_blanks(c, end);
+	*text = c;
+
+	while (!is_line_end(c, end)) c++;
+
+	const char* text_end = c;
+	while (text_end > *text && is_blank(text_end[-1])) text_end--;
+	*length = text_end - *text;
+
+	return c;
+}
+
+/*
+	Reads up to 3 floats, missing ones are 0.  Extra values, such as
+	the optional w of "v x y z w", are skipped.
+*/
+static const char* parse_vector(const char* c, const char* end, float e[3])
+{
+	e[0] = e[1] = e[2] = 0.0f;
+
+	for (int i = 0; ; i++)
+	{
+		c = skip_blanks(c, end);
+		if (is_line_end(c, end)) break;
+
+		float value;
+		const char* next = parse_float(c, end, &value);
+		if (next == c)
+		{
+			next = skip_token(c, end);  // not a number
+		}
+		else if (i < 3)
+		{
+			e[i] = value;
+		}
+		c = next;
+	}
+
+	return c;
+}
+
+/*
+	Chunks are parsed without knowing how many elements the chunks
+	before them define, so a negative (relative) index can't be made
+	absolute yet.  It is stored as a 1-based position relative to the
+	chunk start, which may be 0 or negative when it reaches back into an
+	earlier chunk, tagged with the top bit.  merge_obj_chunks() adds the
+	chunk's offset.
+*/
+#define OBJ_RELATIVE_INDEX_BIT 0x80000000u
+
+/*
+	OBJ indices start at 1, negative ones count back from the last
+	element defined so far.  Missing indices are stored as 0.
+*/
+static unsigned int encode_index(int index, unsigned int chunk_count, int* has_relative_indices)
+{
+	unsigned int result = (unsigned int)index;
+
+	if (index < 0)
+	{
+		int relative = (int)chunk_count + 1 + index;
+		result = ((unsigned int)relative & ~OBJ_RELATIVE_INDEX_BIT) | OBJ_RELATIVE_INDEX_BIT;
+		*has_relative_indices = 1;
+	}
+
+	return result;
+}
+
+static unsigned int decode_index(unsigned int index, unsigned int chunk_offset)
+{
+	unsigned int result = index;
+
+	if (index & OBJ_RELATIVE_INDEX_BIT)
+	{
+		// Sign extend the 31-bit relative position
+		int relative = (int)(index << 1) >> 1;
+		result = (unsigned int)((int)chunk_offset + relative);
+	}
+
+	return result;
+}
+
+/*
+	mtllib and usemtl statements, in file order.  Names point into the
+	mapped file and are resolved once all chunks are parsed.
+*/
+typedef enum obj_event_type_t
+{
+	OBJ_EVENT_MTLLIB,
+	OBJ_EVENT_USEMTL
+} ObjEventType;
+
+typedef struct obj_event_t
+{
+	ObjEventType type;
+	unsigned int face;	// Faces of the chunk before the statement
+	const char* name;
+	size_t name_length;
+} ObjEvent;
+
+typedef struct obj_chunk_t
+{
+	const char* begin;
+	const char* end;
+
+	ObjEvent* events;
+	unsigned int event_count;
+	unsigned int event_capacity;
+
+	Mesh mesh;
+	unsigned int vertex_capacity;
+	unsigned int normal_capacity;
+	unsigned int tex_coord_capacity;
+	unsigned int face_capacity;
+
+	int has_relative_indices;
+
+	// Elements in the chunks before this one
+	unsigned int vertex_offset;
+	unsigned int normal_offset;
+	unsigned int tex_coord_offset;
+	unsigned int face_offset;
+} ObjChunk;
+
+/*
+	"f v/vt/vn v/vt/vn v/vt/vn ...", vt and vn are optional ("v",
+	"v/vt", "v//vn").  Polygons with more than three corners are split
+	into a fan of triangles around the first corner as they are read,
+	which is exact for the convex quads and n-gons exporters write.
+	Lines with fewer than three corners add nothing.
+*/
+static const char* parse_face(const char* c, const char* end, ObjChunk* chunk)
+{
+	Mesh* mesh = &chunk->mesh;
+
+	// Corners 0 and the previous one, as (vertex, texture, normal)
+	unsigned int first[3];
+	unsigned int previous[3];
+
+	for (int corner = 0; ; corner++)
+	{
+		c = skip_blanks(c, end);
+		if (is_line_end(c, end)) break;
+
+		int indices[3] = { 0, 0, 0 };
+		for (int k = 0; k < 3; k++)
+		{
+			c = parse_int(c, end, &indices[k]);
+			if (c >= end || *c != '/') break;
+			c++;
+		}
+		c = skip_token(c, end);
+
+		unsigned int current[3];
+		current[0] = encode_index(indices[0], mesh->vertex_count, &chunk->has_relative_indices);
+		current[1] = encode_index(indices[1], mesh->text_coords_count, &chunk->has_relative_indices);
+		current[2] = encode_index(indices[2], mesh->normal_count, &chunk->has_relative_indices);
+
+		if (corner == 0)
+		{
+			memcpy(first, current, sizeof(first));
+		}
+		else if (corner >= 2)
+		{
+			mesh->faces = (Face*)reserve_item(mesh->faces, mesh->face_count, &chunk->face_capacity, sizeof(Face));
+			Face* face = &mesh->faces[mesh->face_count++];
+
+			const unsigned int* corners[3] = { first, previous, current };
+			for (int k = 0; k < 3; k++)
 			{
-				TextureCoordinate* mem = (TextureCoordinate*)*memory;
-				mem[attrib_index].e[*elem_idx] = val;
+				face->vertexIdx[k] = corners[k][0];
+				face->textureIdx[k] = corners[k][1];
+				face->normalIdx[k] = corners[k][2];
 			}
-			(*elem_idx)++;
 		}
+
+		memcpy(previous, current, sizeof(previous));
 	}
+
+	return c;
 }
 
-Mesh* load_obj_from_file(const char* path)
+/*
+	Parses the lines in [chunk->begin, chunk->end) in one pass.  Arrays
+	grow geometrically, lines can be any length.
+*/
+static void parse_obj_chunk(void* data, int index)
 {
-	FILE* file;
+	ObjChunk* chunk = &((ObjChunk*)data)[index];
+	Mesh* mesh = &chunk->mesh;
 
-	file = fopen(path, "r");
-	if (!file)
+	const char* c = chunk->begin;
+	const char* end = chunk->end;
+
+	while (c < end)
 	{
-		printf("Can't open file\n");
-		return NULL;
+		c = skip_blanks(c, end);
+
+		const char* keyword = c;
+		c = skip_token(c, end);
+		size_t keyword_length = c - keyword;
+
+		if (keyword_length == 1 && keyword[0] == 'v')  // vertices
+		{
+			mesh->vertices = (Vertex*)reserve_item(mesh->vertices, mesh->vertex_count, &chunk->vertex_capacity, sizeof(Vertex));
+			c = parse_vector(c, end, mesh->vertices[mesh->vertex_count++].e);
+		}
+		else if (keyword_length == 2 && keyword[0] == 'v' && keyword[1] == 'n')  // normals
+		{
+			mesh->normals = (Normal*)reserve_item(mesh->normals, mesh->normal_count, &chunk->normal_capacity, sizeof(Normal));
+			c = parse_vector(c, end, mesh->normals[mesh->normal_count++].e);
+		}
+		else if (keyword_length == 2 && keyword[0] == 'v' && keyword[1] == 't')  // texture coordinates
+		{
+			// "vt u v" and "vt u" leave the missing values at 0
+			mesh->tex_coords = (TextureCoordinate*)reserve_item(mesh->tex_coords, mesh->text_coords_count, &chunk->tex_coord_capacity, sizeof(TextureCoordinate));
+			c = parse_vector(c, end, mesh->tex_coords[mesh->text_coords_count++].e);
+		}
+		else if (keyword_length == 1 && keyword[0] == 'f')  // faces
+		{
+			c = parse_face(c, end, chunk);
+		}
+		else if ((keyword_length == 6 && memcmp(keyword, "usemtl", 6) == 0) ||
+			(keyword_length == 6 && memcmp(keyword, "mtllib", 6) == 0))  // materials
+		{
+			chunk->events = (ObjEvent*)reserve_item(chunk->events, chunk->event_count, &chunk->event_capacity, sizeof(ObjEvent));
+			ObjEvent* event = &chunk->events[chunk->event_count++];
+
+			event->type = keyword[0] == 'u' ? OBJ_EVENT_USEMTL : OBJ_EVENT_MTLLIB;
+			event->face = mesh->face_count;
+			c = parse_rest_of_line(c, end, &event->name, &event->name_length);
+		}
+
+		// Comments, blank lines and unsupported statements
+		c = skip_line(c, end);
 	}
+}
 
-	char line[255] = { 0 };
+typedef struct obj_merge_t
+{
+	ObjChunk* chunks;
+	Mesh* mesh;
+} ObjMerge;
 
-	Vertex* verts = NULL;
-	int vert_count = 0;
+/*
+	Copies one chunk into its place in the merged arrays and makes its
+	relative indices absolute.
+*/
+static void merge_obj_chunk(void* data, int index)
+{
+	ObjMerge* merge = (ObjMerge*)data;
+	ObjChunk* chunk = &merge->chunks[index];
+	Mesh* mesh = merge->mesh;
 
-	Face* faces = NULL;
-	int face_count = 0;
+	memcpy(mesh->vertices + chunk->vertex_offset, chunk->mesh.vertices, chunk->mesh.vertex_count * sizeof(Vertex));
+	memcpy(mesh->normals + chunk->normal_offset, chunk->mesh.normals, chunk->mesh.normal_count * sizeof(Normal));
+	memcpy(mesh->tex_coords + chunk->tex_coord_offset, chunk->mesh.tex_coords, chunk->mesh.text_coords_count * sizeof(TextureCoordinate));
 
-	Normal* normals = NULL;
-	int normal_count = 0;
+	Face* faces = mesh->faces + chunk->face_offset;
+	memcpy(faces, chunk->mesh.faces, chunk->mesh.face_count * sizeof(Face));
 
-	TextureCoordinate* tex_coords = NULL;
-	int tex_coord_count = 0;
+	if (chunk->has_relative_indices)
+	{
+		for (unsigned int i = 0; i < chunk->mesh.face_count; i++)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				faces[i].vertexIdx[k] = decode_index(faces[i].vertexIdx[k], chunk->vertex_offset);
+				faces[i].textureIdx[k] = decode_index(faces[i].textureIdx[k], chunk->tex_coord_offset);
+				faces[i].normalIdx[k] = decode_index(faces[i].normalIdx[k], chunk->normal_offset);
+			}
+		}
+	}
+
+	free(chunk->mesh.vertices);
+	free(chunk->mesh.normals);
+	free(chunk->mesh.tex_coords);
+	free(chunk->mesh.faces);
+}
 
-	char* space_delim = " ";
-	char* slash_delim = "/";
+static void* trim_array(void* memory, unsigned int count, size_t item_size)
+{
+	// Trim the spare capacity of a growable array
+	void* result = count ? realloc(memory, count * item_size) : memory;
+
+	return result;
+}
 
-	while (fgets(line, 255, file) != NULL)  // parse file line by line
+/*
+	The renderer reads all three attributes of every corner, so faces
+	are completed after parsing:
+		- faces with a missing or out of range vertex are dropped
+		- corners without a texture coordinate get an appended (0, 0)
+		- corners without a normal get their face's geometric normal,
+		  appended once per face
+*/
+static void complete_mesh_attributes(Mesh* mesh, unsigned int* face_materials)
+{
+	unsigned int kept_faces = 0;
+	unsigned int default_tex_coord = 0;	// 1-based, 0 until needed
+	unsigned int parsed_normal_count = mesh->normal_count;
+	unsigned int normal_capacity = mesh->normal_count;
+
+	for (unsigned int i = 0; i < mesh->face_count; i++)
 	{
-		int elem_idx = 0;
+		Face face = mesh->faces[i];
 
-		char* next;
-		char* token = strtok_r(line, space_delim, &next);
+		int valid = 1;
+		for (int k = 0; k < 3; k++)
+		{
+			if (face.vertexIdx[k] == 0 || face.vertexIdx[k] > mesh->vertex_count) valid = 0;
+		}
+		if (!valid) continue;
+
+		unsigned int face_normal = 0;	// 1-based, 0 until needed
 
-		if (strcmp(token, "v") == 0)  // vertices
+		for (int k = 0; k < 3; k++)
 		{
-			parse_attribute(VERTEX,
-				(void**)&verts,
-				sizeof(Vertex),
-				&vert_count,
-				token,
-				space_delim,
-				next,
-				&elem_idx);
+			if (face.textureIdx[k] == 0 || face.textureIdx[k] > mesh->text_coords_count)
+			{
+				if (default_tex_coord == 0)
+				{
+					mesh->tex_coords = (TextureCoordinate*)realloc(mesh->tex_coords, (mesh->text_coords_count + 1) * sizeof(TextureCoordinate));
+					memset(&mesh->tex_coords[mesh->text_coords_count], 0, sizeof(TextureCoordinate));
+					default_tex_coord = ++mesh->text_coords_count;
+				}
+				face.textureIdx[k] = default_tex_coord;
+			}
+
+			if (face.normalIdx[k] == 0 || face.normalIdx[k] > parsed_normal_count)
+			{
+				if (face_normal == 0)
+				{
+					Vertex v1 = mesh->vertices[face.vertexIdx[0] - 1];
+					Vertex v2 = mesh->vertices[face.vertexIdx[1] - 1];
+					Vertex v3 = mesh->vertices[face.vertexIdx[2] - 1];
+
+					vec3 edge1 = Vec3(v2.x - v1.x, v2.y - v1.y, v2.z - v1.z);
+					vec3 edge2 = Vec3(v3.x - v1.x, v3.y - v1.y, v3.z - v1.z);
+					vec3 normal = cross(edge1, edge2);
+					normal = len_vec3(normal) > 0.0f ? normalize_vec3(normal) : Vec3(0, 0, 1);
+
+					mesh->normals = (Normal*)reserve_item(mesh->normals, mesh->normal_count, &normal_capacity, sizeof(Normal));
+					mesh->normals[mesh->normal_count].x = normal.x;
+					mesh->normals[mesh->normal_count].y = normal.y;
+					mesh->normals[mesh->normal_count].z = normal.z;
+					face_normal = ++mesh->normal_count;
+				}
+				face.normalIdx[k] = face_normal;
+			}
+		}
+
+		face_materials[kept_faces] = face_materials[i];
+		mesh->faces[kept_faces++] = face;
+	}
+
+	mesh->face_count = kept_faces;
+	mesh->normals = (Normal*)trim_array(mesh->normals, mesh->normal_count, sizeof(Normal));
+}
+
+/*
+	Length of the directory part of path, including the last separator
+*/
+static size_t directory_length(const char* path)
+{
+	size_t result = 0;
+
+	for (size_t i = 0; path[i]; i++)
+	{
+		if (path[i] == '/' || path[i] == '\\') result = i + 1;
+	}
+
+	return result;
+}
+
+/*
+	Copies length characters of text, truncated to fit size, and zero
+	terminates.
+*/
+static void copy_text(char* out, size_t size, const char* text, size_t length)
+{
+	if (length >= size) length = size - 1;
+
+	memcpy(out, text, length);
+	out[length] = '\0';
+}
+
+/*
+	Joins the directory of base_path with a relative path, absolute
+	paths are copied as they are.
+*/
+static void resolve_path(char* out, size_t size, const char* base_path, const char* path, size_t length)
+{
+	int is_absolute = length > 0 && (path[0] == '/' || path[0] == '\\' || (length > 1 && path[1] == ':'));
+	size_t prefix = is_absolute ? 0 : directory_length(base_path);
+
+	if (prefix >= size) prefix = size - 1;
+	memcpy(out, base_path, prefix);
+	copy_text(out + prefix, size - prefix, path, length);
+}
+
+/*
+	Map statements may carry options before the file name
+	("map_Bump -bm 0.5 normal.png"), the file name is the last token.
+*/
+static void parse_map_path(const char* c, const char* end, char* out, const char* mtl_path)
+{
+	const char* text;
+	size_t length;
+	parse_rest_of_line(c, end, &text, &length);
+
+	const char* name = text + length;
+	while (name > text && !is_blank(name[-1])) name--;
+
+	resolve_path(out, MATERIAL_PATH_LENGTH, mtl_path, name, text + length - name);
+}
+
+static int keyword_is(const char* keyword, size_t length, const char* name)
+{
+	int result = strlen(name) == length && memcmp(keyword, name, length) == 0;
+
+	return result;
+}
+
+/*
+	Appends the materials of an MTL file to materials.  Statements other
+	than newmtl, Kd, Ks, Ns and the diffuse, normal and specular maps
+	are ignored.
+
+	@returns: 1 on success, 0 if the file can't be opened
+*/
+int load_mtl_file(const char* path, Material** materials, unsigned int* material_count)
+{
+	FileMapping file;
+	if (!map_file(path, &file))
+	{
+		return 0;
+	}
+
+	Material* material = NULL;
+
+	const char* c = file.data;
+	const char* end = file.data + file.size;
+
+	while (c < end)
+	{
+		c = skip_blanks(c, end);
+
+		const char* keyword = c;
+		c = skip_token(c, end);
+		size_t keyword_length = c - keyword;
+
+		if (keyword_is(keyword, keyword_length, "newmtl"))
+		{
+			*materials = (Material*)realloc(*materials, (*material_count + 1) * sizeof(Material));
+			material = &(*materials)[(*material_count)++];
+			memset(material, 0, sizeof(Material));
+
+			// Unspecified colors match the renderer's untextured grey
+			for (int k = 0; k < 3; k++) material->diffuse_color[k] = 0.5f;
+
+			const char* name;
+			size_t name_length;
+			c = parse_rest_of_line(c, end, &name, &name_length);
+			copy_text(material->name, MATERIAL_NAME_LENGTH, name, name_length);
+		}
+		else if (material == NULL)
+		{
+			// Statements before the first newmtl
 		}
-		else if (strcmp(token, "vn") == 0)  // normals
+		else if (keyword_is(keyword, keyword_length, "Kd"))
 		{
-			parse_attribute(NORMAL,
-				(void**)&normals,
-				sizeof(Normal),
-				&normal_count,
-				token,
-				space_delim,
-				next,
-				&elem_idx);
+			c = parse_vector(c, end, material->diffuse_color);
 		}
-		else if (strcmp(token, "vt") == 0)  // texture coordinates
+		else if (keyword_is(keyword, keyword_length, "Ks"))
 		{
-			// TODO - consider case of "vt u v" with only 2 values and not 3
-			parse_attribute(TEXTURE_COORDINATE,
-				(void**)&tex_coords,
-				sizeof(TextureCoordinate),
-				&tex_coord_count,
-				token,
-				space_delim,
-				next,
-				&elem_idx);
+			c = parse_vector(c, end, material->specular_color);
 		}
-		else if (strcmp(token, "f") == 0)  // faces
+		else if (keyword_is(keyword, keyword_length, "Ns"))
 		{
-			face_count++;
-			faces = (Face*)realloc(faces, sizeof(Face) * face_count);
+			c = parse_float(skip_blanks(c, end), end, &material->shininess);
+		}
+		else if (keyword_is(keyword, keyword_length, "map_Kd"))
+		{
+			parse_map_path(c, end, material->diffuse_map, path);
+		}
+		else if (keyword_is(keyword, keyword_length, "map_Ks"))
+		{
+			parse_map_path(c, end, material->specular_map, path);
+		}
+		else if (keyword_is(keyword, keyword_length, "norm") ||
+			keyword_is(keyword, keyword_length, "bump") ||
+			keyword_is(keyword, keyword_length, "map_Bump") ||
+			keyword_is(keyword, keyword_length, "map_bump"))
+		{
+			parse_map_path(c, end, material->normal_map, path);
+		}
+
+		c = skip_line(c, end);
+	}
+
+	unmap_file(&file);
+
+	return 1;
+}
 
-			unsigned int vertex_elem_idx = 0;
-			unsigned int tex_coord_elem_idx = 0;
-			unsigned int normal_idx = 0;
+static unsigned int find_material(const Mesh* mesh, const char* name, size_t length)
+{
+	for (unsigned int i = 0; i < mesh->material_count; i++)
+	{
+		if (strlen(mesh->materials[i].name) == length && memcmp(mesh->materials[i].name, name, length) == 0)
+		{
+			return i;
+		}
+	}
+
+	return MATERIAL_NONE;
+}
+
+/*
+	Loads the mtllib files and tags every face with the material of the
+	last usemtl before it, which may be in an earlier chunk.
+
+	@returns: material of every face
+*/
+static unsigned int* resolve_materials(Mesh* mesh, ObjChunk* chunks, int chunk_count, const char* obj_path)
+{
+	for (int i = 0; i < chunk_count; i++)
+	{
+		for (unsigned int j = 0; j < chunks[i].event_count; j++)
+		{
+			ObjEvent* event = &chunks[i].events[j];
+			if (event->type != OBJ_EVENT_MTLLIB) continue;
 
-			while (token != NULL)
+			// "mtllib a.mtl b.mtl"
+			const char* name = event->name;
+			const char* name_end = event->name + event->name_length;
+			while (name < name_end)
 			{
-				int face_idx = face_count - 1;
-				token = strtok_r(NULL, space_delim, &next);
-				if (token != NULL)
+				const char* token_end = skip_token(name, name_end);
+
+				char mtl_path[MATERIAL_PATH_LENGTH];
+				resolve_path(mtl_path, sizeof(mtl_path), obj_path, name, token_end - name);
+				if (!load_mtl_file(mtl_path, &mesh->materials, &mesh->material_count))
 				{
-					// split "a/b/c"
-					int sub_elem_idx = 0;
-					for (char* next2, *sub_token = strtok_r(token, slash_delim, &next2);
-						sub_token;
-						sub_token = strtok_r(NULL, slash_delim, &next2))
-					{				
-						if (sub_elem_idx == 0)  // vertex position index
-						{
-							unsigned int val = atoi(sub_token);
-							faces[face_idx].vertexIdx[vertex_elem_idx] = val;
-							vertex_elem_idx++;
-						}
-						else if (sub_elem_idx == 1) // texture coordinates index
-						{
-							unsigned int val = atoi(sub_token);
-							faces[face_idx].textureIdx[tex_coord_elem_idx] = val;
-							tex_coord_elem_idx++;
-						}
-						else if (sub_elem_idx == 2) // vertex normals index
-						{
-							unsigned int val = atoi(sub_token);
-							faces[face_idx].normalIdx[normal_idx] = val;
-							normal_idx++;
-						}
-						sub_elem_idx++;
-					}
+					fprintf(stderr, "Can't open material library %s\n", mtl_path);
 				}
+
+				name = skip_blanks(token_end, name_end);
 			}
 		}
 	}
-	fclose(file);
 
-	Mesh* mesh = (Mesh*)malloc(sizeof(Mesh));
+	unsigned int* result = (unsigned int*)malloc(mesh->face_count * sizeof(unsigned int));
+	unsigned int material = MATERIAL_NONE;
+	unsigned int face = 0;
+
+	for (int i = 0; i < chunk_count; i++)
+	{
+		for (unsigned int j = 0; j < chunks[i].event_count; j++)
+		{
+			ObjEvent* event = &chunks[i].events[j];
+			if (event->type != OBJ_EVENT_USEMTL) continue;
+
+			for (; face < chunks[i].face_offset + event->face; face++) result[face] = material;
+			material = find_material(mesh, event->name, event->name_length);
+		}
 
-	mesh->vertices = verts;
-	mesh->vertex_count = vert_count;
+		free(chunks[i].events);
+	}
 
-	mesh->normals = normals;
-	mesh->normal_count = normal_count;
+	for (; face < mesh->face_count; face++) result[face] = material;
 
-	mesh->tex_coords = tex_coords;
-	mesh->text_coords_count = tex_coord_count;
+	return result;
+}
 
-	mesh->faces = faces;
-	mesh->face_count = face_count;
+/*
+	Stable counting sort of the faces by material, faces without a
+	material go last.  Each material then owns one contiguous range and
+	the renderer switches textures once per range.
+*/
+static void group_faces_by_material(Mesh* mesh, const unsigned int* face_materials)
+{
+	unsigned int key_count = mesh->material_count + 1;
+	unsigned int* starts = (unsigned int*)calloc(key_count + 1, sizeof(unsigned int));
+
+	for (unsigned int i = 0; i < mesh->face_count; i++)
+	{
+		unsigned int key = face_materials[i] == MATERIAL_NONE ? mesh->material_count : face_materials[i];
+		starts[key + 1]++;
+	}
+	for (unsigned int key = 0; key < key_count; key++)
+	{
+		starts[key + 1] += starts[key];
+	}
+
+	mesh->material_ranges = (MaterialRange*)malloc(key_count * sizeof(MaterialRange));
+	mesh->material_range_count = 0;
+	for (unsigned int key = 0; key < key_count; key++)
+	{
+		if (starts[key + 1] == starts[key]) continue;
+
+		MaterialRange* range = &mesh->material_ranges[mesh->material_range_count++];
+		range->first_face = starts[key];
+		range->face_count = starts[key + 1] - starts[key];
+		range->material = key == mesh->material_count ? MATERIAL_NONE : key;
+	}
+
+	// Already grouped, e.g. a single material
+	int is_sorted = 1;
+	for (unsigned int i = 1; i < mesh->face_count && is_sorted; i++)
+	{
+		unsigned int previous = face_materials[i - 1] == MATERIAL_NONE ? mesh->material_count : face_materials[i - 1];
+		unsigned int current = face_materials[i] == MATERIAL_NONE ? mesh->material_count : face_materials[i];
+		is_sorted = previous <= current;
+	}
+
+	if (!is_sorted)
+	{
+		Face* faces = (Face*)malloc(mesh->face_count * sizeof(Face));
+		for (unsigned int i = 0; i < mesh->face_count; i++)
+		{
+			unsigned int key = face_materials[i] == MATERIAL_NONE ? mesh->material_count : face_materials[i];
+			faces[starts[key]++] = mesh->faces[i];
+		}
+
+		free(mesh->faces);
+		mesh->faces = faces;
+	}
+
+	free(starts);
+}
+
+/*
+	Splits the memory mapped file at line boundaries into one chunk per
+	core, parses the chunks in parallel and merges them in file order.
+	Files smaller than OBJ_MIN_CHUNK_BYTES per chunk use fewer chunks.
+*/
+#define OBJ_MIN_CHUNK_BYTES (1 << 20)
+
+Mesh* load_obj_from_file(const char* path)
+{
+	FileMapping file;
+	if (!map_file(path, &file))
+	{
+		fprintf(stderr, "Can't open file\n");
+		return NULL;
+	}
+
+	int chunk_count = get_cpu_count();
+	if ((size_t)chunk_count > file.size / OBJ_MIN_CHUNK_BYTES)
+	{
+		chunk_count = (int)(file.size / OBJ_MIN_CHUNK_BYTES);
+	}
+	if (chunk_count < 1) chunk_count = 1;
+
+	ObjChunk* chunks = (ObjChunk*)calloc(chunk_count, sizeof(ObjChunk));
+
+	const char* end = file.data + file.size;
+	const char* c = file.data;
+	for (int i = 0; i < chunk_count; i++)
+	{
+		chunks[i].begin = c;
+
+		// Every chunk but the last ends after a newline
+		const char* split = i + 1 < chunk_count ? file.data + file.size / chunk_count * (i + 1) : end;
+		if (split < c) split = c;
+		c = (i + 1 < chunk_count && split > file.data) ? skip_line(split - 1, end) : end;
+
+		chunks[i].end = c;
+	}
+
+	parallel_for(chunk_count, parse_obj_chunk, chunks);
+
+	Mesh* mesh = (Mesh*)calloc(1, sizeof(Mesh));
+
+	for (int i = 0; i < chunk_count; i++)
+	{
+		chunks[i].vertex_offset = mesh->vertex_count;
+		chunks[i].normal_offset = mesh->normal_count;
+		chunks[i].tex_coord_offset = mesh->text_coords_count;
+		chunks[i].face_offset = mesh->face_count;
+
+		mesh->vertex_count += chunks[i].mesh.vertex_count;
+		mesh->normal_count += chunks[i].mesh.normal_count;
+		mesh->text_coords_count += chunks[i].mesh.text_coords_count;
+		mesh->face_count += chunks[i].mesh.face_count;
+	}
+
+	if (chunk_count == 1 && !chunks[0].has_relative_indices)
+	{
+		// Nothing to merge, keep the chunk's arrays
+		mesh->vertices = (Vertex*)trim_array(chunks[0].mesh.vertices, mesh->vertex_count, sizeof(Vertex));
+		mesh->normals = (Normal*)trim_array(chunks[0].mesh.normals, mesh->normal_count, sizeof(Normal));
+		mesh->tex_coords = (TextureCoordinate*)trim_array(chunks[0].mesh.tex_coords, mesh->text_coords_count, sizeof(TextureCoordinate));
+		mesh->faces = (Face*)trim_array(chunks[0].mesh.faces, mesh->face_count, sizeof(Face));
+	}
+	else
+	{
+		mesh->vertices = (Vertex*)malloc(mesh->vertex_count * sizeof(Vertex));
+		mesh->normals = (Normal*)malloc(mesh->normal_count * sizeof(Normal));
+		mesh->tex_coords = (TextureCoordinate*)malloc(mesh->text_coords_count * sizeof(TextureCoordinate));
+		mesh->faces = (Face*)malloc(mesh->face_count * sizeof(Face));
+
+		ObjMerge merge = { chunks, mesh };
+		parallel_for(chunk_count, merge_obj_chunk, &merge);
+	}
+
+	// Names in the events point into the mapping
+	unsigned int* face_materials = resolve_materials(mesh, chunks, chunk_count, path);
+
+	free(chunks);
+	unmap_file(&file);
+
+	complete_mesh_attributes(mesh, face_materials);
+	group_faces_by_material(mesh, face_materials);
+
+	free(face_materials);
 
 	return mesh;
 }
 
+/*
+	Corners with the same position, UV and normal, on faces mapping UVs
+	with the same handedness, share a tangent.
+*/
+typedef struct tangent_corner_t
+{
+	unsigned int vertex;
+	unsigned int tex_coord;
+	unsigned int normal;
+	int sign;
+	unsigned int corner;	// face * 3 + corner of the face
+} TangentCorner;
+
+static int compare_tangent_corners(const void* a, const void* b)
+{
+	const TangentCorner* x = (const TangentCorner*)a;
+	const TangentCorner* y = (const TangentCorner*)b;
+
+	int result = 0;
+	if (x->vertex != y->vertex) result = x->vertex < y->vertex ? -1 : 1;
+	else if (x->tex_coord != y->tex_coord) result = x->tex_coord < y->tex_coord ? -1 : 1;
+	else if (x->normal != y->normal) result = x->normal < y->normal ? -1 : 1;
+	else if (x->sign != y->sign) result = x->sign < y->sign ? -1 : 1;
+
+	return result;
+}
+
+static int same_tangent_key(const TangentCorner* x, const TangentCorner* y)
+{
+	int result = x->vertex == y->vertex && x->tex_coord == y->tex_coord &&
+		x->normal == y->normal && x->sign == y->sign;
+	return result;
+}
+
+/*
+	Computes a tangent and bitangent sign for every face corner.
+
+	Each face contributes its tangent to its corners, and corners that
+	share position, UV, normal and handedness are averaged together.
+	Corners on either side of a UV seam or a mirrored UV island keep
+	separate frames, so their tangents never cancel out.  The average is
+	made orthogonal to the normal (Gram-Schmidt), and the bitangent is
+	sign * (N x T).
+*/
+void calculate_tangents(Mesh* mesh)
+{
+	if (!mesh || mesh->tangents) return;
+	if (mesh->normal_count == 0 || mesh->text_coords_count == 0) return;
+
+	unsigned int corner_count = mesh->face_count * 3;
+	vec3* face_tangents = (vec3*)calloc(mesh->face_count, sizeof(vec3));
+	TangentCorner* corners = (TangentCorner*)malloc(corner_count * sizeof(TangentCorner));
+
+	int index_offset = 1;
+
+	for (unsigned int i = 0; i < mesh->face_count; i++)
+	{
+		Face face = mesh->faces[i];
+
+		vec3 p[3];
+		vec2 uv[3];
+		for (int k = 0; k < 3; k++)
+		{
+			Vertex vert = mesh->vertices[face.vertexIdx[k] - index_offset];
+			TextureCoordinate tex_coord = mesh->tex_coords[face.textureIdx[k] - index_offset];
+			p[k] = Vec3(vert.x, vert.y, vert.z);
+			uv[k] = Vec2(tex_coord.u, tex_coord.v);
+		}
+
+		// UVs collapsing to a line or a point leave the tangent at 0
+		vec3 tangent = Vec3_0();
+		vec3 bitangent = Vec3_0();
+		if (tangent_bitangent(p[0], p[1], p[2], uv[0], uv[1], uv[2], &tangent, &bitangent))
+		{
+			// Every face gets the same weight, regardless of its UV scale
+			tangent = normalize_vec3(tangent);
+			bitangent = normalize_vec3(bitangent);
+		}
+		face_tangents[i] = tangent;
+
+		for (int k = 0; k < 3; k++)
+		{
+			Normal n = mesh->normals[face.normalIdx[k] - index_offset];
+			vec3 normal = Vec3(n.x, n.y, n.z);
+
+			TangentCorner* corner = &corners[i * 3 + k];
+			corner->vertex = face.vertexIdx[k];
+			corner->tex_coord = face.textureIdx[k];
+			corner->normal = face.normalIdx[k];
+			corner->sign = dot_vec3(cross(normal, tangent), bitangent) < 0.0f ? -1 : 1;
+			corner->corner = i * 3 + k;
+		}
+	}
+
+	qsort(corners, corner_count, sizeof(TangentCorner), compare_tangent_corners);
+
+	mesh->tangents = (Tangent*)malloc(corner_count * sizeof(Tangent));
+	mesh->tangent_signs = (float*)malloc(corner_count * sizeof(float));
+
+	for (unsigned int first = 0; first < corner_count;)
+	{
+		unsigned int last = first + 1;
+		while (last < corner_count && same_tangent_key(&corners[first], &corners[last])) last++;
+
+		vec3 tangent = Vec3_0();
+		for (unsigned int i = first; i < last; i++)
+		{
+			tangent = add_vec3(tangent, face_tangents[corners[i].corner / 3]);
+		}
+
+		Normal n = mesh->normals[corners[first].normal - index_offset];
+		vec3 normal = normalize_vec3(Vec3(n.x, n.y, n.z));
+
+		// Gram-Schmidt: remove the normal component from the tangent
+		tangent = subtract_vec3(tangent, multiply_scalar_vec3(dot_vec3(normal, tangent), normal));
+		tangent = normalize_vec3(tangent);
+
+		if (len_vec3(tangent) == 0.0f)
+		{
+			// No usable UVs around this corner, pick any perpendicular axis
+			vec3 axis = fabsf(normal.x) < 0.9f ? Vec3(1, 0, 0) : Vec3(0, 1, 0);
+			tangent = normalize_vec3(cross(axis, normal));
+		}
+
+		for (unsigned int i = first; i < last; i++)
+		{
+			unsigned int corner = corners[i].corner;
+			mesh->tangents[corner].x = tangent.x;
+			mesh->tangents[corner].y = tangent.y;
+			mesh->tangents[corner].z = tangent.z;
+			mesh->tangent_signs[corner] = (float)corners[i].sign;
+		}
+
+		first = last;
+	}
+
+	free(corners);
+	free(face_tangents);
+}
+
 void free_mesh(Mesh* mesh)
 {
 	if (mesh)
 	{
-		free(mesh->faces);
-		free(mesh->normals);
-		free(mesh->tex_coords);
-		free(mesh->vertices);
+		free(mesh->tangents);
+		free(mesh->tangent_signs);
+
+		if (mesh->mapping)
+		{
+			unmap_file(mesh->mapping);
+			free(mesh->mapping);
+		}
+		else
+		{
+			free(mesh->materials);
+			free(mesh->material_ranges);
+			free(mesh->faces);
+			free(mesh->normals);
+			free(mesh->tex_coords);
+			free(mesh->vertices);
+		}
 
 		free(mesh);
 	}
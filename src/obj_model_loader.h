@@ -7,12 +7,7 @@
 #include <stdlib.h>
 
 #include "utils/root_dir.h"
-
-#if defined(_WIN32) || defined(_WIN64)
-// Welcome to portability
-#define strtok_r strtok_s
-#endif
-
+#include "file_mapping.h"
 
 typedef union vetrex_t
 {
@@ -29,7 +24,7 @@ typedef union vetrex_t
 		float w;
 	};
 	float e[3];
-} Vertex, Normal, TextureCoordinate;
+} Vertex, Normal, TextureCoordinate, Tangent, Bitangent;
 
 typedef union face_t
 {
@@ -42,6 +37,40 @@ typedef union face_t
 	unsigned int e[9];
 } Face;
 
+#define MATERIAL_NAME_LENGTH 64
+#define MATERIAL_PATH_LENGTH 512
+
+// Material of faces without a usemtl, or with an unknown one
+#define MATERIAL_NONE 0xFFFFFFFFu
+
+/*
+	One newmtl block of an MTL file.  Map paths are resolved against
+	the MTL file's directory, empty if the material has no such map.
+*/
+typedef struct material_t
+{
+	char name[MATERIAL_NAME_LENGTH];
+
+	float diffuse_color[3];		// Kd
+	float specular_color[3];	// Ks
+	float shininess;			// Ns
+
+	char diffuse_map[MATERIAL_PATH_LENGTH];		// map_Kd
+	char normal_map[MATERIAL_PATH_LENGTH];		// norm, bump, map_Bump
+	char specular_map[MATERIAL_PATH_LENGTH];	// map_Ks
+} Material;
+
+/*
+	Faces are sorted by material at load, so every material's faces
+	are one contiguous range.
+*/
+typedef struct material_range_t
+{
+	unsigned int first_face;
+	unsigned int face_count;
+	unsigned int material;	// Index into materials, or MATERIAL_NONE
+} MaterialRange;
+
 typedef struct mesh_t
 {
 	Vertex* vertices;
@@ -50,31 +79,37 @@ typedef struct mesh_t
 	Normal* normals;
 	unsigned int normal_count;
 
+	// Tangent frame per face corner, at face * 3 + corner, the
+	// bitangent is tangent_sign * (N x T).  NULL until
+	// calculate_tangents() is called.
+	Tangent* tangents;
+	float* tangent_signs;
+
 	TextureCoordinate* tex_coords;
 	unsigned int text_coords_count;
 
 	Face* faces;
 	unsigned int face_count;
-} Mesh;
 
-typedef enum obj_attribute_type_t
-{
-	VERTEX,
-	NORMAL,
-	TEXTURE_COORDINATE
-} ObjAttributeType;
+	Material* materials;
+	unsigned int material_count;
 
+	// Cover all faces, in face order
+	MaterialRange* material_ranges;
+	unsigned int material_range_count;
+
+	// Set when the arrays above point into a mapped mesh cache file,
+	// they are then read-only and released with the mapping
+	FileMapping* mapping;
+} Mesh;
 
-void parse_attribute(ObjAttributeType type,
-	void** memory,
-	size_t item_size,
-	int* count,
-	char* token,
-	char* delim,
-	char* next,
-	int* elem_idx);
+char* get_path(char* out,
+	const char* root_dir,
+	const char* relative_path);
 
 Mesh* load_obj_from_file(const char* path);
+int load_mtl_file(const char* path, Material** materials, unsigned int* material_count);
+void calculate_tangents(Mesh* mesh);
 void free_mesh(Mesh* mesh);
 
 #endif // !OBJ_IMAGE_LOADER_H
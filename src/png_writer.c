@@ -0,0 +1,819 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "png_writer.h"
+#include "thread.h"
+
+#define PNG_FILTER_UP 2
+
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_MIN_MATCH 4			// The hash covers 4 bytes
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_BLOCK_TOKENS (1 << 15)
+#define DEFLATE_MAX_STORED 65535
+
+#define DEFLATE_LITLEN_SYMBOLS 286
+#define DEFLATE_DIST_SYMBOLS 30
+#define DEFLATE_CODELEN_SYMBOLS 19
+#define DEFLATE_END_OF_BLOCK 256
+
+// Tokens are literals, or DEFLATE_MATCH | length << 16 | distance
+#define DEFLATE_MATCH 0x80000000u
+
+#define ADLER_MOD 65521
+
+static const unsigned short length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const unsigned char length_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const unsigned short distance_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const unsigned char distance_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const unsigned char codelen_order[DEFLATE_CODELEN_SYMBOLS] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+typedef struct bit_writer_t
+{
+	unsigned char* out;
+	uint64_t bits;
+	int count;
+} BitWriter;
+
+static void put_bits(BitWriter* writer, uint32_t value, int count)
+{
+	writer->bits |= (uint64_t)value << writer->count;
+	writer->count += count;
+
+	while (writer->count >= 8)
+	{
+		*writer->out++ = (unsigned char)writer->bits;
+		writer->bits >>= 8;
+		writer->count -= 8;
+	}
+}
+
+static void align_bits(BitWriter* writer)
+{
+	if (writer->count > 0)
+	{
+		put_bits(writer, 0, 8 - writer->count);
+	}
+}
+
+static int length_symbol(int length)
+{
+	int result = 28;
+	while (length_base[result] > length) result--;
+	return result;
+}
+
+static int distance_symbol(int distance)
+{
+	int result = 29;
+	while (distance_base[result] > distance) result--;
+	return result;
+}
+
+/*
+	Moffat and Katajainen's in-place minimum redundancy code: on entry
+	a[] holds n ascending weights, on exit the code length of each.
+*/
+static void minimum_redundancy_lengths(int* a, int n)
+{
+	if (n == 0) return;
+	if (n == 1)
+	{
+		a[0] = 1;
+		return;
+	}
+
+	a[0] += a[1];
+	int root = 0;
+	int leaf = 2;
+
+	for (int next = 1; next < n - 1; next++)
+	{
+		if (leaf >= n || a[root] < a[leaf])
+		{
+			a[next] = a[root];
+			a[root++] = next;
+		}
+		else
+		{
+			a[next] = a[leaf++];
+		}
+
+		if (leaf >= n || (root < next && a[root] < a[leaf]))
+		{
+			a[next] += a[root];
+			a[root++] = next;
+		}
+		else
+		{
+			a[next] += a[leaf++];
+		}
+	}
+
+	a[n - 2] = 0;
+	for (int next = n - 3; next >= 0; next--)
+	{
+		a[next] = a[a[next]] + 1;
+	}
+
+	int available = 1;
+	int used = 0;
+	int depth = 0;
+	root = n - 2;
+	int next = n - 1;
+
+	while (available > 0)
+	{
+		while (root >= 0 && a[root] == depth)
+		{
+			used++;
+			root--;
+		}
+		while (available > used)
+		{
+			a[next--] = depth;
+			available--;
+		}
+		available = 2 * used;
+		depth++;
+		used = 0;
+	}
+}
+
+/*
+	Builds code lengths of at most max_bits for symbols with non-zero
+	frequency.  At least two symbols get a code, which keeps the code
+	complete for strict decoders.
+*/
+static void build_code_lengths(const uint32_t* frequencies, int symbol_count, int max_bits, unsigned char* lengths)
+{
+	int symbols[DEFLATE_LITLEN_SYMBOLS];
+	int weights[DEFLATE_LITLEN_SYMBOLS];
+	int n = 0;
+
+	memset(lengths, 0, symbol_count);
+
+	for (int s = 0; s < symbol_count; s++)
+	{
+		if (frequencies[s]) symbols[n++] = s;
+	}
+	for (int s = 0; n < 2; s++)
+	{
+		if (!frequencies[s]) symbols[n++] = s;
+	}
+
+	// Insertion sort by frequency, the alphabets are small
+	for (int i = 1; i < n; i++)
+	{
+		int symbol = symbols[i];
+		int j = i;
+		while (j > 0 && frequencies[symbols[j - 1]] > frequencies[symbol])
+		{
+			symbols[j] = symbols[j - 1];
+			j--;
+		}
+		symbols[j] = symbol;
+	}
+
+	for (int i = 0; i < n; i++)
+	{
+		weights[i] = frequencies[symbols[i]] ? (int)frequencies[symbols[i]] : 1;
+	}
+
+	minimum_redundancy_lengths(weights, n);
+
+	// Clamp to max_bits, then lengthen short codes until the Kraft sum fits
+	int counts[32] = {0};
+	for (int i = 0; i < n; i++)
+	{
+		counts[weights[i] > max_bits ? max_bits : weights[i]]++;
+	}
+
+	uint32_t total = 0;
+	for (int bits = max_bits; bits > 0; bits--)
+	{
+		total += (uint32_t)counts[bits] << (max_bits - bits);
+	}
+
+	while (total != (1u << max_bits))
+	{
+		counts[max_bits]--;
+		for (int bits = max_bits - 1; bits > 0; bits--)
+		{
+			if (counts[bits])
+			{
+				counts[bits]--;
+				counts[bits + 1] += 2;
+				break;
+			}
+		}
+		total--;
+	}
+
+	// Most frequent symbols, at the end of the sorted list, get the shortest codes
+	int position = n;
+	for (int bits = 1; bits <= max_bits; bits++)
+	{
+		for (int i = 0; i < counts[bits]; i++)
+		{
+			lengths[symbols[--position]] = (unsigned char)bits;
+		}
+	}
+}
+
+/*
+	Canonical codes, bit-reversed since deflate sends Huffman codes
+	most significant bit first.
+*/
+static void build_codes(const unsigned char* lengths, int symbol_count, uint16_t* codes)
+{
+	int counts[16] = {0};
+	uint32_t next_code[16];
+
+	for (int s = 0; s < symbol_count; s++)
+	{
+		counts[lengths[s]]++;
+	}
+	counts[0] = 0;
+
+	uint32_t code = 0;
+	for (int bits = 1; bits < 16; bits++)
+	{
+		code = (code + counts[bits - 1]) << 1;
+		next_code[bits] = code;
+	}
+
+	for (int s = 0; s < symbol_count; s++)
+	{
+		int length = lengths[s];
+		uint32_t value = length ? next_code[length]++ : 0;
+
+		uint32_t reversed = 0;
+		for (int i = 0; i < length; i++)
+		{
+			reversed = reversed << 1 | ((value >> i) & 1);
+		}
+		codes[s] = (uint16_t)reversed;
+	}
+}
+
+/*
+	Run-length codes the literal/length and distance code lengths with
+	symbols 16 (repeat previous), 17 and 18 (runs of zeros).
+
+	@returns: number of items, each symbol | extra bits value << 8
+*/
+static int encode_code_lengths(const unsigned char* lengths, int count, uint32_t* items)
+{
+	int result = 0;
+	int i = 0;
+
+	while (i < count)
+	{
+		int length = lengths[i];
+		int run = 1;
+		while (i + run < count && lengths[i + run] == length) run++;
+
+		if (length == 0 && run >= 3)
+		{
+			if (run > 138) run = 138;
+			items[result++] = run >= 11 ? 18 | (uint32_t)(run - 11) << 8 : 17 | (uint32_t)(run - 3) << 8;
+		}
+		else if (length != 0 && run >= 4)
+		{
+			// The first one is sent as is, 16 repeats it
+			if (run > 7) run = 7;
+			items[result++] = (uint32_t)length;
+			items[result++] = 16 | (uint32_t)(run - 4) << 8;
+		}
+		else
+		{
+			run = 1;
+			items[result++] = (uint32_t)length;
+		}
+
+		i += run;
+	}
+
+	return result;
+}
+
+static void write_stored_blocks(BitWriter* writer, const unsigned char* data, size_t size)
+{
+	do
+	{
+		size_t length = size > DEFLATE_MAX_STORED ? DEFLATE_MAX_STORED : size;
+
+		put_bits(writer, 0, 3);		// Not final, stored
+		align_bits(writer);
+		put_bits(writer, (uint32_t)length, 16);
+		put_bits(writer, (uint32_t)~length & 0xFFFF, 16);
+		memcpy(writer->out, data, length);
+		writer->out += length;
+
+		data += length;
+		size -= length;
+	} while (size > 0);
+}
+
+/*
+	Writes tokens as one dynamic Huffman block, or as stored blocks of
+	the bytes they cover when that is smaller.
+*/
+static void write_block(BitWriter* writer, const uint32_t* tokens, int token_count, const unsigned char* data, size_t size)
+{
+	uint32_t litlen_frequencies[DEFLATE_LITLEN_SYMBOLS] = {0};
+	uint32_t distance_frequencies[DEFLATE_DIST_SYMBOLS] = {0};
+
+	for (int i = 0; i < token_count; i++)
+	{
+		uint32_t token = tokens[i];
+		if (token & DEFLATE_MATCH)
+		{
+			litlen_frequencies[257 + length_symbol((token >> 16) & 0x1FF)]++;
+			distance_frequencies[distance_symbol(token & 0xFFFF)]++;
+		}
+		else
+		{
+			litlen_frequencies[token]++;
+		}
+	}
+	litlen_frequencies[DEFLATE_END_OF_BLOCK] = 1;
+
+	unsigned char lengths[DEFLATE_LITLEN_SYMBOLS + DEFLATE_DIST_SYMBOLS];
+	unsigned char* litlen_lengths = lengths;
+	unsigned char* distance_lengths = lengths + DEFLATE_LITLEN_SYMBOLS;
+	build_code_lengths(litlen_frequencies, DEFLATE_LITLEN_SYMBOLS, 15, litlen_lengths);
+	build_code_lengths(distance_frequencies, DEFLATE_DIST_SYMBOLS, 15, distance_lengths);
+
+	int litlen_count = DEFLATE_LITLEN_SYMBOLS;
+	while (litlen_count > 257 && litlen_lengths[litlen_count - 1] == 0) litlen_count--;
+	int distance_count = DEFLATE_DIST_SYMBOLS;
+	while (distance_count > 1 && distance_lengths[distance_count - 1] == 0) distance_count--;
+
+	// Both length lists are sent back to back, and may be run-length coded across
+	unsigned char all_lengths[DEFLATE_LITLEN_SYMBOLS + DEFLATE_DIST_SYMBOLS];
+	memcpy(all_lengths, litlen_lengths, litlen_count);
+	memcpy(all_lengths + litlen_count, distance_lengths, distance_count);
+
+	uint32_t items[DEFLATE_LITLEN_SYMBOLS + DEFLATE_DIST_SYMBOLS];
+	int item_count = encode_code_lengths(all_lengths, litlen_count + distance_count, items);
+
+	uint32_t codelen_frequencies[DEFLATE_CODELEN_SYMBOLS] = {0};
+	for (int i = 0; i < item_count; i++)
+	{
+		codelen_frequencies[items[i] & 0xFF]++;
+	}
+
+	unsigned char codelen_lengths[DEFLATE_CODELEN_SYMBOLS];
+	build_code_lengths(codelen_frequencies, DEFLATE_CODELEN_SYMBOLS, 7, codelen_lengths);
+
+	int codelen_count = DEFLATE_CODELEN_SYMBOLS;
+	while (codelen_count > 4 && codelen_lengths[codelen_order[codelen_count - 1]] == 0) codelen_count--;
+
+	// Size in bits, to choose between Huffman and stored
+	static const unsigned char item_extra[3] = { 2, 3, 7 };
+	uint64_t bits = 3 + 5 + 5 + 4 + 3 * codelen_count;
+	for (int i = 0; i < item_count; i++)
+	{
+		int symbol = items[i] & 0xFF;
+		bits += codelen_lengths[symbol] + (symbol >= 16 ? item_extra[symbol - 16] : 0);
+	}
+	for (int s = 0; s < DEFLATE_LITLEN_SYMBOLS; s++)
+	{
+		bits += (uint64_t)litlen_frequencies[s] * (litlen_lengths[s] + (s > 256 ? length_extra[s - 257] : 0));
+	}
+	for (int s = 0; s < DEFLATE_DIST_SYMBOLS; s++)
+	{
+		bits += (uint64_t)distance_frequencies[s] * (distance_lengths[s] + distance_extra[s]);
+	}
+
+	uint64_t stored_bits = ((uint64_t)size + 5 * (size / DEFLATE_MAX_STORED + 1)) * 8 + 7;
+	if (bits >= stored_bits)
+	{
+		write_stored_blocks(writer, data, size);
+		return;
+	}
+
+	uint16_t litlen_codes[DEFLATE_LITLEN_SYMBOLS];
+	uint16_t distance_codes[DEFLATE_DIST_SYMBOLS];
+	uint16_t codelen_codes[DEFLATE_CODELEN_SYMBOLS];
+	build_codes(litlen_lengths, DEFLATE_LITLEN_SYMBOLS, litlen_codes);
+	build_codes(distance_lengths, DEFLATE_DIST_SYMBOLS, distance_codes);
+	build_codes(codelen_lengths, DEFLATE_CODELEN_SYMBOLS, codelen_codes);
+
+	put_bits(writer, 2 << 1, 3);		// Not final, dynamic Huffman
+	put_bits(writer, litlen_count - 257, 5);
+	put_bits(writer, distance_count - 1, 5);
+	put_bits(writer, codelen_count - 4, 4);
+	for (int i = 0; i < codelen_count; i++)
+	{
+		put_bits(writer, codelen_lengths[codelen_order[i]], 3);
+	}
+
+	for (int i = 0; i < item_count; i++)
+	{
+		int symbol = items[i] & 0xFF;
+		put_bits(writer, codelen_codes[symbol], codelen_lengths[symbol]);
+		if (symbol >= 16)
+		{
+			put_bits(writer, items[i] >> 8, item_extra[symbol - 16]);
+		}
+	}
+
+	for (int i = 0; i < token_count; i++)
+	{
+		uint32_t token = tokens[i];
+		if (token & DEFLATE_MATCH)
+		{
+			int length = (token >> 16) & 0x1FF;
+			int distance = token & 0xFFFF;
+			int length_code = length_symbol(length);
+			int distance_code = distance_symbol(distance);
+
+			put_bits(writer, litlen_codes[257 + length_code], litlen_lengths[257 + length_code]);
+			put_bits(writer, length - length_base[length_code], length_extra[length_code]);
+			put_bits(writer, distance_codes[distance_code], distance_lengths[distance_code]);
+			put_bits(writer, distance - distance_base[distance_code], distance_extra[distance_code]);
+		}
+		else
+		{
+			put_bits(writer, litlen_codes[token], litlen_lengths[token]);
+		}
+	}
+
+	put_bits(writer, litlen_codes[DEFLATE_END_OF_BLOCK], litlen_lengths[DEFLATE_END_OF_BLOCK]);
+}
+
+static uint32_t read_u32(const unsigned char* p)
+{
+	uint32_t result;
+	memcpy(&result, p, 4);
+	return result;
+}
+
+/*
+	Compresses data into non-final deflate blocks ending on a byte
+	boundary, so independently compressed strips can be concatenated.
+*/
+static unsigned char* deflate_strip(const unsigned char* data, size_t size, int pixel_bytes, int32_t* hash_table, uint32_t* tokens, unsigned char* out)
+{
+	BitWriter writer = { out, 0, 0 };
+
+	for (int i = 0; i < (1 << DEFLATE_HASH_BITS); i++)
+	{
+		hash_table[i] = -DEFLATE_WINDOW - 1;
+	}
+
+	size_t position = 0;
+	size_t block_start = 0;
+	int token_count = 0;
+
+	while (position < size)
+	{
+		uint32_t token = data[position];
+		size_t advance = 1;
+
+		if (position + DEFLATE_MIN_MATCH <= size)
+		{
+			uint32_t word = read_u32(data + position);
+			uint32_t hash = (word * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+			int32_t candidate = hash_table[hash];
+			hash_table[hash] = (int32_t)position;
+
+			size_t limit = size - position;
+			if (limit > DEFLATE_MAX_MATCH) limit = DEFLATE_MAX_MATCH;
+
+			// The pixel to the left is tried too, it catches flat areas with
+			// the cheapest distance code
+			int32_t candidates[2] = { (int32_t)position - pixel_bytes, candidate };
+			size_t best_length = 0;
+			int32_t best_distance = 0;
+
+			for (int i = 0; i < 2; i++)
+			{
+				int32_t distance = (int32_t)position - candidates[i];
+				if (candidates[i] < 0 || distance > DEFLATE_WINDOW || read_u32(data + candidates[i]) != word)
+				{
+					continue;
+				}
+
+				size_t length = DEFLATE_MIN_MATCH;
+				while (length < limit && data[candidates[i] + length] == data[position + length]) length++;
+
+				if (length > best_length)
+				{
+					best_length = length;
+					best_distance = distance;
+				}
+			}
+
+			if (best_length > 0)
+			{
+				token = DEFLATE_MATCH | (uint32_t)best_length << 16 | (uint32_t)best_distance;
+				advance = best_length;
+			}
+		}
+
+		tokens[token_count++] = token;
+		position += advance;
+
+		if (token_count == DEFLATE_BLOCK_TOKENS)
+		{
+			write_block(&writer, tokens, token_count, data + block_start, position - block_start);
+			block_start = position;
+			token_count = 0;
+		}
+	}
+
+	if (token_count > 0)
+	{
+		write_block(&writer, tokens, token_count, data + block_start, position - block_start);
+	}
+
+	// Empty stored block, a sync flush that byte-aligns the stream
+	put_bits(&writer, 0, 3);
+	align_bits(&writer);
+	put_bits(&writer, 0, 16);
+	put_bits(&writer, 0xFFFF, 16);
+
+	return writer.out;
+}
+
+static uint32_t adler32(const unsigned char* data, size_t size)
+{
+	uint32_t s1 = 1;
+	uint32_t s2 = 0;
+
+	while (size > 0)
+	{
+		// Largest block whose sums can't overflow before the modulo
+		size_t block = size < 5552 ? size : 5552;
+		for (size_t i = 0; i < block; i++)
+		{
+			s1 += data[i];
+			s2 += s1;
+		}
+		s1 %= ADLER_MOD;
+		s2 %= ADLER_MOD;
+
+		data += block;
+		size -= block;
+	}
+
+	return s2 << 16 | s1;
+}
+
+/*
+	Adler-32 of a followed by b, from the checksums of both.
+*/
+static uint32_t adler32_combine(uint32_t a, uint32_t b, size_t b_size)
+{
+	uint32_t remainder = (uint32_t)(b_size % ADLER_MOD);
+	uint32_t a1 = a & 0xFFFF;
+	uint32_t a2 = a >> 16;
+
+	uint32_t s1 = ((a1 + (b & 0xFFFF)) % ADLER_MOD + ADLER_MOD - 1) % ADLER_MOD;
+	uint32_t s2 = (uint32_t)(((uint64_t)a2 + (b >> 16) + (uint64_t)remainder * a1 + ADLER_MOD - remainder) % ADLER_MOD);
+
+	return s2 << 16 | s1;
+}
+
+static uint32_t crc32_update(const uint32_t* table, uint32_t crc, const unsigned char* data, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+static void put_u32_be(unsigned char* out, uint32_t value)
+{
+	out[0] = (unsigned char)(value >> 24);
+	out[1] = (unsigned char)(value >> 16);
+	out[2] = (unsigned char)(value >> 8);
+	out[3] = (unsigned char)value;
+}
+
+/*
+	Fills in the length, type and CRC of a chunk whose data already
+	sits at chunk + 8.
+
+	@returns: size of the whole chunk
+*/
+static size_t finish_chunk(const uint32_t* crc_table, unsigned char* chunk, const char* type, size_t data_size)
+{
+	put_u32_be(chunk, (uint32_t)data_size);
+	memcpy(chunk + 4, type, 4);
+
+	uint32_t crc = crc32_update(crc_table, 0xFFFFFFFFu, chunk + 4, data_size + 4);
+	put_u32_be(chunk + 8 + data_size, crc ^ 0xFFFFFFFFu);
+
+	return data_size + 12;
+}
+
+typedef struct png_strip_t
+{
+	unsigned char* filtered;
+	unsigned char* chunk;		// IDAT chunk of the compressed strip
+	size_t chunk_size;
+	uint32_t adler;
+	size_t filtered_size;
+
+	int32_t* hash_table;
+	uint32_t* tokens;
+} PngStrip;
+
+typedef struct png_job_t
+{
+	const unsigned char* buffer;
+	int width;
+	int height;
+	int bytes;					// Bytes per pixel, in and out
+	int rows_per_strip;
+	int first_strip;
+	PngStrip* strips;
+	uint32_t crc_table[256];
+} PngJob;
+
+static void png_encode_strip(void* data, int index)
+{
+	PngJob* job = (PngJob*)data;
+	PngStrip* strip = &job->strips[index];
+
+	int first_row = (job->first_strip + index) * job->rows_per_strip;
+	int last_row = first_row + job->rows_per_strip;
+	if (last_row > job->height) last_row = job->height;
+
+	size_t row_bytes = (size_t)job->width * job->bytes;
+	unsigned char* f = strip->filtered;
+
+	for (int y = first_row; y < last_row; y++)
+	{
+		// PNG rows are top-down and R, G, B(, A)
+		const unsigned char* row = job->buffer + (size_t)(job->height - 1 - y) * row_bytes;
+		const unsigned char* above = y > 0 ? row + row_bytes : NULL;
+
+		*f++ = PNG_FILTER_UP;
+
+		for (int x = 0; x < job->width; x++)
+		{
+			const unsigned char* p = row + (size_t)x * job->bytes;
+			unsigned char pixel[4] = { p[2], p[1], p[0], job->bytes == 4 ? p[3] : 0 };
+
+			if (above)
+			{
+				const unsigned char* q = above + (size_t)x * job->bytes;
+				pixel[0] -= q[2];
+				pixel[1] -= q[1];
+				pixel[2] -= q[0];
+				if (job->bytes == 4) pixel[3] -= q[3];
+			}
+
+			for (int c = 0; c < job->bytes; c++)
+			{
+				*f++ = pixel[c];
+			}
+		}
+	}
+
+	strip->filtered_size = (size_t)(f - strip->filtered);
+	strip->adler = adler32(strip->filtered, strip->filtered_size);
+
+	unsigned char* end = deflate_strip(strip->filtered, strip->filtered_size, job->bytes, strip->hash_table, strip->tokens, strip->chunk + 8);
+	strip->chunk_size = finish_chunk(job->crc_table, strip->chunk, "IDAT", (size_t)(end - (strip->chunk + 8)));
+}
+
+static int write_chunk(FILE* file, const uint32_t* crc_table, const char* type, const unsigned char* data, size_t size)
+{
+	unsigned char chunk[64];
+	assert(size + 12 <= sizeof(chunk));
+
+	if (size > 0)
+	{
+		memcpy(chunk + 8, data, size);
+	}
+	size_t chunk_size = finish_chunk(crc_table, chunk, type, size);
+
+	return fwrite(chunk, 1, chunk_size, file) == chunk_size;
+}
+
+int write_png_image(
+	const char* filename,
+	int width,
+	int height,
+	TGA_ImageDataType data_type,
+	const unsigned char* buffer)
+{
+	assert(buffer != 0);
+
+	FILE* file = fopen(filename, "wb");
+	if (!file)
+	{
+		return 0;
+	}
+	setvbuf(file, NULL, _IOFBF, TGA_WRITE_BUFFER_SIZE);
+
+	PngJob job = {0};
+	job.buffer = buffer;
+	job.width = width;
+	job.height = height;
+	job.bytes = data_type == RGBA ? 4 : 3;
+
+	for (uint32_t n = 0; n < 256; n++)
+	{
+		uint32_t c = n;
+		for (int k = 0; k < 8; k++)
+		{
+			c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+		}
+		job.crc_table[n] = c;
+	}
+
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	fwrite(signature, 1, sizeof(signature), file);
+
+	unsigned char header[13];
+	put_u32_be(header, (uint32_t)width);
+	put_u32_be(header + 4, (uint32_t)height);
+	header[8] = 8;							// Bits per channel
+	header[9] = job.bytes == 4 ? 6 : 2;		// RGBA or RGB
+	header[10] = 0;							// Deflate
+	header[11] = 0;							// Adaptive filtering
+	header[12] = 0;							// Not interlaced
+	write_chunk(file, job.crc_table, "IHDR", header, sizeof(header));
+
+	// zlib header: deflate with a 32K window, fastest level
+	static const unsigned char zlib_header[2] = { 0x78, 0x01 };
+	write_chunk(file, job.crc_table, "IDAT", zlib_header, sizeof(zlib_header));
+
+	size_t row_bytes = 1 + (size_t)width * job.bytes;
+	job.rows_per_strip = (int)(PNG_STRIP_BYTES / row_bytes);
+	if (job.rows_per_strip < 1) job.rows_per_strip = 1;
+
+	int strip_count = (height + job.rows_per_strip - 1) / job.rows_per_strip;
+	int batch_size = get_cpu_count();
+	if (batch_size > strip_count) batch_size = strip_count;
+
+	// Huffman blocks are only kept when smaller than stored ones
+	size_t max_filtered = job.rows_per_strip * row_bytes;
+	size_t max_chunk = 12 + max_filtered + 5 * (max_filtered / DEFLATE_MAX_STORED + 1) * (max_filtered / DEFLATE_BLOCK_TOKENS + 1) + 16;
+
+	job.strips = (PngStrip*)malloc(batch_size * sizeof(PngStrip));
+	for (int i = 0; i < batch_size; i++)
+	{
+		job.strips[i].filtered = (unsigned char*)malloc(max_filtered);
+		job.strips[i].chunk = (unsigned char*)malloc(max_chunk);
+		job.strips[i].hash_table = (int32_t*)malloc((1 << DEFLATE_HASH_BITS) * sizeof(int32_t));
+		job.strips[i].tokens = (uint32_t*)malloc(DEFLATE_BLOCK_TOKENS * sizeof(uint32_t));
+	}
+
+	uint32_t adler = 1;
+
+	for (job.first_strip = 0; job.first_strip < strip_count; job.first_strip += batch_size)
+	{
+		int count = strip_count - job.first_strip;
+		if (count > batch_size) count = batch_size;
+
+		parallel_for(count, png_encode_strip, &job);
+
+		for (int i = 0; i < count; i++)
+		{
+			fwrite(job.strips[i].chunk, 1, job.strips[i].chunk_size, file);
+			adler = adler32_combine(adler, job.strips[i].adler, job.strips[i].filtered_size);
+		}
+	}
+
+	for (int i = 0; i < batch_size; i++)
+	{
+		free(job.strips[i].filtered);
+		free(job.strips[i].chunk);
+		free(job.strips[i].hash_table);
+		free(job.strips[i].tokens);
+	}
+	free(job.strips);
+
+	// Final empty stored block, then the checksum of all filtered rows
+	unsigned char trailer[9] = { 0x01, 0x00, 0x00, 0xFF, 0xFF };
+	put_u32_be(trailer + 5, adler);
+	write_chunk(file, job.crc_table, "IDAT", trailer, sizeof(trailer));
+	write_chunk(file, job.crc_table, "IEND", NULL, 0);
+
+	int result = !ferror(file);
+	result &= fclose(file) == 0;
+
+	return result;
+}
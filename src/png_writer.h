@@ -0,0 +1,30 @@
+#ifndef PNG_WRITER_H
+#define PNG_WRITER_H
+
+#include "tga_image_loader.h"
+
+/*
+	PNG encoder tuned for speed over size.  The input is laid out as
+	for write_tga_image: rows bottom-up, pixels B, G, R(, A).
+
+	Every row uses the Up filter and deflate runs a single-probe LZ77
+	with dynamic Huffman blocks, about what zlib does at level 1.  The
+	image is cut in strips of rows, each compressed on its own core to
+	a byte-aligned run of deflate blocks in its own IDAT chunk; the
+	strips concatenate to one zlib stream, so any PNG reader decodes
+	the file.  Matches don't reach back across strips.
+*/
+
+#define PNG_STRIP_BYTES (1 << 20)		// Filtered bytes per strip, rounded to rows
+
+/*
+	@returns: 0 if the file couldn't be written
+*/
+int write_png_image(
+	const char* filename,
+	int width,
+	int height,
+	TGA_ImageDataType data_type,
+	const unsigned char* buffer);
+
+#endif // !PNG_WRITER_H
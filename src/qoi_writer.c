@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "qoi_writer.h"
+#include "thread.h"
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xC0
+#define QOI_OP_RGB 0xFE
+#define QOI_OP_RGBA 0xFF
+
+#define QOI_MAX_RUN 62
+
+// Pixels are packed as R | G << 8 | B << 16 | A << 24
+#define QOI_R(p) ((p) & 0xFF)
+#define QOI_G(p) (((p) >> 8) & 0xFF)
+#define QOI_B(p) (((p) >> 16) & 0xFF)
+#define QOI_A(p) ((p) >> 24)
+#define QOI_HASH(p) ((QOI_R(p) * 3 + QOI_G(p) * 5 + QOI_B(p) * 7 + QOI_A(p) * 11) % 64)
+
+/*
+	Last pixel seen for each index slot, as a decoder would have it
+	after a strip.  Slots whose bit is clear in used weren't touched.
+*/
+typedef struct qoi_strip_table_t
+{
+	uint32_t last[64];
+	uint64_t used;
+} QoiStripTable;
+
+typedef struct qoi_strip_t
+{
+	unsigned char* encoded;
+	size_t encoded_size;
+} QoiStrip;
+
+typedef struct qoi_job_t
+{
+	const unsigned char* buffer;
+	int width;
+	int height;
+	int bytes;				// Input bytes per pixel
+	int rows_per_strip;
+	int strip_count;
+
+	QoiStripTable* tables;	// One per strip
+	uint32_t* start_index;	// 64 entries per strip, the index it starts with
+
+	int first_strip;		// Strip of the current batch at index 0
+	QoiStrip* strips;
+} QoiJob;
+
+/*
+	Pixel x of row y counted from the top, the order QOI stores them in.
+*/
+static uint32_t qoi_get_pixel(const QoiJob* job, int x, int y)
+{
+	const unsigned char* p = job->buffer + ((size_t)(job->height - 1 - y) * job->width + x) * job->bytes;
+	uint32_t alpha = job->bytes == 4 ? p[3] : 255;
+
+	return (uint32_t)p[2] | (uint32_t)p[1] << 8 | (uint32_t)p[0] << 16 | alpha << 24;
+}
+
+static void qoi_hash_strip(void* data, int index)
+{
+	QoiJob* job = (QoiJob*)data;
+	QoiStripTable* table = &job->tables[index];
+
+	int first_row = index * job->rows_per_strip;
+	int last_row = first_row + job->rows_per_strip;
+	if (last_row > job->height) last_row = job->height;
+
+	table->used = 0;
+
+	for (int y = first_row; y < last_row; y++)
+	{
+		for (int x = 0; x < job->width; x++)
+		{
+			uint32_t pixel = qoi_get_pixel(job, x, y);
+			int slot = QOI_HASH(pixel);
+
+			table->last[slot] = pixel;
+			table->used |= (uint64_t)1 << slot;
+		}
+	}
+}
+
+static void qoi_encode_strip(void* data, int index)
+{
+	QoiJob* job = (QoiJob*)data;
+	QoiStrip* strip = &job->strips[index];
+	int strip_index = job->first_strip + index;
+
+	int first_row = strip_index * job->rows_per_strip;
+	int last_row = first_row + job->rows_per_strip;
+	if (last_row > job->height) last_row = job->height;
+
+	uint32_t color_index[64];
+	memcpy(color_index, job->start_index + strip_index * 64, sizeof(color_index));
+
+	uint32_t previous = 0xFF000000u;
+	if (strip_index > 0)
+	{
+		previous = qoi_get_pixel(job, job->width - 1, first_row - 1);
+	}
+
+	unsigned char* o = strip->encoded;
+	int run = 0;
+
+	for (int y = first_row; y < last_row; y++)
+	{
+		for (int x = 0; x < job->width; x++)
+		{
+			uint32_t pixel = qoi_get_pixel(job, x, y);
+
+			if (pixel == previous)
+			{
+				run++;
+				if (run == QOI_MAX_RUN)
+				{
+					*o++ = (unsigned char)(QOI_OP_RUN | (run - 1));
+					run = 0;
+				}
+				continue;
+			}
+
+			if (run > 0)
+			{
+				*o++ = (unsigned char)(QOI_OP_RUN | (run - 1));
+				run = 0;
+			}
+
+			int slot = QOI_HASH(pixel);
+
+			if (color_index[slot] == pixel)
+			{
+				*o++ = (unsigned char)(QOI_OP_INDEX | slot);
+			}
+			else
+			{
+				color_index[slot] = pixel;
+
+				if (QOI_A(pixel) == QOI_A(previous))
+				{
+					signed char dr = (signed char)(QOI_R(pixel) - QOI_R(previous));
+					signed char dg = (signed char)(QOI_G(pixel) - QOI_G(previous));
+					signed char db = (signed char)(QOI_B(pixel) - QOI_B(previous));
+					signed char dr_dg = (signed char)(dr - dg);
+					signed char db_dg = (signed char)(db - dg);
+
+					if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+					{
+						*o++ = (unsigned char)(QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+					}
+					else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7)
+					{
+						*o++ = (unsigned char)(QOI_OP_LUMA | (dg + 32));
+						*o++ = (unsigned char)((dr_dg + 8) << 4 | (db_dg + 8));
+					}
+					else
+					{
+						*o++ = QOI_OP_RGB;
+						*o++ = (unsigned char)QOI_R(pixel);
+						*o++ = (unsigned char)QOI_G(pixel);
+						*o++ = (unsigned char)QOI_B(pixel);
+					}
+				}
+				else
+				{
+					*o++ = QOI_OP_RGBA;
+					*o++ = (unsigned char)QOI_R(pixel);
+					*o++ = (unsigned char)QOI_G(pixel);
+					*o++ = (unsigned char)QOI_B(pixel);
+					*o++ = (unsigned char)QOI_A(pixel);
+				}
+			}
+
+			previous = pixel;
+		}
+	}
+
+	// Runs end with the strip, the next one starts a new run if needed
+	if (run > 0)
+	{
+		*o++ = (unsigned char)(QOI_OP_RUN | (run - 1));
+	}
+
+	strip->encoded_size = (size_t)(o - strip->encoded);
+}
+
+static void qoi_put_u32(unsigned char* out, uint32_t value)
+{
+	out[0] = (unsigned char)(value >> 24);
+	out[1] = (unsigned char)(value >> 16);
+	out[2] = (unsigned char)(value >> 8);
+	out[3] = (unsigned char)value;
+}
+
+int write_qoi_image(
+	const char* filename,
+	int width,
+	int height,
+	TGA_ImageDataType data_type,
+	const unsigned char* buffer)
+{
+	assert(buffer != 0);
+
+	FILE* file = fopen(filename, "wb");
+	if (!file)
+	{
+		return 0;
+	}
+	setvbuf(file, NULL, _IOFBF, TGA_WRITE_BUFFER_SIZE);
+
+	QoiJob job = {0};
+	job.buffer = buffer;
+	job.width = width;
+	job.height = height;
+	job.bytes = data_type == RGBA ? 4 : 3;
+
+	unsigned char header[14];
+	memcpy(header, QOI_MAGIC, 4);
+	qoi_put_u32(header + 4, (uint32_t)width);
+	qoi_put_u32(header + 8, (uint32_t)height);
+	header[12] = (unsigned char)job.bytes;
+	header[13] = 0;		// sRGB with linear alpha
+	fwrite(header, 1, sizeof(header), file);
+
+	job.rows_per_strip = QOI_STRIP_PIXELS / width;
+	if (job.rows_per_strip < 1) job.rows_per_strip = 1;
+	job.strip_count = (height + job.rows_per_strip - 1) / job.rows_per_strip;
+
+	// The index a strip starts with is the one left by all strips before it
+	job.tables = (QoiStripTable*)malloc(job.strip_count * sizeof(QoiStripTable));
+	job.start_index = (uint32_t*)calloc((size_t)job.strip_count * 64, sizeof(uint32_t));
+
+	parallel_for(job.strip_count, qoi_hash_strip, &job);
+
+	for (int s = 1; s < job.strip_count; s++)
+	{
+		const QoiStripTable* table = &job.tables[s - 1];
+		const uint32_t* before = job.start_index + (s - 1) * 64;
+		uint32_t* after = job.start_index + s * 64;
+
+		for (int slot = 0; slot < 64; slot++)
+		{
+			after[slot] = (table->used >> slot) & 1 ? table->last[slot] : before[slot];
+		}
+	}
+
+	int batch_size = get_cpu_count();
+	if (batch_size > job.strip_count) batch_size = job.strip_count;
+
+	// Worst case is a QOI_OP_RGBA for every pixel
+	size_t max_strip_bytes = (size_t)job.rows_per_strip * width * 5;
+
+	job.strips = (QoiStrip*)malloc(batch_size * sizeof(QoiStrip));
+	for (int i = 0; i < batch_size; i++)
+	{
+		job.strips[i].encoded = (unsigned char*)malloc(max_strip_bytes);
+	}
+
+	for (job.first_strip = 0; job.first_strip < job.strip_count; job.first_strip += batch_size)
+	{
+		int count = job.strip_count - job.first_strip;
+		if (count > batch_size) count = batch_size;
+
+		parallel_for(count, qoi_encode_strip, &job);
+
+		for (int i = 0; i < count; i++)
+		{
+			fwrite(job.strips[i].encoded, 1, job.strips[i].encoded_size, file);
+		}
+	}
+
+	static const unsigned char end_marker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+	fwrite(end_marker, 1, sizeof(end_marker), file);
+
+	for (int i = 0; i < batch_size; i++)
+	{
+		free(job.strips[i].encoded);
+	}
+	free(job.strips);
+	free(job.start_index);
+	free(job.tables);
+
+	int result = !ferror(file);
+	result &= fclose(file) == 0;
+
+	return result;
+}
@@ -0,0 +1,30 @@
+#ifndef QOI_WRITER_H
+#define QOI_WRITER_H
+
+#include "tga_image_loader.h"
+
+/*
+	QOI ("Quite OK Image") encoder.  The input is laid out as for
+	write_tga_image: rows bottom-up, pixels B, G, R(, A).
+
+	The image is encoded in strips of rows on all cores.  QOI is a
+	single stream whose running color index depends on every earlier
+	pixel, so the index each strip starts with is derived up front
+	from cheap per-strip hash tables; the output is the same kind of
+	stream a serial encoder produces, with runs broken at strip ends.
+*/
+
+#define QOI_MAGIC "qoif"
+#define QOI_STRIP_PIXELS (1 << 18)		// Pixels per strip, rounded to rows
+
+/*
+	@returns: 0 if the file couldn't be written
+*/
+int write_qoi_image(
+	const char* filename,
+	int width,
+	int height,
+	TGA_ImageDataType data_type,
+	const unsigned char* buffer);
+
+#endif // !QOI_WRITER_H
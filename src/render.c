@@ -1,13 +1,122 @@
 #include "render.h"
+#include "thread.h"
 
-void init_z_buffer(float* z_buffer, int width, int height)
+// Planes up to this size are cleared on the calling thread
+#define CLEAR_JOB_BYTES (1 << 20)
+
+// Planes this large don't stay in cache until they're drawn to, the
+// clear writes them with non-temporal stores that skip it
+#define CLEAR_STREAM_BYTES (1 << 23)
+
+typedef struct clear_job_t
+{
+	unsigned char* memory;
+	size_t bytes;
+	size_t job_bytes;			// Multiple of 64, so jobs don't share cache lines
+	uint32_t pattern;
+	int stream;
+} ClearJob;
+
+/*
+	Repeats the 4 byte pattern over bytes at memory, which is 4 byte
+	aligned.  A trailing partial word gets the first bytes of pattern.
+*/
+static void fill_pattern(unsigned char* memory, size_t bytes, uint32_t pattern, int stream)
+{
+	uint32_t* words = (uint32_t*)memory;
+	size_t word_count = bytes / 4;
+	size_t i = 0;
+
+#if RENDER_SSE2
+	for (; i < word_count && ((uintptr_t)(words + i) & 15); i++)
+	{
+		words[i] = pattern;
+	}
+
+	// A cache line per iteration, whole lines combine in the write buffers
+	__m128i value = _mm_set1_epi32((int)pattern);
+	if (stream)
+	{
+		for (; i + 16 <= word_count; i += 16)
+		{
+			_mm_stream_si128((__m128i*)(words + i), value);
+			_mm_stream_si128((__m128i*)(words + i + 4), value);
+			_mm_stream_si128((__m128i*)(words + i + 8), value);
+			_mm_stream_si128((__m128i*)(words + i + 12), value);
+		}
+		_mm_sfence();
+	}
+	else
+	{
+		for (; i + 4 <= word_count; i += 4)
+		{
+			_mm_store_si128((__m128i*)(words + i), value);
+		}
+	}
+#endif
+
+	for (; i < word_count; i++)
+	{
+		words[i] = pattern;
+	}
+	memcpy(memory + word_count * 4, &pattern, bytes & 3);
+}
+
+static void clear_job(void* data, int index)
+{
+	ClearJob* job = (ClearJob*)data;
+
+	size_t first = (size_t)index * job->job_bytes;
+	size_t bytes = job->bytes - first;
+	if (bytes > job->job_bytes) bytes = job->job_bytes;
+
+	fill_pattern(job->memory + first, bytes, job->pattern, job->stream);
+}
+
+/*
+	Fills a plane with pattern, split in one contiguous range per thread.
+*/
+static void clear_plane(void* memory, size_t bytes, uint32_t pattern)
+{
+	ClearJob job;
+	job.memory = (unsigned char*)memory;
+	job.bytes = bytes;
+	job.pattern = pattern;
+	job.stream = bytes >= CLEAR_STREAM_BYTES;
+
+	int job_count = 1;
+	if (bytes > CLEAR_JOB_BYTES)
+	{
+		job_count = get_cpu_count();
+	}
+
+	job.job_bytes = (bytes / job_count + 63) & ~(size_t)63;
+	if (job.job_bytes == 0) job.job_bytes = 64;
+	job_count = (int)((bytes + job.job_bytes - 1) / job.job_bytes);
+
+	// Clears come every frame, on threads that are kept around
+	pooled_parallel_for(job_count, clear_job, &job);
+}
+
+/*
+	@returns: bits of the farthest depth of the format, repeated to 32 bits
+*/
+static uint32_t depth_clear_pattern(DepthFormat format)
 {
-	int length = width * height;
-	for (int i = 0; i < length; i++)
+	uint32_t result = 0;
+
+	if (format == DEPTH_FLOAT32)
 	{
-		//z_buffer[i] = 0.0f;
-		z_buffer[i] = -1.0f * FLT_MAX;
+		float far = -1.0f * FLT_MAX;
+		memcpy(&result, &far, sizeof(result));
 	}
+
+	return result;
+}
+
+void init_z_buffer(float* z_buffer, int width, int height)
+{
+	clear_plane(z_buffer, (size_t)width * height * sizeof(float), depth_clear_pattern(DEPTH_FLOAT32));
 }
 
 void free_z_buffer(float* z_buffer)
@@ -23,18 +132,411 @@ void init_frame_buffer(
 	unsigned int width,
 	unsigned int height,
 	unsigned int bytes_per_pixel)
+{
+	init_frame_buffer_format(buffer, width, height, bytes_per_pixel, FRAME_BUFFER_LINEAR, DEPTH_FLOAT32, 1);
+}
+
+/*
+	@returns: bytes of depth per pixel, all samples
+*/
+static size_t depth_pixel_bytes(const FrameBuffer* buffer)
+{
+	size_t result = depth_format_bytes(buffer->depth_format);
+	if (buffer->samples)
+	{
+		result *= buffer->sample_count;
+	}
+
+	return result;
+}
+
+void init_frame_buffer_format(
+	FrameBuffer* buffer,
+	unsigned int width,
+	unsigned int height,
+	unsigned int bytes_per_pixel,
+	FrameBufferLayout layout,
+	DepthFormat depth_format,
+	int sample_count)
 {
 	if (!buffer) return;
 
+	if ((sample_count != 2 && sample_count != 4 && sample_count != 8) || bytes_per_pixel != 4)
+	{
+		sample_count = 1;
+	}
+
 	buffer->width = width;
 	buffer->height = height;
 	buffer->bytes_per_pixel = bytes_per_pixel;
+	buffer->layout = layout;
+	buffer->tiles_x = (width + FRAME_BUFFER_TILE_SIZE - 1) / FRAME_BUFFER_TILE_SIZE;
+	buffer->tiles_y = (height + FRAME_BUFFER_TILE_SIZE - 1) / FRAME_BUFFER_TILE_SIZE;
+	buffer->depth_format = depth_format;
+	buffer->depth_near = DEPTH_DEFAULT_NEAR;
+	buffer->depth_far = DEPTH_DEFAULT_FAR;
+	buffer->clear_color = 0;
+	buffer->sample_count = sample_count;
+
+	size_t pixels = frame_buffer_pixel_count(buffer);
+
+	buffer->samples = NULL;
+	if (sample_count > 1)
+	{
+		buffer->samples = (SampleStorage*)calloc(1, sizeof(SampleStorage));
+		buffer->samples->slots = (uint32_t*)calloc(pixels, sizeof(uint32_t));
+	}
+
+	buffer->tile_state = NULL;
+	if (layout == FRAME_BUFFER_TILED)
+	{
+		size_t tiles = (size_t)buffer->tiles_x * buffer->tiles_y;
+		buffer->tile_state = (unsigned char*)malloc(tiles);
+		memset(buffer->tile_state, TILE_COLOR_CLEARED | TILE_DEPTH_CLEARED, tiles);
+	}
+
+	buffer->memory = NULL;
+	if (bytes_per_pixel)
+	{
+		buffer->memory = calloc(pixels * bytes_per_pixel, sizeof(char));
+	}
+
+	buffer->z_buffer = NULL;
+	if (depth_format != DEPTH_NONE)
+	{
+		buffer->z_buffer = malloc(pixels * depth_pixel_bytes(buffer));
+		clear_z_buffer(buffer);
+	}
+}
+
+size_t frame_buffer_pixel_count(const FrameBuffer* buffer)
+{
+	size_t result = (size_t)buffer->width * buffer->height;
+
+	if (buffer->layout == FRAME_BUFFER_TILED)
+	{
+		result = (size_t)buffer->tiles_x * buffer->tiles_y * FRAME_BUFFER_TILE_SIZE * FRAME_BUFFER_TILE_SIZE;
+	}
+
+	return result;
+}
+
+size_t depth_format_bytes(DepthFormat format)
+{
+	size_t result = 0;
+
+	switch (format)
+	{
+		case DEPTH_FLOAT32:
+		case DEPTH_FLOAT32_REVERSED:
+		case DEPTH_UNORM24_STENCIL8: result = 4; break;
+		case DEPTH_UNORM16: result = 2; break;
+		default: break;
+	}
+
+	return result;
+}
+
+/*
+	Fills pixels of color, any bytes per pixel.
+*/
+static void fill_color(void* memory, size_t pixels, int bytes_per_pixel, uint32_t color, int stream)
+{
+	if (bytes_per_pixel == 4)
+	{
+		fill_pattern((unsigned char*)memory, pixels * 4, color, stream);
+	}
+	else
+	{
+		// Little endian, the low bytes are the ones a pixel keeps
+		unsigned char* out = (unsigned char*)memory;
+		for (size_t i = 0; i < pixels; i++)
+		{
+			memcpy(out + i * bytes_per_pixel, &color, bytes_per_pixel);
+		}
+	}
+}
+
+/*
+	Fills the planes of a tile still marked cleared, before it's drawn to.
+*/
+static void resolve_tile(const FrameBuffer* buffer, size_t tile)
+{
+	const size_t tile_pixels = FRAME_BUFFER_TILE_SIZE * FRAME_BUFFER_TILE_SIZE;
+	unsigned char state = buffer->tile_state[tile];
+
+	if ((state & TILE_COLOR_CLEARED) && buffer->memory)
+	{
+		unsigned char* color = (unsigned char*)buffer->memory + tile * tile_pixels * buffer->bytes_per_pixel;
+		fill_color(color, tile_pixels, buffer->bytes_per_pixel, buffer->clear_color, 0);
+
+		if (buffer->samples)
+		{
+			fill_pattern((unsigned char*)(buffer->samples->slots + tile * tile_pixels), tile_pixels * sizeof(uint32_t), 0, 0);
+		}
+	}
+
+	if ((state & TILE_DEPTH_CLEARED) && buffer->z_buffer)
+	{
+		size_t bytes = tile_pixels * depth_pixel_bytes(buffer);
+		unsigned char* depth = (unsigned char*)buffer->z_buffer + tile * bytes;
+		fill_pattern(depth, bytes, depth_clear_pattern(buffer->depth_format), 0);
+	}
+
+	buffer->tile_state[tile] = 0;
+}
+
+/*
+	Readies the tile of pixel (x, y) for drawing.
+*/
+static void touch_tile(const FrameBuffer* buffer, unsigned int x, unsigned int y)
+{
+	if (buffer->tile_state)
+	{
+		size_t tile = (size_t)(y >> FRAME_BUFFER_TILE_SHIFT) * buffer->tiles_x + (x >> FRAME_BUFFER_TILE_SHIFT);
+		if (buffer->tile_state[tile])
+		{
+			resolve_tile(buffer, tile);
+		}
+	}
+}
+
+void resolve_frame_buffer(FrameBuffer* buffer)
+{
+	if (!buffer->tile_state) return;
+
+	size_t tiles = (size_t)buffer->tiles_x * buffer->tiles_y;
+	for (size_t i = 0; i < tiles; i++)
+	{
+		if (buffer->tile_state[i])
+		{
+			resolve_tile(buffer, i);
+		}
+	}
+}
+
+void clear_z_buffer(FrameBuffer* buffer)
+{
+	if (!buffer->z_buffer) return;
+
+	if (buffer->tile_state)
+	{
+		size_t tiles = (size_t)buffer->tiles_x * buffer->tiles_y;
+		for (size_t i = 0; i < tiles; i++)
+		{
+			buffer->tile_state[i] |= TILE_DEPTH_CLEARED;
+		}
+		return;
+	}
+
+	size_t bytes = frame_buffer_pixel_count(buffer) * depth_pixel_bytes(buffer);
+	clear_plane(buffer->z_buffer, bytes, depth_clear_pattern(buffer->depth_format));
+}
+
+void clear_color_buffer(FrameBuffer* buffer, u32 color)
+{
+	if (!buffer->memory) return;
+
+	// Every slot is released, tiles drop theirs when filled
+	if (buffer->samples)
+	{
+		buffer->samples->count = 0;
+	}
+
+	if (buffer->tile_state)
+	{
+		size_t tiles = (size_t)buffer->tiles_x * buffer->tiles_y;
+		for (size_t i = 0; i < tiles; i++)
+		{
+			buffer->tile_state[i] |= TILE_COLOR_CLEARED;
+		}
+		buffer->clear_color = color;
+		return;
+	}
+
+	size_t pixels = frame_buffer_pixel_count(buffer);
+
+	if (buffer->samples)
+	{
+		clear_plane(buffer->samples->slots, pixels * sizeof(uint32_t), 0);
+	}
+
+	if (buffer->bytes_per_pixel == 4)
+	{
+		clear_plane(buffer->memory, pixels * 4, color);
+	}
+	else
+	{
+		fill_color(buffer->memory, pixels, buffer->bytes_per_pixel, color, 0);
+	}
+}
+
+float frame_buffer_depth(const FrameBuffer* buffer, float clip_z, float inv_w)
+{
+	float result = clip_z;
+
+	if (buffer->depth_format == DEPTH_FLOAT32_REVERSED)
+	{
+		// Negative behind the camera, never passes
+		result = buffer->depth_near * inv_w;
+	}
+	else if (buffer->depth_format == DEPTH_UNORM16 || buffer->depth_format == DEPTH_UNORM24_STENCIL8)
+	{
+		float near = buffer->depth_near;
+		float far = buffer->depth_far;
+
+		result = near * (far * inv_w - 1.0f) / (far - near);
+		if (result < 0.0f) result = 0.0f;
+		if (result > 1.0f) result = 1.0f;
+	}
+
+	return result;
+}
+
+/*
+	Writes depth at index if it's closer than the stored one.
+	@returns: 1 if the fragment passed, 0 otherwise.
+*/
+static int depth_test(const FrameBuffer* buffer, size_t index, float depth)
+{
+	int result = 0;
+
+	switch (buffer->depth_format)
+	{
+		case DEPTH_FLOAT32:
+		case DEPTH_FLOAT32_REVERSED:
+		{
+			float* stored = (float*)buffer->z_buffer + index;
+			if (depth > *stored)
+			{
+				*stored = depth;
+				result = 1;
+			}
+		} break;
+		case DEPTH_UNORM16:
+		{
+			uint16_t* stored = (uint16_t*)buffer->z_buffer + index;
+			uint16_t value = (uint16_t)(depth * 65535.0f + 0.5f);
+			if (value > *stored)
+			{
+				*stored = value;
+				result = 1;
+			}
+		} break;
+		case DEPTH_UNORM24_STENCIL8:
+		{
+			uint32_t* stored = (uint32_t*)buffer->z_buffer + index;
+			uint32_t value = (uint32_t)(depth * 16777215.0f + 0.5f) << 8;
+			if (value > (*stored & 0xFFFFFF00u))
+			{
+				*stored = value | (*stored & 0xFFu);
+				result = 1;
+			}
+		} break;
+		default:
+			result = 1;
+			break;
+	}
+
+	return result;
+}
+
+typedef struct linearize_job_t
+{
+	const FrameBuffer* buffer;
+	unsigned char* out;
+} LinearizeJob;
+
+/*
+	Averages the samples of count pixels from index, which are
+	contiguous in memory.
+*/
+static void resolve_samples(const FrameBuffer* buffer, size_t index, int count, uint32_t* out)
+{
+	const uint32_t* colors = (const uint32_t*)buffer->memory + index;
+	const uint32_t* slots = buffer->samples->slots + index;
+	int sample_count = buffer->sample_count;
+	int shift = sample_count == 8 ? 3 : (sample_count == 4 ? 2 : 1);
+
+	for (int i = 0; i < count; i++)
+	{
+		uint32_t slot = slots[i];
+		if (!slot || (slot & SAMPLE_SLOT_UNIFORM))
+		{
+			out[i] = colors[i];
+			continue;
+		}
+
+		const uint32_t* samples = buffer->samples->colors + (size_t)(slot - 1) * sample_count;
+
+		uint32_t resolved = 0;
+		for (int channel = 0; channel < 32; channel += 8)
+		{
+			uint32_t sum = sample_count >> 1;
+			for (int s = 0; s < sample_count; s++)
+			{
+				sum += (samples[s] >> channel) & 0xFF;
+			}
+			resolved |= (sum >> shift) << channel;
+		}
+		out[i] = resolved;
+	}
+}
+
+/*
+	Copies one row of tiles, a block row of pixels at a time.  Tiles
+	never drawn to are filled with the clear color instead.  Also used
+	for linear multisampled buffers, as rows of 64 pixel high bands.
+*/
+static void linearize_tile_row(void* data, int index)
+{
+	LinearizeJob* job = (LinearizeJob*)data;
+	const FrameBuffer* buffer = job->buffer;
+	int bytes = buffer->bytes_per_pixel;
+
+	int first_row = index * FRAME_BUFFER_TILE_SIZE;
+	int last_row = first_row + FRAME_BUFFER_TILE_SIZE;
+	if (last_row > buffer->height) last_row = buffer->height;
+
+	for (int y = first_row; y < last_row; y++)
+	{
+		unsigned char* out = job->out + (size_t)y * buffer->width * bytes;
+
+		for (int x = 0; x < buffer->width; x += FRAME_BUFFER_BLOCK_SIZE)
+		{
+			int count = buffer->width - x;
+			if (count > FRAME_BUFFER_BLOCK_SIZE) count = FRAME_BUFFER_BLOCK_SIZE;
+
+			size_t tile = (size_t)index * buffer->tiles_x + (x >> FRAME_BUFFER_TILE_SHIFT);
+			if (buffer->tile_state && (buffer->tile_state[tile] & TILE_COLOR_CLEARED))
+			{
+				fill_color(out + (size_t)x * bytes, count, bytes, buffer->clear_color, 0);
+				continue;
+			}
+
+			size_t first = frame_buffer_index(buffer, x, y);
+			if (buffer->samples)
+			{
+				resolve_samples(buffer, first, count, (uint32_t*)(out + (size_t)x * bytes));
+				continue;
+			}
+
+			const unsigned char* in = (const unsigned char*)buffer->memory + first * bytes;
+			memcpy(out + (size_t)x * bytes, in, (size_t)count * bytes);
+		}
+	}
+}
 
-	int bytes = height * width * bytes_per_pixel;
+void linearize_frame_buffer(const FrameBuffer* buffer, void* out)
+{
+	if (frame_buffer_is_linear(buffer))
+	{
+		memcpy(out, buffer->memory, (size_t)buffer->width * buffer->height * buffer->bytes_per_pixel);
+		return;
+	}
 
-	buffer->memory = calloc(bytes, sizeof(char));
-	buffer->z_buffer = (float*)malloc(width * height * sizeof(float));
-	init_z_buffer(buffer->z_buffer, width, height);
+	LinearizeJob job = { buffer, (unsigned char*)out };
+	parallel_for(buffer->tiles_y, linearize_tile_row, &job);
 }
 
 void free_frame_buffer(FrameBuffer* buffer)
@@ -46,6 +548,20 @@ void free_frame_buffer(FrameBuffer* buffer)
 			free(buffer->memory);
 		}
 
+		free_z_buffer(buffer->z_buffer);
+		free(buffer->tile_state);
+		buffer->memory = NULL;
+		buffer->z_buffer = NULL;
+		buffer->tile_state = NULL;
+
+		if (buffer->samples)
+		{
+			free(buffer->samples->slots);
+			free(buffer->samples->colors);
+			free(buffer->samples);
+			buffer->samples = NULL;
+		}
+
 		buffer->width = 0;
 		buffer->height = 0;
 		buffer->bytes_per_pixel = 0;
@@ -88,22 +604,101 @@ void draw_pixel(
 	fprintf(logfile, "draw_pixel: x = %d, y = %d, color = %x\n", x, y, color);
 #endif
 
-	uint8_t* row = (uint8_t*)buffer->memory; // first row
-	row += buffer->bytes_per_pixel * buffer->width * y; // offset in y
-
 	/*
 		TODO - currently, the fucntion assumes bytes_per_pixel = 4,
 		modify later
 	*/
-	uint32_t* pixel = (uint32_t*)row;
-	pixel += x; // offset in x
+	touch_tile(buffer, x, y);
+
+	size_t index = frame_buffer_index(buffer, x, y);
+	uint32_t* pixel = (uint32_t*)buffer->memory + index;
 
 	*pixel = color;
+
+	// Every sample takes the color
+	if (buffer->samples && buffer->samples->slots[index])
+	{
+		buffer->samples->slots[index] |= SAMPLE_SLOT_UNIFORM;
+	}
+}
+
+/*
+	@returns: a new slot, 1 + its index
+*/
+static uint32_t allocate_sample_slot(SampleStorage* storage, int sample_count)
+{
+	if (storage->count == storage->capacity)
+	{
+		storage->capacity = storage->capacity ? storage->capacity * 2 : 4096;
+		storage->colors = (uint32_t*)realloc(storage->colors, storage->capacity * sample_count * sizeof(uint32_t));
+	}
+
+	storage->count++;
+	uint32_t result = (uint32_t)storage->count;
+
+	return result;
+}
+
+/*
+	Writes color to the samples in mask of the pixel at index.  The pixel
+	only gets per sample colors while they differ.
+*/
+static void draw_samples(const FrameBuffer* buffer, size_t index, uint32_t mask, uint32_t color)
+{
+	SampleStorage* storage = buffer->samples;
+	int sample_count = buffer->sample_count;
+	uint32_t full_mask = (1u << sample_count) - 1;
+	uint32_t* colors = (uint32_t*)buffer->memory;
+	uint32_t slot = storage->slots[index];
+	int expanded = slot && !(slot & SAMPLE_SLOT_UNIFORM);
+
+	if (mask == full_mask || (!expanded && colors[index] == color))
+	{
+		colors[index] = color;
+		if (expanded)
+		{
+			storage->slots[index] = slot | SAMPLE_SLOT_UNIFORM;
+		}
+		return;
+	}
+
+	if (!expanded)
+	{
+		if (!slot)
+		{
+			slot = allocate_sample_slot(storage, sample_count);
+		}
+		slot &= ~SAMPLE_SLOT_UNIFORM;
+		storage->slots[index] = slot;
+
+		uint32_t* samples = storage->colors + (size_t)(slot - 1) * sample_count;
+		for (int s = 0; s < sample_count; s++)
+		{
+			samples[s] = colors[index];
+		}
+	}
+
+	uint32_t* samples = storage->colors + (size_t)(slot - 1) * sample_count;
+	int is_uniform = 1;
+	for (int s = 0; s < sample_count; s++)
+	{
+		if (mask & (1u << s))
+		{
+			samples[s] = color;
+		}
+		is_uniform &= samples[s] == color;
+	}
+
+	if (is_uniform)
+	{
+		colors[index] = color;
+		storage->slots[index] = slot | SAMPLE_SLOT_UNIFORM;
+	}
 }
 
 /*
 	x, y - screen coordinates
-	z - depth
+	z - depth, in the format of frame_buffer_depth
 */
 void draw_pixel_3d(
 	const FrameBuffer* buffer,
@@ -114,14 +709,33 @@ void draw_pixel_3d(
 	uint32_t ARGB_color)
 {
 	// if outside screen boundaries, then discard
-	if (x > buffer->width || y > buffer->height) return;
+	if (x >= buffer->width || y >= buffer->height) return;
+
+	if (buffer->samples)
+	{
+		touch_tile(buffer, x, y);
 
-	if (buffer->z_buffer)
+		size_t index = frame_buffer_index(buffer, x, y);
+		uint32_t mask = (1u << buffer->sample_count) - 1;
+		if (buffer->z_buffer)
+		{
+			mask = 0;
+			for (int s = 0; s < buffer->sample_count; s++)
+			{
+				mask |= (uint32_t)depth_test(buffer, index * buffer->sample_count + s, z) << s;
+			}
+		}
+
+		if (mask)
+		{
+			draw_samples(buffer, index, mask, ARGB_color);
+		}
+	}
+	else if (buffer->z_buffer)
 	{
-		int index = x + y * buffer->width;
-		if (z > buffer->z_buffer[index])
+		touch_tile(buffer, x, y);
+		if (depth_test(buffer, frame_buffer_index(buffer, x, y), z))
 		{
-			buffer->z_buffer[index] = z;
 			draw_pixel(buffer, x, y, ARGB_color);
 		}
 	}
@@ -392,57 +1006,321 @@ AABB find_AABB(vec2i* points, u32 array_count)
 	return result;
 }
 
-void draw_AABB(FrameBuffer* buffer, AABB box, u32 ARGB_color)
-{
-	// bottom hirozintal
-	draw_line(buffer, box.min.x, box.min.y, box.max.x, box.min.y, ARGB_color);
+void draw_AABB(FrameBuffer* buffer, AABB box, u32 ARGB_color)
+{
+	// bottom hirozintal
+	draw_line(buffer, box.min.x, box.min.y, box.max.x, box.min.y, ARGB_color);
+
+	// right vertical
+	draw_line(buffer, box.max.x, box.min.y, box.max.x, box.max.y, ARGB_color);
+
+	// top horizontal
+	draw_line(buffer, box.max.x, box.max.y, box.min.x, box.max.y, ARGB_color);
+
+	// left vertical
+	draw_line(buffer, box.min.x, box.max.y, box.min.x, box.min.y, ARGB_color);
+}
+
+mat4 get_viewport_mat4(int x, int y, int width, int height, int near, int far)
+{
+	mat4 result =
+	{
+		0.5f * width, 0, 0, x + 0.5f * width,
+		0, 0.5f * height, 0, y + 0.5f * height,
+		0, 0, 1, 0,
+		0, 0, 0, 1
+	};
+
+	return result;
+}
+
+/*
+	Nearest texel of the given mip level.
+
+	@returns: packed ARGB32 texel
+*/
+u32 sample_texture_nearest(const Texture* texture, int level, vec2 tex_coords_uv)
+{
+	const TextureLevel* mip = &texture->levels[level];
+
+	int width = mip->width;
+	int height = mip->height;
+
+	float u = tex_coords_uv.x;
+	float v = tex_coords_uv.y;
+
+	if (texture->wrap == TEXTURE_WRAP_REPEAT)
+	{
+		u -= floorf(u);
+		v -= floorf(v);
+	}
+	else
+	{
+		u = fminf(fmaxf(u, 0.0f), 1.0f);
+		v = fminf(fmaxf(v, 0.0f), 1.0f);
+	}
+
+	int x = roundf(lerp(0, width - 1, u));
+	int y = roundf(lerp(0, height - 1, v));
+
+	u32 result = fetch_texel(texture, mip, x, y);
+
+	return result;
+}
+
+/*
+	Bilinear filtering in fixed point.
+
+	Texel coordinates carry 8 fractional bits, so the integer part is
+	the texel address and the low byte is the blend weight.  The four
+	texels are widened to 16-bit lanes and blended with integer SIMD
+	(two texels per register) where SSE2 is available, or with the
+	packed 32-bit lerp otherwise.
+
+	@returns: packed ARGB32 color
+*/
+u32 sample_texture_bilinear(const Texture* texture, int level, vec2 tex_coords_uv)
+{
+	const TextureLevel* mip = &texture->levels[level];
+
+	int width = mip->width;
+	int height = mip->height;
+
+	float u = tex_coords_uv.x;
+	float v = tex_coords_uv.y;
+
+	if (texture->wrap == TEXTURE_WRAP_REPEAT)
+	{
+		u -= floorf(u);
+		v -= floorf(v);
+	}
+
+	// Texel centers are at half-integers, shift by half a texel (128)
+	int fx = (int)(u * (width << 8)) - 128;
+	int fy = (int)(v * (height << 8)) - 128;
+
+	int x0 = fx >> 8;
+	int y0 = fy >> 8;
+	u32 weight_x = fx & 0xFF;
+	u32 weight_y = fy & 0xFF;
+
+	int x1 = x0 + 1;
+	int y1 = y0 + 1;
+
+	if (texture->wrap == TEXTURE_WRAP_REPEAT)
+	{
+		// fx is in [-128, width * 256 - 128), so x0 is in [-1, width - 1]
+		if (x0 < 0) x0 = width - 1;
+		if (y0 < 0) y0 = height - 1;
+		if (x1 >= width) x1 = 0;
+		if (y1 >= height) y1 = 0;
+	}
+	else
+	{
+		x0 = x0 < 0 ? 0 : (x0 >= width ? width - 1 : x0);
+		y0 = y0 < 0 ? 0 : (y0 >= height ? height - 1 : y0);
+		x1 = x1 < 0 ? 0 : (x1 >= width ? width - 1 : x1);
+		y1 = y1 < 0 ? 0 : (y1 >= height ? height - 1 : y1);
+	}
+
+	u32 texel00 = fetch_texel(texture, mip, x0, y0);
+	u32 texel10 = fetch_texel(texture, mip, x1, y0);
+	u32 texel01 = fetch_texel(texture, mip, x0, y1);
+	u32 texel11 = fetch_texel(texture, mip, x1, y1);
+
+#if RENDER_SSE2
+	__m128i zero = _mm_setzero_si128();
+	__m128i half = _mm_set1_epi16(128);
+
+	// Lanes 0-3: left column texel, lanes 4-7: right column texel
+	__m128i row0 = _mm_unpacklo_epi8(_mm_set_epi32(0, 0, (int)texel10, (int)texel00), zero);
+	__m128i row1 = _mm_unpacklo_epi8(_mm_set_epi32(0, 0, (int)texel11, (int)texel01), zero);
+
+	// Vertical blend, at most 255 * 256 + 128 per lane, fits unsigned 16 bits
+	__m128i column = _mm_add_epi16(
+		_mm_mullo_epi16(row0, _mm_set1_epi16((short)(256 - weight_y))),
+		_mm_mullo_epi16(row1, _mm_set1_epi16((short)weight_y)));
+	column = _mm_srli_epi16(_mm_add_epi16(column, half), 8);
+
+	// Horizontal blend, then add the right half onto the left half
+	__m128i weights = _mm_set_epi16(
+		(short)weight_x, (short)weight_x, (short)weight_x, (short)weight_x,
+		(short)(256 - weight_x), (short)(256 - weight_x), (short)(256 - weight_x), (short)(256 - weight_x));
+	__m128i blend = _mm_mullo_epi16(column, weights);
+	blend = _mm_add_epi16(blend, _mm_srli_si128(blend, 8));
+	blend = _mm_srli_epi16(_mm_add_epi16(blend, half), 8);
+
+	u32 result = (u32)_mm_cvtsi128_si32(_mm_packus_epi16(blend, blend));
+#else
+	u32 row0 = lerp_color_ARGB32(texel00, texel10, weight_x);
+	u32 row1 = lerp_color_ARGB32(texel01, texel11, weight_x);
+
+	u32 result = lerp_color_ARGB32(row0, row1, weight_y);
+#endif
+
+	return result;
+}
+
+/*
+	One sample of the given mip level, with the texture's filter.
+
+	@returns: packed ARGB32 color
+*/
+u32 sample_texture_level(const Texture* texture, int level, vec2 tex_coords_uv)
+{
+	u32 result;
+
+	if (texture->filter == TEXTURE_FILTER_NEAREST)
+	{
+		result = sample_texture_nearest(texture, level, tex_coords_uv);
+	}
+	else
+	{
+		result = sample_texture_bilinear(texture, level, tex_coords_uv);
+	}
+
+	return result;
+}
+
+u32 sample_texture(const Texture* texture, vec2 tex_coords_uv)
+{
+	u32 result = sample_texture_level(texture, 0, tex_coords_uv);
+
+	return result;
+}
+
+/*
+	Trilinear filtering: blends the two mip levels around lod.
+	Magnified surfaces (lod <= 0) read level 0 only.
+
+	@returns: packed ARGB32 color
+*/
+u32 sample_texture_trilinear(const Texture* texture, vec2 tex_coords_uv, float lod)
+{
+	int max_level = texture->level_count - 1;
+
+	if (lod <= 0.0f || max_level == 0)
+	{
+		return sample_texture_level(texture, 0, tex_coords_uv);
+	}
+	if (lod >= max_level)
+	{
+		return sample_texture_level(texture, max_level, tex_coords_uv);
+	}
+
+	int level = (int)lod;
+	u32 t = (u32)((lod - level) * 256.0f);
+
+	u32 color0 = sample_texture_level(texture, level, tex_coords_uv);
+	u32 color1 = sample_texture_level(texture, level + 1, tex_coords_uv);
+
+	u32 result = lerp_color_ARGB32(color0, color1, t);
+
+	return result;
+}
+
+/*
+	duv_dx, duv_dy - screen space derivatives of the texture coordinates
+
+	@returns: mip level where one pixel step covers about one texel
+*/
+float texture_lod(const Texture* texture, vec2 duv_dx, vec2 duv_dy)
+{
+	float width = texture->width;
+	float height = texture->height;
+
+	float dx_sq = duv_dx.x * duv_dx.x * width * width + duv_dx.y * duv_dx.y * height * height;
+	float dy_sq = duv_dy.x * duv_dy.x * width * width + duv_dy.y * duv_dy.y * height * height;
+
+	float rho_sq = fmaxf(dx_sq, dy_sq);
+	if (rho_sq <= 1.0f) return 0.0f;  // Magnification
+
+	// log2(sqrt(rho_sq))
+	float result = 0.5f * fast_log2(rho_sq);
+
+	return result;
+}
+
+/*
+	Gradient over the screen of an attribute that is linear in screen
+	space, given its values f1, f2, f3 at screen points p1, p2, p3.
 
-	// right vertical
-	draw_line(buffer, box.max.x, box.min.y, box.max.x, box.max.y, ARGB_color);
+	@returns: (df/dx, df/dy)
+*/
+vec2 screen_space_gradient(vec2 p1, vec2 p2, vec2 p3, float f1, float f2, float f3)
+{
+	vec2 result = Vec2_0();
 
-	// top horizontal
-	draw_line(buffer, box.max.x, box.max.y, box.min.x, box.max.y, ARGB_color);
+	float area = (p2.x - p1.x) * (p3.y - p1.y) - (p3.x - p1.x) * (p2.y - p1.y);
+	if (area != 0.0f)
+	{
+		result.x = ((f2 - f1) * (p3.y - p1.y) - (f3 - f1) * (p2.y - p1.y)) / area;
+		result.y = ((f3 - f1) * (p2.x - p1.x) - (f2 - f1) * (p3.x - p1.x)) / area;
+	}
 
-	// left vertical
-	draw_line(buffer, box.min.x, box.max.y, box.min.x, box.min.y, ARGB_color);
+	return result;
 }
 
-mat4 get_viewport_mat4(int x, int y, int width, int height, int near, int far)
+/*
+	pow(n_dot_h, SPECULAR_EXPONENT) sampled over [0, 1], so the pixel
+	loop pays a table lookup instead of a pow() call.
+*/
+static float specular_pow_lut[SPECULAR_LUT_SIZE + 1];
+
+void init_specular_lut()
 {
-	mat4 result =
+	for (int i = 0; i <= SPECULAR_LUT_SIZE; i++)
 	{
-		0.5f * width, 0, 0, x + 0.5f * width,
-		0, 0.5f * height, 0, y + 0.5f * height,
-		0, 0, 1, 0,
-		0, 0, 0, 1
-	};
-
-	return result;
+		specular_pow_lut[i] = powf((float)i / SPECULAR_LUT_SIZE, SPECULAR_EXPONENT);
+	}
 }
 
-vec3 sample_texture(Texture texture, vec2 tex_coords_uv)
+/*
+	n_dot_h - cosine between surface normal and half vector
+
+	@returns: specular intensity, to be scaled by the specular map texel
+*/
+float specular_term(float n_dot_h)
 {
-	vec3 result;
+	if (n_dot_h <= 0.0f) return 0.0f;
+	if (n_dot_h >= 1.0f) n_dot_h = 1.0f;
 
-	int width = texture.width;
-	int height = texture.height;
+	int index = (int)(n_dot_h * SPECULAR_LUT_SIZE);
+	float result = specular_pow_lut[index] * SPECULAR_INTENSITY;
 
-	float u = tex_coords_uv.x;
-	float v = tex_coords_uv.y;
+	return result;
+}
 
-	int x = roundf(lerp(0, width - 1, u));
-	int y = roundf(lerp(0, height - 1, v));
+/*
+	Blends all four channels of two packed colors at once, two channels
+	per 32-bit multiply.
 
-	int offset = y * width * texture.bytes_per_pixel + x * texture.bytes_per_pixel;
+	t - weight of b, in [0, 256]
+*/
+u32 lerp_color_ARGB32(u32 a, u32 b, u32 t)
+{
+	u32 s = 256 - t;
+
+	u32 rb = (((a & 0x00FF00FF) * s + (b & 0x00FF00FF) * t) >> 8) & 0x00FF00FF;
+	u32 ag = (((a >> 8) & 0x00FF00FF) * s + ((b >> 8) & 0x00FF00FF) * t) & 0xFF00FF00;
+
+	u32 result = rb | ag;
 
-	unsigned char* memory = (unsigned char*)texture.memory;
+	return result;
+}
 
-	// TODO - impl alpha, if bytes_per_pixel = 4
+/*
+	@returns: r, g, b in [0, 1] range
+*/
+vec3 unpack_color_ARGB32(u32 color)
+{
+	const float scale = 1.0f / 255.0f;
 
-	// TODO - below impl is for bytes_per_pixel = 3 only!
-	result.x = memory[offset + 0];
-	result.y = memory[offset + 1];
-	result.z = memory[offset + 2];
+	vec3 result = Vec3(
+		((color >> 16) & 0xFF) * scale,
+		((color >> 8) & 0xFF) * scale,
+		(color & 0xFF) * scale
+	);
 
 	return result;
 }
@@ -478,6 +1356,11 @@ u32 pack_tga_color_ARGB32(TGA_Color color)
 */
 u32 pack_color_ARGB32(vec3 color, float alpha)
 {
+	// Specular highlights can push channels past 1
+	color.x = fminf(color.x, 1.0f);
+	color.y = fminf(color.y, 1.0f);
+	color.z = fminf(color.z, 1.0f);
+
 	uint8_t A = (uint8_t)(alpha * 255);
 	uint8_t R = (uint8_t)(color.x * 255);
 	uint8_t G = (uint8_t)(color.y * 255);
@@ -631,44 +1514,171 @@ mat3 get_tbn_mat(
 {
 	normal = normalize_vec3(normal);
 
-	/*
-		Edge1 = delta_u1 * T + delta_v1 * B
-		Edge2 = delta_u2 * T + delta_v2 * B
-	*/
+	vec3 tangent;
+	vec3 bitangent;
+	tangent_bitangent(p1, p2, p3, uv1, uv2, uv3, &tangent, &bitangent);
 
-	vec3 edge1 = subtract_vec3(p2, p1);
-	vec3 edge2 = subtract_vec3(p3, p1);
+	mat3 result = get_tbn_mat_from_basis(tangent, bitangent, normal);
 
-	vec2 delta_uv1 = subtract_vec2(uv2, uv1);
-	vec2 delta_uv2 = subtract_vec2(uv3, uv1);
+	return result;
+}
 
-	/*
-		|Ex1, Ey1, Ez1| = |delta_u1, delta_v1| * |Tx, Ty, Tz|
-		|Ex2, Ey2, Ez2|   |delta_u2, delta_v2|   |Bx, By, Bz|
+/*
+	Columns of the result are T, B and N, so that multiplying it by
+	a tangent space vector gives the vector in the space of T, B and N.
+*/
+mat3 get_tbn_mat_from_basis(vec3 tangent, vec3 bitangent, vec3 normal)
+{
+	mat3 result =
+	{
+		tangent.x, bitangent.x, normal.x,
+		tangent.y, bitangent.y, normal.y,
+		tangent.z, bitangent.z, normal.z,
+	};
 
-		|delta_u1, delta_v1|^(-1)  * |Ex1, Ey1, Ez1| = |Tx, Ty, Tz|
-		|delta_u2, delta_v2|         |Ex2, Ey2, Ez2|   |Bx, By, Bz|
-	*/
+	return result;
+}
 
-	float det = delta_uv1.x * delta_uv2.y - delta_uv2.x * delta_uv1.y;
+/*
+	Orthonormal TBN frame at a face corner: the tangent is made
+	perpendicular to the normal (Gram-Schmidt) and the bitangent is
+	sign * (N x T).
+*/
+static mat3 get_corner_tbn_mat(vec3 tangent, vec3 normal, float sign)
+{
+	normal = normalize_vec3(normal);
+	tangent = normalize_vec3(subtract_vec3(tangent, multiply_scalar_vec3(dot_vec3(normal, tangent), normal)));
+	vec3 bitangent = multiply_scalar_vec3(sign, cross(normal, tangent));
 
-	float tangent_x = 1.0f / det * (delta_uv2.y * edge1.x - delta_uv1.y * edge2.x);
-	float tangent_y = 1.0f / det * (delta_uv2.y * edge1.y - delta_uv1.y * edge2.y);
-	float tangent_z = 1.0f / det * (delta_uv2.y * edge1.z - delta_uv1.y * edge2.z);
+	mat3 result = get_tbn_mat_from_basis(tangent, bitangent, normal);
 
-	float bitangent_x = 1.0f / det * (-1.0f * delta_uv2.x * edge1.x + delta_uv1.x * edge2.x);
-	float bitangent_y = 1.0f / det * (-1.0f * delta_uv2.x * edge1.y + delta_uv1.x * edge2.y);
-	float bitangent_z = 1.0f / det * (-1.0f * delta_uv2.x * edge1.z + delta_uv1.x * edge2.z);
+	return result;
+}
 
-	vec3 tangent = { tangent_x, tangent_y, tangent_z };
-	vec3 bitanget = { bitangent_x, bitangent_y, bitangent_z };
+/*
+	material - index into the mesh materials, or MATERIAL_NONE for the
+	           maps passed to load_model
+*/
+static ModelMaterial get_model_material(const Model* model, unsigned int material)
+{
+	ModelMaterial result;
 
-	mat3 result =
+	if (material == MATERIAL_NONE || (int)material >= model->material_count)
 	{
-		tangent_x, bitangent_x, normal.x,
-		tangent_y, bitangent_y, normal.y,
-		tangent_z, bitangent_z, normal.z,
-	};
+		result.diffuse_map = model->diffuse_map;
+		result.normal_map = model->normal_map;
+		result.specular_map = model->specular_map;
+		result.diffuse_color = Vec3(0.5f, 0.5f, 0.5f);
+		result.specular = 0.0f;
+	}
+	else
+	{
+		result = model->materials[material];
+	}
+
+	return result;
+}
+
+// Standard sample positions, x, y pairs in 1/16 pixel from the center
+static const signed char sample_positions_2[] = { 4, 4, -4, -4 };
+static const signed char sample_positions_4[] = { -2, -6, 6, -2, -6, 2, 2, 6 };
+static const signed char sample_positions_8[] = { 1, -3, -1, 3, 5, 1, -3, -5, -5, 5, -7, -1, 3, 7, 7, -7 };
+
+/*
+	Signed barycentric coordinates of a screen space triangle, as
+	functions of the position.  Unlike barycentric() they go negative
+	outside, so they hold for any point, sample positions included.
+*/
+typedef struct triangle_edges_t
+{
+	vec3 origin;	// Coordinates at (0, 0)
+	vec3 dx;		// Change per pixel in x
+	vec3 dy;		// Change per pixel in y
+	int is_degenerate;
+} TriangleEdges;
+
+static TriangleEdges get_triangle_edges(vec2 a, vec2 b, vec2 c)
+{
+	TriangleEdges result = { 0 };
+
+	float area = (b.x - a.x) * (c.y - a.y) - (c.x - a.x) * (b.y - a.y);
+	if (area == 0.0f)
+	{
+		result.is_degenerate = 1;
+		return result;
+	}
+
+	// Weight of a vertex is the edge function of the opposite edge
+	result.dx = Vec3((b.y - c.y) / area, (c.y - a.y) / area, (a.y - b.y) / area);
+	result.dy = Vec3((c.x - b.x) / area, (a.x - c.x) / area, (b.x - a.x) / area);
+	result.origin = Vec3(
+		(b.x * c.y - c.x * b.y) / area,
+		(c.x * a.y - a.x * c.y) / area,
+		(a.x * b.y - b.x * a.y) / area);
+
+	return result;
+}
+
+/*
+	Tests the samples of pixel (x, y) for coverage and depth, and writes
+	the depth of those that pass.  inv_w and z are 1/w and clip space z
+	of the vertices.  covered gets the coordinates of the first covered
+	sample, to shade at when the pixel center is outside, or 0 when
+	none is.
+
+	@returns: mask of the samples that passed
+*/
+static uint32_t cover_samples(
+	const FrameBuffer* buffer,
+	const TriangleEdges* edges,
+	vec3 inv_w,
+	vec3 z,
+	int x,
+	int y,
+	vec3* covered)
+{
+	uint32_t result = 0;
+	*covered = Vec3_0();
+
+	if (edges->is_degenerate || x < 0 || y < 0 || x >= buffer->width || y >= buffer->height) return result;
+
+	const signed char* positions = sample_positions_2;
+	if (buffer->sample_count == 4) positions = sample_positions_4;
+	if (buffer->sample_count == 8) positions = sample_positions_8;
+
+	touch_tile(buffer, x, y);
+	size_t first = frame_buffer_index(buffer, x, y) * buffer->sample_count;
+	int found = 0;
+
+	for (int s = 0; s < buffer->sample_count; s++)
+	{
+		float sample_x = x + positions[2 * s] / 16.0f;
+		float sample_y = y + positions[2 * s + 1] / 16.0f;
+
+		vec3 bary = add_vec3(edges->origin, add_vec3(
+			multiply_scalar_vec3(sample_x, edges->dx),
+			multiply_scalar_vec3(sample_y, edges->dy)));
+
+		if (bary.x < 0 || bary.y < 0 || bary.z < 0) continue;
+
+		if (!found)
+		{
+			*covered = bary;
+			found = 1;
+		}
+
+		if (buffer->z_buffer)
+		{
+			// Perspective correct, like the depth at the pixel center
+			float sample_inv_w = bary.x * inv_w.x + bary.y * inv_w.y + bary.z * inv_w.z;
+			float sample_z = (bary.x * inv_w.x * z.x + bary.y * inv_w.y * z.y + bary.z * inv_w.z * z.z) / sample_inv_w;
+			float depth = frame_buffer_depth(buffer, sample_z, sample_inv_w);
+
+			if (!depth_test(buffer, first + s, depth)) continue;
+		}
+
+		result |= 1u << s;
+	}
 
 	return result;
 }
@@ -684,188 +1694,395 @@ void render_model(
 	mat4 projection_mat = g_ctx->projection_mat;
 	mat4 viewport_mat = g_ctx->viewport_mat;
 	mat4 shadow_mvp_mat = g_ctx->shadow_buffer_mvp_mat;
-	float* z_buffer = g_ctx->frame_buffer->z_buffer;
 
 	Mesh* mesh = model->mesh;
-	Texture* diffuse_texture = model->diffuse_map;
-	Texture* normal_texture = model->normal_map;
-	Texture* specular_texture = model->specular_map;
+	vec3 light_direction = normalize_vec3(light_source.position);
 
-	for (int i = 0; i < mesh->face_count; i++)
+	// Faces are grouped by material, so textures are bound once per range
+	for (unsigned int r = 0; r < mesh->material_range_count; r++)
 	{
-		Face face = mesh->faces[i];
+		MaterialRange range = mesh->material_ranges[r];
+		ModelMaterial material = get_model_material(model, range.material);
 
-		// By OBJ format spec, index must start with 1.  If 0, then bad format?
-		int index_offset = 1;
+		Texture* diffuse_texture = material.diffuse_map;
+		Texture* normal_texture = material.normal_map;
+		Texture* specular_texture = material.specular_map;
 
-		// Vertecies
-		Vertex vert1 = mesh->vertices[face.vertexIdx[0] - index_offset];
-		Vertex vert2 = mesh->vertices[face.vertexIdx[1] - index_offset];
-		Vertex vert3 = mesh->vertices[face.vertexIdx[2] - index_offset];
+		// Normal mapping needs the per-vertex tangent frames computed at load
+		int use_normal_map = normal_texture && mesh->tangents;
+		int use_specular_map = specular_texture != NULL;
+		int use_specular = use_specular_map || material.specular > 0.0f;
+
+		for (unsigned int i = range.first_face; i < range.first_face + range.face_count; i++)
+		{
+			Face face = mesh->faces[i];
+
+			// By OBJ format spec, index must start with 1.  If 0, then bad format?
+			int index_offset = 1;
+
+			// Vertecies
+			Vertex vert1 = mesh->vertices[face.vertexIdx[0] - index_offset];
+			Vertex vert2 = mesh->vertices[face.vertexIdx[1] - index_offset];
+			Vertex vert3 = mesh->vertices[face.vertexIdx[2] - index_offset];
 
-		vec3 vertex1_v3 = Vec3(vert1.x, vert1.y, vert1.z);
-		vec3 vertex2_v3 = Vec3(vert2.x, vert2.y, vert2.z);
-		vec3 vertex3_v3 = Vec3(vert3.x, vert3.y, vert3.z);
+			vec3 vertex1_v3 = Vec3(vert1.x, vert1.y, vert1.z);
+			vec3 vertex2_v3 = Vec3(vert2.x, vert2.y, vert2.z);
+			vec3 vertex3_v3 = Vec3(vert3.x, vert3.y, vert3.z);
 
-		// Normals
-		Normal normal1 = mesh->normals[face.normalIdx[0] - index_offset];
-		Normal normal2 = mesh->normals[face.normalIdx[1] - index_offset];
-		Normal normal3 = mesh->normals[face.normalIdx[2] - index_offset];
+			// Normals
+			Normal normal1 = mesh->normals[face.normalIdx[0] - index_offset];
+			Normal normal2 = mesh->normals[face.normalIdx[1] - index_offset];
+			Normal normal3 = mesh->normals[face.normalIdx[2] - index_offset];
+
+			vec3 normal1_v3 = Vec3(normal1.x, normal1.y, normal1.z);
+			vec3 normal2_v3 = Vec3(normal2.x, normal2.y, normal2.z);
+			vec3 normal3_v3 = Vec3(normal3.x, normal3.y, normal3.z);
+
+			// Texture Coordinates
+			TextureCoordinate tex_coords1 = mesh->tex_coords[face.textureIdx[0] - index_offset];
+			TextureCoordinate tex_coords2 = mesh->tex_coords[face.textureIdx[1] - index_offset];
+			TextureCoordinate tex_coords3 = mesh->tex_coords[face.textureIdx[2] - index_offset];
+
+			vec2 tex_coords1_v2 = Vec2(tex_coords1.u, tex_coords1.v);
+			vec2 tex_coords2_v2 = Vec2(tex_coords2.u, tex_coords2.v);
+			vec2 tex_coords3_v2 = Vec2(tex_coords3.u, tex_coords3.v);
+
+			/*
+				An orthonormal TBN frame per corner, the pixel loop only
+				interpolates them.  The corners of a face normally agree on
+				the bitangent sign, a face that doesn't takes the majority.
+			*/
+			mat3 tbn1_mat = get_identity_mat3();
+			mat3 tbn2_mat = tbn1_mat;
+			mat3 tbn3_mat = tbn1_mat;
+			if (use_normal_map)
+			{
+				Tangent t1 = mesh->tangents[i * 3];
+				Tangent t2 = mesh->tangents[i * 3 + 1];
+				Tangent t3 = mesh->tangents[i * 3 + 2];
 
-		vec3 normal1_v3 = Vec3(normal1.x, normal1.y, normal1.z);
-		vec3 normal2_v3 = Vec3(normal2.x, normal2.y, normal2.z);
-		vec3 normal3_v3 = Vec3(normal3.x, normal3.y, normal3.z);
+				float signs = mesh->tangent_signs[i * 3] + mesh->tangent_signs[i * 3 + 1] + mesh->tangent_signs[i * 3 + 2];
+				float tangent_sign = signs < 0.0f ? -1.0f : 1.0f;
 
-		// Texture Coordinates
-		TextureCoordinate tex_coords1 = mesh->tex_coords[face.textureIdx[0] - index_offset];
-		TextureCoordinate tex_coords2 = mesh->tex_coords[face.textureIdx[1] - index_offset];
-		TextureCoordinate tex_coords3 = mesh->tex_coords[face.textureIdx[2] - index_offset];
+				tbn1_mat = get_corner_tbn_mat(Vec3(t1.x, t1.y, t1.z), normal1_v3, tangent_sign);
+				tbn2_mat = get_corner_tbn_mat(Vec3(t2.x, t2.y, t2.z), normal2_v3, tangent_sign);
+				tbn3_mat = get_corner_tbn_mat(Vec3(t3.x, t3.y, t3.z), normal3_v3, tangent_sign);
+			}
 
-		vec2 tex_coords1_v2 = Vec2(tex_coords1.u, tex_coords1.v);
-		vec2 tex_coords2_v2 = Vec2(tex_coords2.u, tex_coords2.v);
-		vec2 tex_coords3_v2 = Vec2(tex_coords3.u, tex_coords3.v);
+			/*
+				Blinn-Phong half vector, shared by every pixel of the triangle.
+				The view direction is taken from the triangle centroid.
+			*/
+			vec3 half_vector = Vec3_0();
+			if (use_specular)
+			{
+				normal1_v3 = normalize_vec3(normal1_v3);
+				normal2_v3 = normalize_vec3(normal2_v3);
+				normal3_v3 = normalize_vec3(normal3_v3);
 
-		// TODO - if Flat Shading, it can be performed here for optimization (or after ModelView transform?)
-		float flat_shaded = flat_shading(vertex1_v3, vertex2_v3, vertex3_v3, Vec3(1, 1, 1));
+				vec3 centroid = multiply_scalar_vec3(1.0f / 3.0f, add_vec3(add_vec3(vertex1_v3, vertex2_v3), vertex3_v3));
+				vec3 view_direction = normalize_vec3(subtract_vec3(camera.position, centroid));
+				half_vector = normalize_vec3(add_vec3(light_direction, view_direction));
+			}
 
-		// Homogenous coordinates for vertex positions
-		vec4 vertex1_v4 = Vec4_v3_in(vertex1_v3, 1.f);
-		vec4 vertex2_v4 = Vec4_v3_in(vertex2_v3, 1.f);
-		vec4 vertex3_v4 = Vec4_v3_in(vertex3_v3, 1.f);
+			// TODO - if Flat Shading, it can be performed here for optimization (or after ModelView transform?)
+			float flat_shaded = flat_shading(vertex1_v3, vertex2_v3, vertex3_v3, Vec3(1, 1, 1));
 
-		// ModelView transformation
-		vertex1_v4 = multiply_mat4_vec4(model_view_mat, vertex1_v4);
-		vertex2_v4 = multiply_mat4_vec4(model_view_mat, vertex2_v4);
-		vertex3_v4 = multiply_mat4_vec4(model_view_mat, vertex3_v4);
+			// Homogenous coordinates for vertex positions
+			vec4 vertex1_v4 = Vec4_v3_in(vertex1_v3, 1.f);
+			vec4 vertex2_v4 = Vec4_v3_in(vertex2_v3, 1.f);
+			vec4 vertex3_v4 = Vec4_v3_in(vertex3_v3, 1.f);
 
-		// Projection transformation
-		vec4 vertex1_clip_space_v4 = multiply_mat4_vec4(projection_mat, vertex1_v4);
-		vec4 vertex2_clip_space_v4 = multiply_mat4_vec4(projection_mat, vertex2_v4);
-		vec4 vertex3_clip_space_v4 = multiply_mat4_vec4(projection_mat, vertex3_v4);
+			// ModelView transformation
+			vertex1_v4 = multiply_mat4_vec4(model_view_mat, vertex1_v4);
+			vertex2_v4 = multiply_mat4_vec4(model_view_mat, vertex2_v4);
+			vertex3_v4 = multiply_mat4_vec4(model_view_mat, vertex3_v4);
 
-		// Division by w
-		vertex1_v4 = divide_by_w(vertex1_clip_space_v4);
-		vertex2_v4 = divide_by_w(vertex2_clip_space_v4);
-		vertex3_v4 = divide_by_w(vertex3_clip_space_v4);
+			// Projection transformation
+			vec4 vertex1_clip_space_v4 = multiply_mat4_vec4(projection_mat, vertex1_v4);
+			vec4 vertex2_clip_space_v4 = multiply_mat4_vec4(projection_mat, vertex2_v4);
+			vec4 vertex3_clip_space_v4 = multiply_mat4_vec4(projection_mat, vertex3_v4);
 
-		// Viewport transformation
-		vertex1_v4 = multiply_mat4_vec4(viewport_mat, vertex1_v4);
-		vertex2_v4 = multiply_mat4_vec4(viewport_mat, vertex2_v4);
-		vertex3_v4 = multiply_mat4_vec4(viewport_mat, vertex3_v4);
+			// Division by w
+			vertex1_v4 = divide_by_w(vertex1_clip_space_v4);
+			vertex2_v4 = divide_by_w(vertex2_clip_space_v4);
+			vertex3_v4 = divide_by_w(vertex3_clip_space_v4);
 
-		float x1 = (int)vertex1_v4.x;
-		float y1 = (int)vertex1_v4.y;
+			// Viewport transformation
+			vertex1_v4 = multiply_mat4_vec4(viewport_mat, vertex1_v4);
+			vertex2_v4 = multiply_mat4_vec4(viewport_mat, vertex2_v4);
+			vertex3_v4 = multiply_mat4_vec4(viewport_mat, vertex3_v4);
 
-		float x2 = (int)vertex2_v4.x;
-		float y2 = (int)vertex2_v4.y;
+			float x1 = (int)vertex1_v4.x;
+			float y1 = (int)vertex1_v4.y;
 
-		float x3 = (int)vertex3_v4.x;
-		float y3 = (int)vertex3_v4.y;
+			float x2 = (int)vertex2_v4.x;
+			float y2 = (int)vertex2_v4.y;
 
-		vec2i pts[] =
-		{
-			Vec2i(roundf(x1), roundf(y1)),
-			Vec2i(roundf(x2), roundf(y2)),
-			Vec2i(roundf(x3), roundf(y3))
-		};
-
-		AABB aabb = find_AABB(pts, 3);
-
-		// Line sweep inside the bouding box and check if each point P is inside the triangle
-		for (int y = aabb.max.y - 1; y >= aabb.min.y; y--) {
-			for (int x = aabb.min.x; x < aabb.max.x; x++) {
-				vec3 bary = barycentric(Vec2(x1, y1), Vec2(x2, y2), Vec2(x3, y3), Vec2(x, y));
-
-				// Perspective correct linear interpolation
-				float denom = (bary.x / vertex1_clip_space_v4.w + bary.y / vertex2_clip_space_v4.w + bary.z / vertex3_clip_space_v4.w);
-				vec3 bary_clip = Vec3(
-					(bary.x / vertex1_clip_space_v4.w) / denom,
-					(bary.y / vertex2_clip_space_v4.w) / denom,
-					(bary.z / vertex3_clip_space_v4.w) / denom
-				);
-
-				float error = 0.0001f;
-
-				int is_outside_the_triangle =
-					bary.x < 0 ||
-					bary.y < 0 ||
-					bary.z < 0 ||
-					(bary.x + bary.y + bary.z) > (1 + error) ||
-					(bary.x + bary.y + bary.z) < (1 - error);
-
-				if (!is_outside_the_triangle)
-				{
+			float x3 = (int)vertex3_v4.x;
+			float y3 = (int)vertex3_v4.y;
 
-					float depth_clip_space = bary_clip.x * vertex1_clip_space_v4.z + bary_clip.y * vertex2_clip_space_v4.z + bary_clip.z * vertex3_clip_space_v4.z;
-					vec2 P = { x, y }; // x, y - in screen coordinates
+			vec2i pts[] =
+			{
+				Vec2i(roundf(x1), roundf(y1)),
+				Vec2i(roundf(x2), roundf(y2)),
+				Vec2i(roundf(x3), roundf(y3))
+			};
 
-					vec2 weighted_uv1 = multiply_scalar_vec2(bary_clip.x, tex_coords1_v2);
-					vec2 weighted_uv2 = multiply_scalar_vec2(bary_clip.y, tex_coords2_v2);
-					vec2 weighted_uv3 = multiply_scalar_vec2(bary_clip.z, tex_coords3_v2);
+			AABB aabb = find_AABB(pts, 3);
 
-					vec2 tex_coord = add_vec2(add_vec2(weighted_uv1, weighted_uv2), weighted_uv3);
+			/*
+				u/w, v/w and 1/w are linear in screen space, so their gradients
+				are constant over the triangle.  Per pixel, the derivatives of
+				the perspective correct UVs follow from the quotient rule:
+
+					du/dx = (d(u/w)/dx - u * d(1/w)/dx) / (1/w)
+			*/
+			vec2 p1 = Vec2(x1, y1);
+			vec2 p2 = Vec2(x2, y2);
+			vec2 p3 = Vec2(x3, y3);
+
+			float inv_w1 = 1.0f / vertex1_clip_space_v4.w;
+			float inv_w2 = 1.0f / vertex2_clip_space_v4.w;
+			float inv_w3 = 1.0f / vertex3_clip_space_v4.w;
+
+			vec2 inv_w_grad = screen_space_gradient(p1, p2, p3, inv_w1, inv_w2, inv_w3);
+			vec2 u_over_w_grad = screen_space_gradient(p1, p2, p3,
+				tex_coords1_v2.x * inv_w1, tex_coords2_v2.x * inv_w2, tex_coords3_v2.x * inv_w3);
+			vec2 v_over_w_grad = screen_space_gradient(p1, p2, p3,
+				tex_coords1_v2.y * inv_w1, tex_coords2_v2.y * inv_w2, tex_coords3_v2.y * inv_w3);
+
+			// Multisampling covers samples past the last pixel centers
+			int sample_count = g_ctx->frame_buffer->samples ? g_ctx->frame_buffer->sample_count : 1;
+			int sample_extent = sample_count > 1 ? 1 : 0;
+			TriangleEdges edges = { 0 };
+			if (sample_count > 1)
+			{
+				edges = get_triangle_edges(p1, p2, p3);
+			}
+			vec3 inv_w = Vec3(inv_w1, inv_w2, inv_w3);
+			vec3 clip_z = Vec3(vertex1_clip_space_v4.z, vertex2_clip_space_v4.z, vertex3_clip_space_v4.z);
 
-					vec3 texel_color = Vec3(127, 127, 127);
-					if (diffuse_texture)
-					{
-						texel_color = sample_texture(*diffuse_texture, tex_coord);
-					}
+			// Line sweep inside the bouding box and check if each point P is inside the triangle
+			for (int y = aabb.max.y - 1 + sample_extent; y >= aabb.min.y; y--) {
+				for (int x = aabb.min.x; x < aabb.max.x + sample_extent; x++) {
+					vec3 bary = barycentric(Vec2(x1, y1), Vec2(x2, y2), Vec2(x3, y3), Vec2(x, y));
 
-					vec3 texel_normal = Vec3_0();
-					if (normal_texture)
-					{
-						texel_normal = sample_texture(*normal_texture, tex_coord);
-					}				
-					
-					vec3 texel_specular = Vec3_0();
-					if(specular_texture)
-					{
-						texel_specular = sample_texture(*specular_texture, tex_coord);
-					}
+					// Perspective correct linear interpolation
+					float denom = (bary.x / vertex1_clip_space_v4.w + bary.y / vertex2_clip_space_v4.w + bary.z / vertex3_clip_space_v4.w);
+					vec3 bary_clip = Vec3(
+						(bary.x / vertex1_clip_space_v4.w) / denom,
+						(bary.y / vertex2_clip_space_v4.w) / denom,
+						(bary.z / vertex3_clip_space_v4.w) / denom
+					);
 
-					float gouraud_shaded = gouraud_shading(normal1_v3, normal2_v3, normal3_v3, bary_clip, light_source.position);
+					float error = 0.0001f;
 
-					// Modify color based on computed light intensity					
-					texel_color.x *= gouraud_shaded;
-					texel_color.y *= gouraud_shaded;
-					texel_color.z *= gouraud_shaded;
+					int is_outside_the_triangle =
+						bary.x < 0 ||
+						bary.y < 0 ||
+						bary.z < 0 ||
+						(bary.x + bary.y + bary.z) > (1 + error) ||
+						(bary.x + bary.y + bary.z) < (1 - error);
 
-					texel_color = normalize_color(texel_color);
+					uint32_t coverage = !is_outside_the_triangle;
+					if (sample_count > 1)
+					{
+						vec3 covered = Vec3_0();
+						coverage = cover_samples(g_ctx->frame_buffer, &edges, inv_w, clip_z, x, y, &covered);
+
+						// Shaded once for all samples, at a covered one if the center isn't
+						if (coverage && is_outside_the_triangle)
+						{
+							bary = covered;
+							denom = bary.x * inv_w1 + bary.y * inv_w2 + bary.z * inv_w3;
+							bary_clip = Vec3(bary.x * inv_w1 / denom, bary.y * inv_w2 / denom, bary.z * inv_w3 / denom);
+						}
+					}
 
-					u32 ARGB_color = pack_color_ARGB32(texel_color, 1);
-					u32 ARGB_debug_color = pack_color_ARGB32(Vec3(1, 0, 0), 1);
+					if (coverage)
+					{
 
-					// Write final color to frame buffer
-					draw_pixel_3d(
-						g_ctx->frame_buffer,
-						g_ctx->frame_buffer->z_buffer,
-						P.x, P.y, depth_clip_space,
-						ARGB_color
-					);
+						float depth_clip_space = bary_clip.x * vertex1_clip_space_v4.z + bary_clip.y * vertex2_clip_space_v4.z + bary_clip.z * vertex3_clip_space_v4.z;
+						float depth = frame_buffer_depth(g_ctx->frame_buffer, depth_clip_space, denom);
+						vec2 P = { x, y }; // x, y - in screen coordinates
+
+						vec2 weighted_uv1 = multiply_scalar_vec2(bary_clip.x, tex_coords1_v2);
+						vec2 weighted_uv2 = multiply_scalar_vec2(bary_clip.y, tex_coords2_v2);
+						vec2 weighted_uv3 = multiply_scalar_vec2(bary_clip.z, tex_coords3_v2);
+
+						vec2 tex_coord = add_vec2(add_vec2(weighted_uv1, weighted_uv2), weighted_uv3);
+
+						// denom is 1/w at this pixel
+						vec2 duv_dx = Vec2(
+							(u_over_w_grad.x - tex_coord.x * inv_w_grad.x) / denom,
+							(v_over_w_grad.x - tex_coord.y * inv_w_grad.x) / denom);
+						vec2 duv_dy = Vec2(
+							(u_over_w_grad.y - tex_coord.x * inv_w_grad.y) / denom,
+							(v_over_w_grad.y - tex_coord.y * inv_w_grad.y) / denom);
+
+						vec3 texel_color = material.diffuse_color;
+						if (diffuse_texture)
+						{
+							float lod = texture_lod(diffuse_texture, duv_dx, duv_dy);
+							texel_color = unpack_color_ARGB32(sample_texture_trilinear(diffuse_texture, tex_coord, lod));
+						}
+
+						float light_intensity;
+						vec3 normal;
+						if (use_normal_map)
+						{
+							float lod = texture_lod(normal_texture, duv_dx, duv_dy);
+							vec3 texel_normal = unpack_color_ARGB32(sample_texture_trilinear(normal_texture, tex_coord, lod));
+
+							// [0, 1] -> [-1, 1]
+							vec3 tangent_normal = Vec3(
+								texel_normal.x * 2.0f - 1.0f,
+								texel_normal.y * 2.0f - 1.0f,
+								texel_normal.z * 2.0f - 1.0f
+							);
+
+							mat3 tbn_mat;
+							for (int k = 0; k < 9; k++)
+							{
+								tbn_mat.m[k] = bary_clip.x * tbn1_mat.m[k] + bary_clip.y * tbn2_mat.m[k] + bary_clip.z * tbn3_mat.m[k];
+							}
+
+							// The blended frame is slightly shorter than unit inside the triangle
+							normal = normalize_vec3(multiply_mat3_vec3(tbn_mat, tangent_normal));
+							light_intensity = fmaxf(0.0f, dot_vec3(normal, light_direction));
+						}
+						else
+						{
+							light_intensity = gouraud_shading(normal1_v3, normal2_v3, normal3_v3, bary_clip, light_source.position);
+						}
+
+						// Modify color based on computed light intensity
+						texel_color.x *= light_intensity;
+						texel_color.y *= light_intensity;
+						texel_color.z *= light_intensity;
+
+						if (use_specular && light_intensity > 0.0f)
+						{
+							if (!use_normal_map)
+							{
+								// The blend is shorter than unit where the vertex normals differ
+								normal = normalize_vec3(add_vec3(add_vec3(
+									multiply_scalar_vec3(bary_clip.x, normal1_v3),
+									multiply_scalar_vec3(bary_clip.y, normal2_v3)),
+									multiply_scalar_vec3(bary_clip.z, normal3_v3)));
+							}
+
+							// Highlight strength comes from the red channel of the map
+							float strength = material.specular;
+							if (use_specular_map)
+							{
+								float lod = texture_lod(specular_texture, duv_dx, duv_dy);
+								strength = unpack_color_ARGB32(sample_texture_trilinear(specular_texture, tex_coord, lod)).x;
+							}
+
+							float specular = specular_term(dot_vec3(normal, half_vector)) * strength;
+
+							texel_color.x += specular;
+							texel_color.y += specular;
+							texel_color.z += specular;
+						}
+
+						u32 ARGB_color = pack_color_ARGB32(texel_color, 1);
+						u32 ARGB_debug_color = pack_color_ARGB32(Vec3(1, 0, 0), 1);
+
+						// Write final color to frame buffer, samples passed depth already
+						if (sample_count > 1)
+						{
+							draw_samples(g_ctx->frame_buffer, frame_buffer_index(g_ctx->frame_buffer, x, y), coverage, ARGB_color);
+						}
+						else
+						{
+							draw_pixel_3d(
+								g_ctx->frame_buffer,
+								g_ctx->frame_buffer->z_buffer,
+								P.x, P.y, depth,
+								ARGB_color
+							);
+						}
+					}
 				}
 			}
 		}
 	}
 }
 
+/*
+	Adds texture to textures if it's virtual and not there yet.
+*/
+static void collect_virtual_texture(Texture** textures, int* count, Texture* texture)
+{
+	if (texture == NULL || texture->format != TEXTURE_FORMAT_VIRTUAL) return;
+
+	for (int i = 0; i < *count; i++)
+	{
+		if (textures[i] == texture) return;
+	}
+
+	textures[(*count)++] = texture;
+}
+
 void render_scene(GraphicsContext* g_ctx, Scene* scene)
 {
 	for (int i = 0; i < scene->modelCount; i++)
 	{
 		render_model(g_ctx, scene->models[i], scene->light);
 	}
+
+	// Pages sampled but not resident are streamed in for the next frame.
+	// Textures shared by models or materials are updated once, an update
+	// also advances the frame their cache evicts by
+	int texture_capacity = 0;
+	for (int i = 0; i < scene->modelCount; i++)
+	{
+		texture_capacity += 3 + 3 * scene->models[i]->material_count;
+	}
+
+	Texture** textures = (Texture**)malloc(texture_capacity * sizeof(Texture*));
+	int texture_count = 0;
+
+	for (int i = 0; i < scene->modelCount; i++)
+	{
+		Model* model = scene->models[i];
+
+		collect_virtual_texture(textures, &texture_count, model->diffuse_map);
+		collect_virtual_texture(textures, &texture_count, model->normal_map);
+		collect_virtual_texture(textures, &texture_count, model->specular_map);
+
+		for (int j = 0; j < model->material_count; j++)
+		{
+			collect_virtual_texture(textures, &texture_count, model->materials[j].diffuse_map);
+			collect_virtual_texture(textures, &texture_count, model->materials[j].normal_map);
+			collect_virtual_texture(textures, &texture_count, model->materials[j].specular_map);
+		}
+	}
+
+	for (int i = 0; i < texture_count; i++)
+	{
+		update_virtual_texture(textures[i]);
+	}
+
+	free(textures);
 }
 
 void copy_z_buffer_to_frame_buffer(FrameBuffer* buffer, float* z_buffer)
 {
-	for (int i = 0; i < buffer->width * buffer->height; i++)
+	resolve_frame_buffer(buffer);
+
+	for (int y = 0; y < buffer->height; y++)
 	{
-		float z_value = z_buffer[i];
-		u32 x = i % buffer->width;
-		u32 y = i / buffer->height;
+		for (int x = 0; x < buffer->width; x++)
+		{
+			float z_value = z_buffer[frame_buffer_index(buffer, x, y)];
 
-		vec3 z_color = Vec3(z_value, z_value, z_value);
-		draw_pixel(buffer, x, y, pack_color_ARGB32(z_color, 1.0f));
+			vec3 z_color = Vec3(z_value, z_value, z_value);
+			draw_pixel(buffer, x, y, pack_color_ARGB32(z_color, 1.0f));
+		}
 	}
 }
 
@@ -883,6 +2100,14 @@ void render_shadow_buffer(GraphicsContext* g_ctx, Scene* scene, Light light)
 
 	g_ctx->shadow_buffer_mvp_mat = multiply_mat4(projection_mat, model_view_mat);
 
+	if (!g_ctx->shadow_buffer)
+	{
+		// Color is only for looking at the depth
+		g_ctx->shadow_buffer = (FrameBuffer*)malloc(sizeof(FrameBuffer));
+		init_frame_buffer(g_ctx->shadow_buffer, g_ctx->frame_buffer->width, g_ctx->frame_buffer->height, 4);
+	}
+	float* shadow_z_buffer = (float*)g_ctx->shadow_buffer->z_buffer;
+
 	for (int m_idx = 0; m_idx < scene->modelCount; m_idx++)
 	{
 		Model* model = scene->models[m_idx];
@@ -972,14 +2197,14 @@ void render_shadow_buffer(GraphicsContext* g_ctx, Scene* scene, Light light)
 					{
 						// We only care about the depth (z-value) of shadow buffer
 						float depth = bary_clip.x * vertex1_clip_space_v4.z + bary_clip.y * vertex2_clip_space_v4.z + bary_clip.z * vertex3_clip_space_v4.z;
-						update_z_buffer(g_ctx->shadow_buffer->z_buffer, g_ctx->shadow_buffer->width, x, y, depth);
+						update_z_buffer(shadow_z_buffer, g_ctx->shadow_buffer->width, x, y, depth);
 					}
 				}
 			}
 		}
 	}
 
-	copy_z_buffer_to_frame_buffer(g_ctx->shadow_buffer, g_ctx->shadow_buffer->z_buffer);
+	copy_z_buffer_to_frame_buffer(g_ctx->shadow_buffer, shadow_z_buffer);
 }
 
 void render_buffer_fill(
@@ -988,13 +2213,20 @@ void render_buffer_fill(
 	const u32 height,
 	const vec3 color)
 {
-	for (int index = 0; index < width * height; index++)
+	u32 packed_color = pack_color_ARGB32(color, 1.f);
+
+	if ((int)width == buffer->width && (int)height == buffer->height)
 	{
-		u32 x = index % width;
-		u32 y = index / height;
-		u32 packed_color = pack_color_ARGB32(color, 1.f);
+		clear_color_buffer(buffer, packed_color);
+		return;
+	}
 
-		draw_pixel(buffer, x, y, packed_color);
+	for (u32 y = 0; y < height; y++)
+	{
+		for (u32 x = 0; x < width; x++)
+		{
+			draw_pixel(buffer, x, y, packed_color);
+		}
 	}
 }
 
@@ -1003,6 +2235,8 @@ void init_graphics_context(
 	const unsigned int width,
 	const unsigned int height,
 	const unsigned int bytes_per_pixel,
+	DepthFormat depth_format,
+	int sample_count,
 	vec3 camera_position,
 	vec3 camera_target,
 	vec3 camera_up
@@ -1010,14 +2244,29 @@ void init_graphics_context(
 {
 	if (!g_ctx) return;
 
+	init_graphics_context_no_buffer(g_ctx, width, height, camera_position, camera_target, camera_up);
+
 	g_ctx->frame_buffer = (FrameBuffer*)malloc(sizeof(FrameBuffer));
-	init_frame_buffer(g_ctx->frame_buffer, width, height, bytes_per_pixel);
+	init_frame_buffer_format(g_ctx->frame_buffer, width, height, bytes_per_pixel, FRAME_BUFFER_LINEAR, depth_format, sample_count);
+	g_ctx->owns_frame_buffer = 1;
+}
 
-	g_ctx->depth_buffer = (FrameBuffer*)malloc(sizeof(FrameBuffer));
-	init_frame_buffer(g_ctx->depth_buffer, width, height, bytes_per_pixel);
+void init_graphics_context_no_buffer(
+	GraphicsContext* g_ctx,
+	const unsigned int width,
+	const unsigned int height,
+	vec3 camera_position,
+	vec3 camera_target,
+	vec3 camera_up
+)
+{
+	if (!g_ctx) return;
+
+	g_ctx->frame_buffer = NULL;
+	g_ctx->owns_frame_buffer = 0;
 
-	g_ctx->shadow_buffer = (FrameBuffer*)malloc(sizeof(FrameBuffer));
-	init_frame_buffer(g_ctx->shadow_buffer, width, height, bytes_per_pixel);
+	// Only render_shadow_buffer needs it
+	g_ctx->shadow_buffer = NULL;
 
 	g_ctx->camera.position = camera_position;
 	g_ctx->camera.target = camera_target;
@@ -1043,11 +2292,21 @@ void init_graphics_context(
 
 	g_ctx->viewport_mat = get_viewport_mat4(0, 0, width, height, 0, 1);
 	print_mat4(logfile, g_ctx->viewport_mat, "Viewport:");
+
+	init_specular_lut();
 }
 
 void free_graphics_context(GraphicsContext g_ctx)
 {
-	free_frame_buffer(g_ctx.frame_buffer);
-	free_frame_buffer(g_ctx.depth_buffer);
-	free_frame_buffer(g_ctx.shadow_buffer);
+	if (g_ctx.owns_frame_buffer && g_ctx.frame_buffer)
+	{
+		free_frame_buffer(g_ctx.frame_buffer);
+		free(g_ctx.frame_buffer);
+	}
+
+	if (g_ctx.shadow_buffer)
+	{
+		free_frame_buffer(g_ctx.shadow_buffer);
+		free(g_ctx.shadow_buffer);
+	}
 }
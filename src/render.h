@@ -7,7 +7,15 @@
 #include <limits.h>
 #include <float.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RENDER_SSE2 1
+#else
+#define RENDER_SSE2 0
+#endif
+
 #include "texture.h"
+#include "virtual_texture.h"
 #include "model.h"
 #include "tga_image_loader.h"
 #include "math_operations.h"
@@ -17,16 +25,166 @@ extern FILE* logfile;
 
 typedef uint32_t u32;
 
+// Blinn-Phong shininess, and highlight strength for a full-white specular texel
+#define SPECULAR_EXPONENT 32.0f
+#define SPECULAR_INTENSITY 0.6f
+#define SPECULAR_LUT_SIZE 1024
+
+
+/*
+	Linear buffers are row-major, row 0 at the bottom.  Tiled buffers
+	store FRAME_BUFFER_TILE_SIZE square tiles one after the other, each
+	as FRAME_BUFFER_BLOCK_SIZE square pixel blocks; tiles, blocks in a
+	tile and pixels in a block are all in row order.  At 64 and 8, a
+	block of color is 256 contiguous bytes and a tile 16 KB, so narrow
+	triangles touch a few cache lines per 8 rows instead of one per row,
+	and threads working on different tiles don't share lines.  The
+	buffer is padded to whole tiles.
+
+	Color and depth share the layout.  Tiled buffers are for rendering
+	only, linearize_frame_buffer converts them for output.
+
+	Tiled buffers also keep a state per tile.  Clearing them only marks
+	every tile cleared, a tile is filled with the clear values when it's
+	first drawn to, and linearize_frame_buffer writes the clear color for
+	tiles never drawn to without reading them.  Background costs no
+	bandwidth until it's written out.
+*/
+typedef enum frame_buffer_layout_t
+{
+	FRAME_BUFFER_LINEAR,
+	FRAME_BUFFER_TILED
+} FrameBufferLayout;
+
+#define FRAME_BUFFER_TILE_SIZE 64
+#define FRAME_BUFFER_BLOCK_SIZE 8
+
+// Sizes are powers of 2, pixel coordinates split into tile, block and
+// pixel with shifts and masks
+#define FRAME_BUFFER_TILE_SHIFT 6
+#define FRAME_BUFFER_BLOCK_SHIFT 3
+#define FRAME_BUFFER_TILE_BLOCKS (FRAME_BUFFER_TILE_SIZE / FRAME_BUFFER_BLOCK_SIZE)	// Blocks per tile row
+
+_Static_assert((1 << FRAME_BUFFER_TILE_SHIFT) == FRAME_BUFFER_TILE_SIZE, "FRAME_BUFFER_TILE_SHIFT must be log2 of FRAME_BUFFER_TILE_SIZE");
+_Static_assert((1 << FRAME_BUFFER_BLOCK_SHIFT) == FRAME_BUFFER_BLOCK_SIZE, "FRAME_BUFFER_BLOCK_SHIFT must be log2 of FRAME_BUFFER_BLOCK_SIZE");
+_Static_assert(FRAME_BUFFER_BLOCK_SIZE <= FRAME_BUFFER_TILE_SIZE, "Blocks must fit in a tile");
+
+// Tile state bits, a tile with neither has been drawn to
+#define TILE_COLOR_CLEARED 1	// Color plane holds garbage, reads as clear_color
+#define TILE_DEPTH_CLEARED 2	// Depth plane holds garbage, reads as the farthest depth
+
+/*
+	Every format passes the fragments with a greater depth, larger is
+	closer.  DEPTH_FLOAT32 keeps the interpolated clip space z, cleared
+	to -FLT_MAX.  The others are computed from the view distance w:
+
+	DEPTH_FLOAT32_REVERSED - depth_near / w, cleared to 0, with the far
+	plane at infinity.  Float precision is densest near 0, far away,
+	which evens out the precision 1/w loses with distance.
+
+	DEPTH_UNORM16, DEPTH_UNORM24_STENCIL8 - 1 at depth_near down to 0
+	at depth_far, hyperbolic in w like a standard z-buffer, quantized.
+	16 bits is half the bandwidth of float.  24 bit depth sits in the
+	high bits of a 32 bit word, depth writes keep the low 8 stencil bits.
+
+	DEPTH_NONE - no depth plane, every fragment passes.
+*/
+typedef enum depth_format_t
+{
+	DEPTH_NONE,
+	DEPTH_FLOAT32,
+	DEPTH_FLOAT32_REVERSED,
+	DEPTH_UNORM16,
+	DEPTH_UNORM24_STENCIL8
+} DepthFormat;
+
+// View distances mapped to the ends of the depth range
+#define DEPTH_DEFAULT_NEAR 0.1f
+#define DEPTH_DEFAULT_FAR 100.0f
+
+/*
+	Multisampled buffers test coverage and depth at 2, 4 or 8 points of
+	a pixel, but shade a triangle once per pixel.  Depth is stored per
+	sample, sample_count values per pixel.  Color stays one value per
+	pixel in the color plane while all samples agree, the common case
+	inside triangles.  Pixels on edges get a slot in a pool with one
+	color per sample.  linearize_frame_buffer averages the samples.
+
+	slots holds per pixel 0 while no slot is assigned, else 1 + index of
+	the slot.  A pixel whose samples agree again keeps its slot, marked
+	SAMPLE_SLOT_UNIFORM, to reuse it; the pool never outgrows the pixels.
+*/
+#define SAMPLE_SLOT_UNIFORM 0x80000000u
+
+typedef struct
+{
+	uint32_t* slots;
+	uint32_t* colors;			// sample_count colors per slot
+	size_t count;				// Slots handed out since the last clear
+	size_t capacity;
+} SampleStorage;
 
 typedef struct
 {
-	void* memory;
+	void* memory;				// Color plane, NULL if bytes_per_pixel is 0
 	int width;
 	int height;
 	int bytes_per_pixel;
-	float* z_buffer;
+	void* z_buffer;				// Depth plane, NULL if DEPTH_NONE
+
+	FrameBufferLayout layout;
+	int tiles_x;				// Tiles per row, if tiled
+	int tiles_y;
+	unsigned char* tile_state;	// TILE_ bits per tile, NULL if not tracked
+	uint32_t clear_color;		// Color of TILE_COLOR_CLEARED tiles
+
+	DepthFormat depth_format;
+	float depth_near;
+	float depth_far;
+
+	int sample_count;			// 1, or 2, 4, 8 for multisampling
+	SampleStorage* samples;		// NULL if single sampled
 } FrameBuffer;
 
+/*
+	@returns: index of pixel (x, y) in memory and z_buffer, in pixels
+*/
+static size_t frame_buffer_index(const FrameBuffer* buffer, unsigned int x, unsigned int y)
+{
+	size_t result;
+
+	if (buffer->layout == FRAME_BUFFER_TILED)
+	{
+		const unsigned int block_mask = FRAME_BUFFER_TILE_BLOCKS - 1;
+		const unsigned int pixel_mask = FRAME_BUFFER_BLOCK_SIZE - 1;
+
+		size_t tile = (size_t)(y >> FRAME_BUFFER_TILE_SHIFT) * buffer->tiles_x + (x >> FRAME_BUFFER_TILE_SHIFT);
+		unsigned int block =
+			((y >> FRAME_BUFFER_BLOCK_SHIFT) & block_mask) * FRAME_BUFFER_TILE_BLOCKS +
+			((x >> FRAME_BUFFER_BLOCK_SHIFT) & block_mask);
+		unsigned int pixel = (y & pixel_mask) * FRAME_BUFFER_BLOCK_SIZE + (x & pixel_mask);
+
+		result = (tile * FRAME_BUFFER_TILE_BLOCKS * FRAME_BUFFER_TILE_BLOCKS + block) *
+			FRAME_BUFFER_BLOCK_SIZE * FRAME_BUFFER_BLOCK_SIZE + pixel;
+	}
+	else
+	{
+		result = (size_t)y * buffer->width + x;
+	}
+
+	return result;
+}
+
+/*
+	@returns: 1 if the color plane is the image, rows in order, and can
+	be written out without linearize_frame_buffer.
+*/
+static int frame_buffer_is_linear(const FrameBuffer* buffer)
+{
+	int result = buffer->layout == FRAME_BUFFER_LINEAR && !buffer->samples;
+	return result;
+}
+
 typedef struct
 {
 	vec3 position;	// World camera position
@@ -36,9 +194,9 @@ typedef struct
 
 typedef struct
 {
-	FrameBuffer* frame_buffer;		// Main color buffer
-	FrameBuffer* depth_buffer;		// Z-value buffer
-	FrameBuffer* shadow_buffer;		// Light source view z-value buffer
+	FrameBuffer* frame_buffer;		// Main color and depth buffer
+	int owns_frame_buffer;			// Else the caller's, not freed with the context
+	FrameBuffer* shadow_buffer;		// Light source view z-value buffer, allocated on first use
 	
 	mat4 model_mat;
 	mat4 view_mat;
@@ -75,8 +233,59 @@ void init_frame_buffer(
 	unsigned int width, 
 	unsigned int height, 
 	unsigned int bytes_per_pixel);
+
+/*
+	Allocates only the planes asked for: no color plane if
+	bytes_per_pixel is 0, no depth plane for DEPTH_NONE.  sample_count
+	other than 2, 4 or 8 is single sampled; multisampling needs 4 bytes
+	per pixel.  init_frame_buffer is a linear, single sampled buffer
+	with DEPTH_FLOAT32.
+*/
+void init_frame_buffer_format(
+	FrameBuffer* buffer,
+	unsigned int width,
+	unsigned int height,
+	unsigned int bytes_per_pixel,
+	FrameBufferLayout layout,
+	DepthFormat depth_format,
+	int sample_count);
 void free_frame_buffer(FrameBuffer* buffer);
 
+/*
+	Pixels allocated, including the padding of tiled buffers.
+*/
+size_t frame_buffer_pixel_count(const FrameBuffer* buffer);
+size_t depth_format_bytes(DepthFormat format);
+
+/*
+	Resets depth to the farthest value of the format, and stencil to 0.
+	Clears are SIMD and split across threads, large planes are written
+	with non-temporal stores, around the cache.  On tiled buffers they
+	only mark the tiles.
+*/
+void clear_z_buffer(FrameBuffer* buffer);
+void clear_color_buffer(FrameBuffer* buffer, u32 color);
+
+/*
+	Fills every tile still marked cleared, for code reading the planes
+	of a tiled buffer directly.  draw_pixel and linearize_frame_buffer
+	don't need it.
+*/
+void resolve_frame_buffer(FrameBuffer* buffer);
+
+/*
+	Depth of a fragment in the format of the buffer, from its clip
+	space z and 1/w, to pass to draw_pixel_3d.
+*/
+float frame_buffer_depth(const FrameBuffer* buffer, float clip_z, float inv_w);
+
+/*
+	Copies the color of a buffer to out as a linear buffer,
+	width * height * bytes_per_pixel bytes, resolving multisampled
+	pixels to the average of their samples.
+*/
+void linearize_frame_buffer(const FrameBuffer* buffer, void* out);
+
 unsigned char* index_into_buffer(
 	unsigned char* buffer,
 	int x,
@@ -112,8 +321,19 @@ void draw_line_3d(const FrameBuffer* buffer, float** z_buffer, vec3 p1, vec3 p2,
 AABB find_AABB(vec2i* points, u32 array_count);
 void draw_AABB(FrameBuffer* buffer, AABB box, u32 ARGB_color);
 
-vec3 sample_texture(Texture texture, vec2 tex_coords_uv);
+u32 sample_texture(const Texture* texture, vec2 tex_coords_uv);
+u32 sample_texture_nearest(const Texture* texture, int level, vec2 tex_coords_uv);
+u32 sample_texture_bilinear(const Texture* texture, int level, vec2 tex_coords_uv);
+u32 sample_texture_level(const Texture* texture, int level, vec2 tex_coords_uv);
+u32 sample_texture_trilinear(const Texture* texture, vec2 tex_coords_uv, float lod);
+float texture_lod(const Texture* texture, vec2 duv_dx, vec2 duv_dy);
+vec2 screen_space_gradient(vec2 p1, vec2 p2, vec2 p3, float f1, float f2, float f3);
 
+void init_specular_lut();
+float specular_term(float n_dot_h);
+
+u32 lerp_color_ARGB32(u32 a, u32 b, u32 t);
+vec3 unpack_color_ARGB32(u32 color);
 vec3 normalize_color(vec3 color);
 u32 pack_tga_color_ARGB32(TGA_Color color);
 u32 pack_color_ARGB32(vec3 color, float alpha);
@@ -136,6 +356,7 @@ mat3 get_tbn_mat(
 	vec3 p1, vec3 p2, vec3 p3,
 	vec2 uv1, vec2 uv2, vec2 uv3,
 	vec3 normal);
+mat3 get_tbn_mat_from_basis(vec3 tangent, vec3 bitangent, vec3 normal);
 
 void render_coordinate_frame(GraphicsContext* g_ctx);
 
@@ -156,6 +377,21 @@ void init_graphics_context(
 	const unsigned int width,
 	const unsigned int height,
 	const unsigned int bytes_per_pixel,
+	DepthFormat depth_format,
+	int sample_count,
+	vec3 camera_position,
+	vec3 camera_target,
+	vec3 camera_up
+);
+
+/*
+	Sets up the camera and transforms only, the caller points
+	frame_buffer at a buffer of width x height before rendering.
+*/
+void init_graphics_context_no_buffer(
+	GraphicsContext* g_ctx,
+	const unsigned int width,
+	const unsigned int height,
 	vec3 camera_position,
 	vec3 camera_target,
 	vec3 camera_up
@@ -0,0 +1,332 @@
+#include <string.h>
+
+#include "shared_frame_buffer.h"
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#define SHARED_FRAME_LOAD(pointer) __atomic_load_n(pointer, __ATOMIC_ACQUIRE)
+#define SHARED_FRAME_STORE(pointer, value) __atomic_store_n(pointer, value, __ATOMIC_RELEASE)
+
+static size_t align_size(size_t size)
+{
+	return (size + SHARED_FRAME_ALIGNMENT - 1) & ~(size_t)(SHARED_FRAME_ALIGNMENT - 1);
+}
+
+/*
+	Points the slot frame buffers at the segment.
+*/
+static void map_slots(SharedFrameBuffer* shared)
+{
+	SharedFrameHeader* header = shared->header;
+	unsigned char* base = (unsigned char*)header;
+
+	for (int i = 0; i < SHARED_FRAME_SLOT_COUNT; i++)
+	{
+		FrameBuffer* slot = &shared->slots[i];
+		slot->width = (int)header->width;
+		slot->height = (int)header->height;
+		slot->bytes_per_pixel = header->color_format == SHARED_FRAME_COLOR_ARGB32 ? 4 : 3;
+		slot->memory = base + header->color_offsets[i];
+		slot->z_buffer = base + header->depth_offsets[i];
+		slot->depth_format = DEPTH_FLOAT32;
+		slot->depth_near = DEPTH_DEFAULT_NEAR;
+		slot->depth_far = DEPTH_DEFAULT_FAR;
+		slot->sample_count = 1;
+	}
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+
+int create_shared_frame_buffer(SharedFrameBuffer* shared, const char* name, int width, int height, int bytes_per_pixel)
+{
+	memset(shared, 0, sizeof(SharedFrameBuffer));
+	return 0;
+}
+
+int open_shared_frame_buffer(SharedFrameBuffer* shared, const char* name)
+{
+	memset(shared, 0, sizeof(SharedFrameBuffer));
+	return 0;
+}
+
+void close_shared_frame_buffer(SharedFrameBuffer* shared)
+{
+}
+
+void unlink_shared_frame_buffer(const char* name)
+{
+}
+
+FrameBuffer* acquire_shared_frame(SharedFrameBuffer* shared)
+{
+	return NULL;
+}
+
+void publish_shared_frame(SharedFrameBuffer* shared)
+{
+}
+
+uint32_t wait_shared_frame(SharedFrameBuffer* shared, uint32_t last_sequence, int timeout_ms)
+{
+	return last_sequence;
+}
+
+int shared_frame_still_valid(const SharedFrameBuffer* shared, uint32_t sequence)
+{
+	return 0;
+}
+
+#else
+
+int create_shared_frame_buffer(SharedFrameBuffer* shared, const char* name, int width, int height, int bytes_per_pixel)
+{
+	memset(shared, 0, sizeof(SharedFrameBuffer));
+
+	size_t color_size = (size_t)width * height * bytes_per_pixel;
+	size_t depth_size = (size_t)width * height * sizeof(float);
+
+	size_t size = align_size(sizeof(SharedFrameHeader));
+	uint64_t color_offsets[SHARED_FRAME_SLOT_COUNT];
+	uint64_t depth_offsets[SHARED_FRAME_SLOT_COUNT];
+	for (int i = 0; i < SHARED_FRAME_SLOT_COUNT; i++)
+	{
+		color_offsets[i] = size;
+		size += align_size(color_size);
+		depth_offsets[i] = size;
+		size += align_size(depth_size);
+	}
+
+	// Resizing or clearing a live segment in place would pull the pages
+	// from under existing consumers.  A fresh segment replaces the name
+	// instead, consumers that still map the old one keep its pages until
+	// they reopen
+	shm_unlink(name);
+
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+	{
+		return 0;
+	}
+
+	if (ftruncate(fd, (off_t)size) != 0)
+	{
+		close(fd);
+		shm_unlink(name);
+		return 0;
+	}
+
+	void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (memory == MAP_FAILED)
+	{
+		return 0;
+	}
+
+	// The pages are zero, so sequence starts at 0
+	SharedFrameHeader* header = (SharedFrameHeader*)memory;
+	header->version = SHARED_FRAME_VERSION;
+	header->width = (uint32_t)width;
+	header->height = (uint32_t)height;
+	header->color_format = bytes_per_pixel == 4 ? SHARED_FRAME_COLOR_ARGB32 : SHARED_FRAME_COLOR_BGR24;
+	header->depth_format = SHARED_FRAME_DEPTH_FLOAT32;
+	header->color_stride = (uint32_t)(width * bytes_per_pixel);
+	header->slot_count = SHARED_FRAME_SLOT_COUNT;
+	memcpy(header->color_offsets, color_offsets, sizeof(color_offsets));
+	memcpy(header->depth_offsets, depth_offsets, sizeof(depth_offsets));
+	header->segment_size = size;
+
+	// Consumers check the magic last
+	SHARED_FRAME_STORE(&header->magic, SHARED_FRAME_MAGIC);
+
+	shared->header = header;
+	shared->size = size;
+	shared->writable = 1;
+	map_slots(shared);
+
+	return 1;
+}
+
+/*
+	@returns: 1 if the header describes a segment of this version that
+			  fits in size bytes
+*/
+static int is_valid_header(const SharedFrameHeader* header, size_t size)
+{
+	if (SHARED_FRAME_LOAD(&header->magic) != SHARED_FRAME_MAGIC ||
+		header->version != SHARED_FRAME_VERSION ||
+		header->slot_count != SHARED_FRAME_SLOT_COUNT ||
+		header->segment_size > size ||
+		header->color_format < SHARED_FRAME_COLOR_ARGB32 ||
+		header->color_format > SHARED_FRAME_COLOR_BGR24)
+	{
+		return 0;
+	}
+
+	size_t color_size = (size_t)header->color_stride * header->height;
+	size_t depth_size = (size_t)header->width * header->height * sizeof(float);
+
+	for (int i = 0; i < SHARED_FRAME_SLOT_COUNT; i++)
+	{
+		if (header->color_offsets[i] > size || size - header->color_offsets[i] < color_size ||
+			header->depth_offsets[i] > size || size - header->depth_offsets[i] < depth_size)
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int open_shared_frame_buffer(SharedFrameBuffer* shared, const char* name)
+{
+	memset(shared, 0, sizeof(SharedFrameBuffer));
+
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+	{
+		return 0;
+	}
+
+	struct stat status;
+	if (fstat(fd, &status) != 0 || (size_t)status.st_size < sizeof(SharedFrameHeader))
+	{
+		close(fd);
+		return 0;
+	}
+
+	size_t size = (size_t)status.st_size;
+	void* memory = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (memory == MAP_FAILED)
+	{
+		return 0;
+	}
+
+	SharedFrameHeader* header = (SharedFrameHeader*)memory;
+	if (!is_valid_header(header, size))
+	{
+		munmap(memory, size);
+		return 0;
+	}
+
+	shared->header = header;
+	shared->size = size;
+	shared->writable = 0;
+	map_slots(shared);
+
+	return 1;
+}
+
+void close_shared_frame_buffer(SharedFrameBuffer* shared)
+{
+	if (shared->header)
+	{
+		munmap(shared->header, shared->size);
+	}
+
+	memset(shared, 0, sizeof(SharedFrameBuffer));
+}
+
+void unlink_shared_frame_buffer(const char* name)
+{
+	shm_unlink(name);
+}
+
+FrameBuffer* acquire_shared_frame(SharedFrameBuffer* shared)
+{
+	assert(shared->writable);
+
+	SharedFrameHeader* header = shared->header;
+	uint32_t frame = header->sequence + 1;
+
+	// Announced before the slot is touched, readers of the frame two
+	// behind then know their data is going away
+	SHARED_FRAME_STORE(&header->rendering, frame);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	FrameBuffer* result = &shared->slots[(frame - 1) % SHARED_FRAME_SLOT_COUNT];
+	clear_z_buffer(result);
+
+	return result;
+}
+
+void publish_shared_frame(SharedFrameBuffer* shared)
+{
+	assert(shared->writable);
+
+	SharedFrameHeader* header = shared->header;
+
+	SHARED_FRAME_STORE(&header->sequence, header->rendering);
+	SHARED_FRAME_STORE(&header->rendering, 0);
+
+#if defined(__linux__)
+	// Not FUTEX_PRIVATE_FLAG, the waiters are in other processes
+	syscall(SYS_futex, &header->sequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+uint32_t wait_shared_frame(SharedFrameBuffer* shared, uint32_t last_sequence, int timeout_ms)
+{
+	uint32_t result = SHARED_FRAME_LOAD(&shared->header->sequence);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (result == last_sequence)
+	{
+		int remaining_ms = 10;
+		if (timeout_ms >= 0)
+		{
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			long elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+			if (elapsed_ms >= timeout_ms) break;
+			remaining_ms = timeout_ms - (int)elapsed_ms;
+		}
+
+#if defined(__linux__)
+		struct timespec timeout = { remaining_ms / 1000, (remaining_ms % 1000) * 1000000L };
+		syscall(SYS_futex, &shared->header->sequence, FUTEX_WAIT, last_sequence,
+			timeout_ms >= 0 ? &timeout : NULL, NULL, 0);
+#else
+		if (remaining_ms > 10) remaining_ms = 10;
+		struct timespec pause = { 0, remaining_ms * 1000000L };
+		nanosleep(&pause, NULL);
+#endif
+
+		result = SHARED_FRAME_LOAD(&shared->header->sequence);
+	}
+
+	return result;
+}
+
+int shared_frame_still_valid(const SharedFrameBuffer* shared, uint32_t sequence)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	// The slot is reused by frame sequence + SHARED_FRAME_SLOT_COUNT
+	uint32_t rendering = SHARED_FRAME_LOAD(&shared->header->rendering);
+	uint32_t published = SHARED_FRAME_LOAD(&shared->header->sequence);
+	uint32_t reuse = sequence + SHARED_FRAME_SLOT_COUNT;
+
+	int result = published - sequence < SHARED_FRAME_SLOT_COUNT &&
+		(rendering == 0 || rendering - reuse > 0x80000000u);
+
+	return result;
+}
+
+#endif
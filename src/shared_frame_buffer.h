@@ -0,0 +1,126 @@
+#ifndef SHARED_FRAME_BUFFER_H
+#define SHARED_FRAME_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "render.h"
+
+/*
+	Frame buffers allocated in a named POSIX shared memory segment, so
+	other processes on the host can read color and depth in place as
+	frames finish.
+
+	The segment holds a SharedFrameHeader and SHARED_FRAME_SLOT_COUNT
+	color + depth slots; frame n is rendered into slot n % slot count,
+	so a consumer can read the last frame while the next one renders.
+	Color is ARGB32 (or 24 bit BGR) words, depth the renderer's float
+	z-buffer where larger is closer, both with row 0 at the bottom.
+
+	Producer:
+		FrameBuffer* frame = acquire_shared_frame(&shared);
+		... render into frame ...
+		publish_shared_frame(&shared);
+
+	Consumer:
+		sequence = wait_shared_frame(&shared, sequence, -1);
+		slot = (sequence - 1) % SHARED_FRAME_SLOT_COUNT;
+		... read the slot ...
+		if (!shared_frame_still_valid(&shared, sequence)) ... it was overwritten
+
+	header->sequence counts published frames.  On Linux it is also a
+	futex word, woken on every publish; elsewhere waiting polls.
+	Not available on Windows, where create and open fail.
+*/
+
+#define SHARED_FRAME_MAGIC 0x42465253u		// "SRFB"
+#define SHARED_FRAME_VERSION 1
+#define SHARED_FRAME_SLOT_COUNT 2
+#define SHARED_FRAME_ALIGNMENT 4096
+
+typedef enum shared_frame_format_t
+{
+	SHARED_FRAME_COLOR_ARGB32 = 1,	// 4 bytes, B, G, R, A in memory
+	SHARED_FRAME_COLOR_BGR24 = 2,
+	SHARED_FRAME_DEPTH_FLOAT32 = 3
+} SharedFrameFormat;
+
+typedef struct shared_frame_header_t
+{
+	uint32_t magic;
+	uint32_t version;
+
+	uint32_t width;
+	uint32_t height;
+	uint32_t color_format;
+	uint32_t depth_format;
+	uint32_t color_stride;		// Bytes per row
+	uint32_t slot_count;
+
+	// Byte offsets from the start of the segment
+	uint64_t color_offsets[SHARED_FRAME_SLOT_COUNT];
+	uint64_t depth_offsets[SHARED_FRAME_SLOT_COUNT];
+	uint64_t segment_size;
+
+	uint32_t sequence;			// Published frames, futex word
+	uint32_t rendering;			// Frame being rendered, 1-based, 0 if none
+} SharedFrameHeader;
+
+typedef struct shared_frame_buffer_t
+{
+	SharedFrameHeader* header;
+	size_t size;
+	int writable;
+
+	FrameBuffer slots[SHARED_FRAME_SLOT_COUNT];	// Views into the segment
+} SharedFrameBuffer;
+
+/*
+	Creates or replaces the segment name, e.g. "/renderer".  A replaced
+	segment is unlinked, not modified, so consumers still mapping it
+	keep reading its last frames until they reopen the name.
+
+	@returns: 0 if the segment can't be created
+*/
+int create_shared_frame_buffer(SharedFrameBuffer* shared, const char* name, int width, int height, int bytes_per_pixel);
+
+/*
+	Maps an existing segment read-only, for consumers.
+
+	@returns: 0 if it doesn't exist or isn't a frame buffer segment
+*/
+int open_shared_frame_buffer(SharedFrameBuffer* shared, const char* name);
+
+/*
+	Unmaps the segment.  It stays available to others until
+	unlink_shared_frame_buffer removes the name.
+*/
+void close_shared_frame_buffer(SharedFrameBuffer* shared);
+void unlink_shared_frame_buffer(const char* name);
+
+/*
+	Returns the slot for the next frame, z-buffer cleared, and tells
+	consumers it is being rewritten.
+*/
+FrameBuffer* acquire_shared_frame(SharedFrameBuffer* shared);
+
+/*
+	Makes the acquired frame the latest one and wakes waiting consumers.
+*/
+void publish_shared_frame(SharedFrameBuffer* shared);
+
+/*
+	Waits up to timeout_ms (-1 forever) for more than last_sequence
+	frames to be published.
+
+	@returns: the sequence now, which equals last_sequence on timeout
+*/
+uint32_t wait_shared_frame(SharedFrameBuffer* shared, uint32_t last_sequence, int timeout_ms);
+
+/*
+	@returns: 1 if frame sequence hasn't started to be overwritten, check
+			  after reading it
+*/
+int shared_frame_still_valid(const SharedFrameBuffer* shared, uint32_t sequence);
+
+#endif // !SHARED_FRAME_BUFFER_H
@@ -1,39 +1,510 @@
+#include <stdint.h>
+
 #include "texture.h"
+#include "block_compression.h"
+#include "virtual_texture.h"
+#include "tga_image_loader.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
-Texture* load_texture(const char* path)
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+static Texture* load_dds_texture(const char* path);
+
+static uint32_t premultiply_ARGB32(uint32_t color)
+{
+	uint32_t A = color >> 24;
+	uint32_t R = ((color >> 16 & 0xFF) * A + 127) / 255;
+	uint32_t G = ((color >> 8 & 0xFF) * A + 127) / 255;
+	uint32_t B = ((color & 0xFF) * A + 127) / 255;
+
+	uint32_t result = A << 24 | R << 16 | G << 8 | B;
+
+	return result;
+}
+
+/*
+	TGA files go through load_tga_image, which maps the file and keeps
+	uncompressed pixels in place.  32-bit TGA pixels (B, G, R, A) are
+	already ARGB32 words, they are copied once into the texel buffer.
+*/
+static uint32_t* load_tga_ARGB32(const char* path, TextureLoadFlags flags, int* width, int* height)
+{
+	TGA_Image image = load_tga_image(path);
+
+	*width = 0;
+	*height = 0;
+
+	if (image.imageBuffer == NULL)
+	{
+		return NULL;
+	}
+
+	int bits = (unsigned char)image.header.bitsperpixel;
+	int is_gray = image.header.datatypecode == 3;
+	*width = (unsigned short)image.header.width;
+	*height = (unsigned short)image.header.height;
+
+	size_t texel_count = (size_t)*width * *height;
+	uint32_t* result = (uint32_t*)malloc(texel_count * TEXEL_BYTES);
+	const unsigned char* pixels = image.imageBuffer;
+
+	if (bits == 32)
+	{
+		memcpy(result, pixels, texel_count * TEXEL_BYTES);
+	}
+	else
+	{
+		for (size_t i = 0; i < texel_count; i++)
+		{
+			uint32_t A = 0xFF;
+			uint32_t R, G, B;
+
+			if (bits == 24)
+			{
+				B = pixels[3 * i + 0];
+				G = pixels[3 * i + 1];
+				R = pixels[3 * i + 2];
+			}
+			else if (bits == 8)
+			{
+				R = G = B = pixels[i];
+			}
+			else if (is_gray)
+			{
+				// 16 bit grayscale is a gray byte then an alpha byte
+				R = G = B = pixels[2 * i];
+				A = pixels[2 * i + 1];
+			}
+			else
+			{
+				// 15/16 bits: xRRRRRGG GGGBBBBB, the top bit is not alpha
+				uint32_t color = pixels[2 * i] | pixels[2 * i + 1] << 8;
+				R = ((color >> 10) & 0x1F) * 255 / 31;
+				G = ((color >> 5) & 0x1F) * 255 / 31;
+				B = (color & 0x1F) * 255 / 31;
+			}
+
+			result[i] = A << 24 | R << 16 | G << 8 | B;
+		}
+	}
+
+	free_tga_image(&image);
+
+	if (flags & TEXTURE_LOAD_PREMULTIPLY_ALPHA)
+	{
+		for (size_t i = 0; i < texel_count; i++)
+		{
+			result[i] = premultiply_ARGB32(result[i]);
+		}
+	}
+
+	return result;
+}
+
+/*
+	Decodes an image file to row-major ARGB32 texels, bottom row first.
+
+	@returns: texels to be freed by the caller, NULL if the file can't
+	          be decoded
+*/
+uint32_t* load_image_ARGB32(const char* path, TextureLoadFlags flags, int* width, int* height)
 {
-	Texture* texture = (Texture*)malloc(sizeof(Texture));
+	const char* extension = strrchr(path, '.');
+	if (extension && (strcmp(extension, ".tga") == 0 || strcmp(extension, ".TGA") == 0))
+	{
+		return load_tga_ARGB32(path, flags, width, height);
+	}
 
 	stbi_set_flip_vertically_on_load(1);
 
 	int num_channels;
-	int tex_width;
-	int tex_height;
+	int tex_width = 0;
+	int tex_height = 0;
 
+	// Grey, grey-alpha and RGB images are expanded to RGBA by stb_image
 	unsigned char* data = stbi_load(
 		path,
 		&tex_width,
 		&tex_height,
 		&num_channels,
-		0
+		4
 	);
 
+	*width = tex_width;
+	*height = tex_height;
+
+	if (data == NULL)
+	{
+		return NULL;
+	}
+
+	int texel_count = tex_width * tex_height;
+	uint32_t* result = (uint32_t*)malloc(texel_count * TEXEL_BYTES);
+
+	for (int i = 0; i < texel_count; i++)
+	{
+		uint32_t R = data[4 * i + 0];
+		uint32_t G = data[4 * i + 1];
+		uint32_t B = data[4 * i + 2];
+		uint32_t A = data[4 * i + 3];
+
+		if (flags & TEXTURE_LOAD_PREMULTIPLY_ALPHA)
+		{
+			R = (R * A + 127) / 255;
+			G = (G * A + 127) / 255;
+			B = (B * A + 127) / 255;
+		}
+
+		result[i] = A << 24 | R << 16 | G << 8 | B;
+	}
+
+	stbi_image_free(data);
+
+	return result;
+}
+
+Texture* load_texture(const char* path, TextureLoadFlags flags)
+{
+	const char* extension = strrchr(path, '.');
+	if (extension && (strcmp(extension, ".dds") == 0 || strcmp(extension, ".DDS") == 0))
+	{
+		// Block compressed data is used as stored, flags do not apply
+		return load_dds_texture(path);
+	}
+	if (extension && strcmp(extension, VIRTUAL_TEXTURE_EXTENSION) == 0)
+	{
+		// Pages are streamed from disk as they are sampled
+		return load_virtual_texture(path);
+	}
+
+	Texture* texture = (Texture*)calloc(1, sizeof(Texture));
+
+	int tex_width;
+	int tex_height;
+	uint32_t* texels = load_image_ARGB32(path, flags, &tex_width, &tex_height);
+
 	texture->width = tex_width;
 	texture->height = tex_height;
-	texture->memory = data;
-	texture->bytes_per_pixel = num_channels;
+	texture->bytes_per_pixel = TEXEL_BYTES;
+	texture->level_count = 1;
+
+	if (texels)
+	{
+		texture->levels[0].memory = texels;
+		texture->levels[0].width = tex_width;
+		texture->levels[0].height = tex_height;
+
+		// Mips are filtered from the row-major image, then every level is tiled
+		generate_mipmaps(texture);
+
+		for (int i = 0; i < texture->level_count; i++)
+		{
+			void* linear = texture->levels[i].memory;
+			swizzle_texture_level(&texture->levels[i], TEXEL_BYTES);
+			free(linear);
+		}
+	}
+
+	texture->memory = texture->levels[0].memory;
 
 	return texture;
 }
 
+/*
+	Converts a row-major level to the tiled layout of texel_index().
+	Partial tiles on the right and top edges are padded, the padding
+	is never sampled.
+*/
+void swizzle_texture_level(TextureLevel* level, int bytes_per_pixel)
+{
+	int tiles_x = (level->width + TEXTURE_TILE_MASK) >> TEXTURE_TILE_SHIFT;
+	int tiles_y = (level->height + TEXTURE_TILE_MASK) >> TEXTURE_TILE_SHIFT;
+
+	int tile_bytes = TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * bytes_per_pixel;
+
+	unsigned char* linear = (unsigned char*)level->memory;
+	unsigned char* tiled = (unsigned char*)calloc(tiles_x * tiles_y, tile_bytes);
+
+	level->tiles_x = tiles_x;
+
+	for (int y = 0; y < level->height; y++)
+	{
+		unsigned char* row = linear + y * level->width * bytes_per_pixel;
+		for (int x = 0; x < level->width; x++)
+		{
+			memcpy(tiled + texel_index(level, x, y) * bytes_per_pixel, row + x * bytes_per_pixel, bytes_per_pixel);
+		}
+	}
+
+	level->memory = tiled;
+}
+
+/*
+	2x2 box filter.  For odd sizes the last row/column is reused,
+	so every source texel contributes to the smaller level.
+*/
+static void downsample_level(const TextureLevel* src, TextureLevel* dst, int bytes_per_pixel)
+{
+	const unsigned char* src_memory = (const unsigned char*)src->memory;
+	unsigned char* dst_memory = (unsigned char*)dst->memory;
+
+	int src_stride = src->width * bytes_per_pixel;
+
+	for (int y = 0; y < dst->height; y++)
+	{
+		int y0 = 2 * y;
+		int y1 = (2 * y + 1 < src->height) ? 2 * y + 1 : src->height - 1;
+
+		const unsigned char* row0 = src_memory + y0 * src_stride;
+		const unsigned char* row1 = src_memory + y1 * src_stride;
+		unsigned char* dst_row = dst_memory + y * dst->width * bytes_per_pixel;
+
+		for (int x = 0; x < dst->width; x++)
+		{
+			int x0 = 2 * x * bytes_per_pixel;
+			int x1 = ((2 * x + 1 < src->width) ? 2 * x + 1 : src->width - 1) * bytes_per_pixel;
+
+			for (int c = 0; c < bytes_per_pixel; c++)
+			{
+				int sum = row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c];
+				dst_row[x * bytes_per_pixel + c] = (unsigned char)((sum + 2) / 4);
+			}
+		}
+	}
+}
+
+/*
+	Builds levels 1..N from level 0.  Minified surfaces then read
+	from a level whose texels are about one pixel apart, which keeps
+	the fetches inside a few cache lines instead of one per pixel.
+*/
+void generate_mipmaps(Texture* texture)
+{
+	int level = 0;
+
+	while (level + 1 < MAX_MIP_LEVELS)
+	{
+		TextureLevel* src = &texture->levels[level];
+		if (src->width == 1 && src->height == 1) break;
+
+		TextureLevel* dst = &texture->levels[level + 1];
+		dst->width = src->width > 1 ? src->width / 2 : 1;
+		dst->height = src->height > 1 ? src->height / 2 : 1;
+		dst->memory = malloc(dst->width * dst->height * texture->bytes_per_pixel);
+
+		downsample_level(src, dst, texture->bytes_per_pixel);
+
+		level++;
+	}
+
+	texture->level_count = level + 1;
+}
+
+static uint32_t read_u32_le(const unsigned char* data)
+{
+	uint32_t result = data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+
+	return result;
+}
+
+#define DDS_FOURCC(a, b, c, d) ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+
+// DXGI_FORMAT values of the DX10 header extension
+#define DXGI_FORMAT_BC1_UNORM 71
+#define DXGI_FORMAT_BC1_UNORM_SRGB 72
+#define DXGI_FORMAT_BC3_UNORM 77
+#define DXGI_FORMAT_BC3_UNORM_SRGB 78
+#define DXGI_FORMAT_BC7_UNORM 98
+#define DXGI_FORMAT_BC7_UNORM_SRGB 99
+
+/*
+	Loads a BC1 (DXT1), BC3 (DXT5) or BC7 (DX10 header) DDS file with
+	its stored mip chain.  Blocks are kept compressed, one allocation
+	per level, in file order: block rows top to bottom.
+
+	@returns: texture with no levels if the file can't be read or the
+	          format isn't supported
+*/
+static Texture* load_dds_texture(const char* path)
+{
+	Texture* texture = (Texture*)calloc(1, sizeof(Texture));
+	texture->bytes_per_pixel = TEXEL_BYTES;
+
+	FILE* file = fopen(path, "rb");
+	if (file == NULL)
+	{
+		return texture;
+	}
+
+	fseek(file, 0, SEEK_END);
+	long file_size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	unsigned char* data = (unsigned char*)malloc(file_size > 0 ? file_size : 1);
+	size_t read_size = fread(data, 1, file_size > 0 ? file_size : 0, file);
+	fclose(file);
+
+	// Magic (4 bytes) + DDS_HEADER (124 bytes)
+	if (read_size < 128 || read_u32_le(data) != DDS_FOURCC('D', 'D', 'S', ' '))
+	{
+		free(data);
+		return texture;
+	}
+
+	int height = (int)read_u32_le(data + 12);
+	int width = (int)read_u32_le(data + 16);
+	int mip_count = (int)read_u32_le(data + 28);
+	uint32_t fourcc = read_u32_le(data + 84);
+
+	size_t offset = 128;
+	TextureFormat format = TEXTURE_FORMAT_ARGB32;
+
+	if (fourcc == DDS_FOURCC('D', 'X', 'T', '1'))
+	{
+		format = TEXTURE_FORMAT_BC1;
+	}
+	else if (fourcc == DDS_FOURCC('D', 'X', 'T', '5'))
+	{
+		format = TEXTURE_FORMAT_BC3;
+	}
+	else if (fourcc == DDS_FOURCC('D', 'X', '1', '0') && read_size >= 148)
+	{
+		uint32_t dxgi_format = read_u32_le(data + 128);
+		offset = 148;
+
+		switch (dxgi_format)
+		{
+			case DXGI_FORMAT_BC1_UNORM:
+			case DXGI_FORMAT_BC1_UNORM_SRGB: format = TEXTURE_FORMAT_BC1; break;
+			case DXGI_FORMAT_BC3_UNORM:
+			case DXGI_FORMAT_BC3_UNORM_SRGB: format = TEXTURE_FORMAT_BC3; break;
+			case DXGI_FORMAT_BC7_UNORM:
+			case DXGI_FORMAT_BC7_UNORM_SRGB: format = TEXTURE_FORMAT_BC7; break;
+		}
+	}
+
+	if (format == TEXTURE_FORMAT_ARGB32 || width <= 0 || height <= 0)
+	{
+		free(data);
+		return texture;
+	}
+
+	int block_bytes = format == TEXTURE_FORMAT_BC1 ? BC1_BLOCK_BYTES : BC3_BLOCK_BYTES;
+
+	if (mip_count < 1) mip_count = 1;
+	if (mip_count > MAX_MIP_LEVELS) mip_count = MAX_MIP_LEVELS;
+
+	texture->format = format;
+	texture->width = width;
+	texture->height = height;
+
+	for (int i = 0; i < mip_count; i++)
+	{
+		TextureLevel* level = &texture->levels[i];
+		level->width = width > 1 ? width : 1;
+		level->height = height > 1 ? height : 1;
+
+		int blocks_x = (level->width + BC_BLOCK_DIM - 1) / BC_BLOCK_DIM;
+		int blocks_y = (level->height + BC_BLOCK_DIM - 1) / BC_BLOCK_DIM;
+		size_t level_bytes = (size_t)blocks_x * blocks_y * block_bytes;
+
+		// Truncated file, keep the levels read so far
+		if (offset + level_bytes > read_size) break;
+
+		level->tiles_x = blocks_x;
+		level->memory = malloc(level_bytes);
+		memcpy(level->memory, data + offset, level_bytes);
+
+		offset += level_bytes;
+		texture->level_count = i + 1;
+
+		width /= 2;
+		height /= 2;
+	}
+
+	free(data);
+
+	texture->memory = texture->levels[0].memory;
+
+	return texture;
+}
+
+/*
+	Decoded blocks, one small direct-mapped cache per thread.  Bilinear
+	footprints and neighbouring pixels hit the same block most of the
+	time, so a block is decoded once for many fetches.
+
+	Entries are keyed by block address, the generation is bumped when a
+	texture is freed so a reused allocation is never mistaken for a
+	cached one.
+*/
+#define BLOCK_CACHE_SIZE 64
+
+typedef struct decoded_block_t
+{
+	const uint8_t* block;
+	unsigned int generation;
+	uint32_t texels[16];
+} DecodedBlock;
+
+static THREAD_LOCAL DecodedBlock block_cache[BLOCK_CACHE_SIZE];
+static unsigned int block_cache_generation = 1;
+
+uint32_t fetch_compressed_texel(const Texture* texture, const TextureLevel* level, int x, int y)
+{
+	int block_bytes = texture->format == TEXTURE_FORMAT_BC1 ? BC1_BLOCK_BYTES : BC3_BLOCK_BYTES;
+
+	// Texture rows go bottom to top, DDS blocks top to bottom
+	y = level->height - 1 - y;
+
+	int block_x = x / BC_BLOCK_DIM;
+	int block_y = y / BC_BLOCK_DIM;
+
+	const uint8_t* block = (const uint8_t*)level->memory + ((size_t)block_y * level->tiles_x + block_x) * block_bytes;
+
+	DecodedBlock* entry = &block_cache[((uintptr_t)block / block_bytes) & (BLOCK_CACHE_SIZE - 1)];
+
+	if (entry->block != block || entry->generation != block_cache_generation)
+	{
+		switch (texture->format)
+		{
+			case TEXTURE_FORMAT_BC1: decode_bc1_block(block, entry->texels); break;
+			case TEXTURE_FORMAT_BC3: decode_bc3_block(block, entry->texels); break;
+			default: decode_bc7_block(block, entry->texels); break;
+		}
+
+		entry->block = block;
+		entry->generation = block_cache_generation;
+	}
+
+	uint32_t result = entry->texels[(y % BC_BLOCK_DIM) * BC_BLOCK_DIM + x % BC_BLOCK_DIM];
+
+	return result;
+}
+
 void free_texture(Texture* texture)
 {
 	if (texture)
 	{
-		STBI_FREE(texture->memory);
+		if (texture->format == TEXTURE_FORMAT_VIRTUAL)
+		{
+			free_virtual_texture(texture->virtual_texture);
+		}
+		else if (texture->format != TEXTURE_FORMAT_ARGB32)
+		{
+			block_cache_generation++;
+		}
+
+		for (int i = 0; i < texture->level_count; i++)
+		{
+			free(texture->levels[i].memory);
+		}
 	}
 	free(texture);
-}
\ No newline at end of file
+}
@@ -1,16 +1,146 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
+#include <stdint.h>
+
+// Enough for a 32768 x 32768 texture
+#define MAX_MIP_LEVELS 16
+
+/*
+	Texels are stored in square tiles of TEXTURE_TILE_SIZE, with tiles in
+	row-major order and texels inside a tile in Z-order (Morton).  Any
+	2x2 texel footprint then sits in one or two cache lines, whichever
+	way the UVs walk across the texture.
+*/
+#define TEXTURE_TILE_SHIFT 3
+#define TEXTURE_TILE_SIZE (1 << TEXTURE_TILE_SHIFT)
+#define TEXTURE_TILE_MASK (TEXTURE_TILE_SIZE - 1)
+
+typedef struct texture_level_t
+{
+	void* memory;	// Tiled layout, see texel_index()
+	int width;
+	int height;
+	int tiles_x;	// Tiles per row, width rounded up to TEXTURE_TILE_SIZE,
+					// or 4x4 blocks per row for compressed formats
+} TextureLevel;
+
+/*
+	Every texture is expanded at load time to one 32-bit texel format,
+	packed the same way as the frame buffer (see pack_color_ARGB32).
+	A texel fetch is then a single aligned 32-bit load.
+
+	The exception are block compressed textures loaded from DDS files,
+	which stay compressed in memory (4-8x smaller) and are decoded a
+	4x4 block at a time when sampled, see fetch_texel(), and virtual
+	textures, which page ARGB32 texels in from disk.
+*/
+#define TEXEL_BYTES 4
+
+typedef enum texture_format_t
+{
+	TEXTURE_FORMAT_ARGB32,	// Tiled, see texel_index()
+	TEXTURE_FORMAT_BC1,		// 8 bytes per 4x4 block, RGB + 1-bit alpha
+	TEXTURE_FORMAT_BC3,		// 16 bytes per 4x4 block, RGB + 8-bit alpha
+	TEXTURE_FORMAT_BC7,		// 16 bytes per 4x4 block, RGBA
+	TEXTURE_FORMAT_VIRTUAL	// ARGB32 pages streamed from disk, see virtual_texture.h
+} TextureFormat;
+
+typedef enum texture_load_flags_t
+{
+	TEXTURE_LOAD_DEFAULT = 0,
+	TEXTURE_LOAD_PREMULTIPLY_ALPHA = 1 << 0	// Store color * alpha
+} TextureLoadFlags;
+
+typedef enum texture_filter_t
+{
+	TEXTURE_FILTER_BILINEAR,
+	TEXTURE_FILTER_NEAREST
+} TextureFilter;
+
+typedef enum texture_wrap_t
+{
+	TEXTURE_WRAP_CLAMP,		// UVs outside [0, 1] read the edge texels
+	TEXTURE_WRAP_REPEAT		// UVs outside [0, 1] tile the texture
+} TextureWrap;
+
 typedef struct texture_t
 {
-	void* memory;
+	void* memory;	// Level 0, same as levels[0].memory
 	int width;
 	int height;
-	int bytes_per_pixel;
+	int bytes_per_pixel;	// Always TEXEL_BYTES, the size of a decoded texel
+	TextureFormat format;
+
+	// Mip chain, each level half the size of the previous one, down to 1x1
+	TextureLevel levels[MAX_MIP_LEVELS];
+	int level_count;
+
+	TextureFilter filter;
+	TextureWrap wrap;
+
+	// Page tables and page cache, TEXTURE_FORMAT_VIRTUAL only
+	struct virtual_texture_t* virtual_texture;
 } Texture;
 
 
-Texture* load_texture(const char* path);
+/*
+	Spreads the low 3 bits of v to the even bit positions: abc -> a0b0c
+*/
+static unsigned int part_1_by_1(unsigned int v)
+{
+	unsigned int result = (v & 1) | ((v & 2) << 1) | ((v & 4) << 2);
+
+	return result;
+}
+
+/*
+	x, y - texel coordinates within the level
+
+	@returns: index of the texel in the level's tiled memory
+*/
+static unsigned int texel_index(const TextureLevel* level, int x, int y)
+{
+	unsigned int tile = (y >> TEXTURE_TILE_SHIFT) * level->tiles_x + (x >> TEXTURE_TILE_SHIFT);
+	unsigned int morton = part_1_by_1(x & TEXTURE_TILE_MASK) | (part_1_by_1(y & TEXTURE_TILE_MASK) << 1);
+
+	unsigned int result = (tile << (2 * TEXTURE_TILE_SHIFT)) | morton;
+
+	return result;
+}
+
+uint32_t fetch_compressed_texel(const Texture* texture, const TextureLevel* level, int x, int y);
+uint32_t fetch_virtual_texel(const Texture* texture, int level, int x, int y);
+
+/*
+	x, y - texel coordinates within the level, row 0 at the bottom
+
+	@returns: packed ARGB32 texel
+*/
+static uint32_t fetch_texel(const Texture* texture, const TextureLevel* level, int x, int y)
+{
+	uint32_t result;
+
+	if (texture->format == TEXTURE_FORMAT_ARGB32)
+	{
+		result = ((const uint32_t*)level->memory)[texel_index(level, x, y)];
+	}
+	else if (texture->format == TEXTURE_FORMAT_VIRTUAL)
+	{
+		result = fetch_virtual_texel(texture, (int)(level - texture->levels), x, y);
+	}
+	else
+	{
+		result = fetch_compressed_texel(texture, level, x, y);
+	}
+
+	return result;
+}
+
+uint32_t* load_image_ARGB32(const char* path, TextureLoadFlags flags, int* width, int* height);
+Texture* load_texture(const char* path, TextureLoadFlags flags);
+void generate_mipmaps(Texture* texture);
+void swizzle_texture_level(TextureLevel* level, int bytes_per_pixel);
 void free_texture(Texture* texture);
 
-#endif
\ No newline at end of file
+#endif
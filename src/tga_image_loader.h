@@ -4,6 +4,10 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+
+#include "file_mapping.h"
+#include "thread.h"
 
 #pragma pack(push, 1)
 typedef struct {
@@ -40,28 +44,51 @@ typedef struct tga_image_t
 {
     TGA_Header2 header;
     unsigned char* imageBuffer;
+
+    FileMapping mapping;    // Backs imageBuffer unless owns_buffer
+    int owns_buffer;
 }TGA_Image;
 
-static void write_tga_image(const char *filename,
-                            const int width, 
-                            const int height, 
-                            const TGA_ImageDataType dataType,
-                            const unsigned char *buffer)
-{
-    assert(sizeof(TGA_Header2) == 18);
-    assert(buffer != 0);
+#define TGA_WRITE_BUFFER_SIZE (1 << 20)   // stdio buffer for output files
+#define TGA_BAND_BYTES (1 << 20)          // Uncompressed bytes per RLE band
 
+/*
+    @returns: NULL if the file can't be created
+*/
+static FILE* tga_open_for_write(const char* filename)
+{
     // Open in binary mode!  If text mode (w+), Windows will add 0D to every 0A
-    char *mode = "wb+";
+    FILE* file = fopen(filename, "wb");
+
+    // Fully buffered, so the many small packets reach the disk in large writes
+    if (file)
+    {
+        setvbuf(file, NULL, _IOFBF, TGA_WRITE_BUFFER_SIZE);
+    }
 
-	FILE *file;    
-	file = fopen(filename, mode);  
-    assert(file != NULL);
-    setbuf(file, NULL);
+    return file;
+}
+
+/*
+    Closes a file opened by tga_open_for_write.
+
+    @returns: 0 if any write to it failed
+*/
+static int tga_close_written(FILE* file)
+{
+    int result = !ferror(file);
+    result &= fclose(file) == 0;
+
+    return result;
+}
+
+static TGA_Header2 tga_make_header(int datatypecode, int width, int height, TGA_ImageDataType dataType)
+{
+    assert(sizeof(TGA_Header2) == 18);
 
     TGA_Header2 header = {0};
 
-    header.datatypecode = 2;
+    header.datatypecode = datatypecode;
     header.width = width;
     header.height = height;
 
@@ -73,62 +100,451 @@ static void write_tga_image(const char *filename,
     {
         header.bitsperpixel = 32;
     }
-    
-    int header_elements_written = fwrite(&header, sizeof(TGA_Header2), 1, file);
 
-    int buffer_size_in_bytes = width * height * (header.bitsperpixel / 8);
-    int body_elements_written = fwrite(buffer, sizeof(char), buffer_size_in_bytes, file);
+    return header;
+}
+
+/*
+    @returns: 0 if the file couldn't be written
+*/
+static int write_tga_image(const char *filename,
+                           const int width, 
+                           const int height, 
+                           const TGA_ImageDataType dataType,
+                           const unsigned char *buffer)
+{
+    assert(buffer != 0);
+
+    FILE* file = tga_open_for_write(filename);
+    if (!file)
+    {
+        return 0;
+    }
+
+    TGA_Header2 header = tga_make_header(2, width, height, dataType);
+    fwrite(&header, sizeof(TGA_Header2), 1, file);
+
+    size_t buffer_size_in_bytes = (size_t)width * height * (header.bitsperpixel / 8);
+    fwrite(buffer, sizeof(char), buffer_size_in_bytes, file);
+
+    return tga_close_written(file);
+}
+
+static int tga_same_pixel(const unsigned char* a, const unsigned char* b, int bytes)
+{
+    if (bytes == 4)
+    {
+        unsigned int pa, pb;
+        memcpy(&pa, a, 4);
+        memcpy(&pb, b, 4);
+        return pa == pb;
+    }
+
+    return memcmp(a, b, bytes) == 0;
+}
+
+/*
+    RLE encodes one row into out, which must hold the worst case of
+    width * bytes + (width + 127) / 128 bytes.  Packets never cross the
+    end of the row, as the TGA 2.0 specification asks.
+
+    @returns: bytes written to out
+*/
+static size_t tga_encode_rle_row(const unsigned char* row, int width, int bytes, unsigned char* out)
+{
+    unsigned char* o = out;
+    int x = 0;
+
+    while (x < width)
+    {
+        const unsigned char* pixel = row + (size_t)x * bytes;
+
+        int run = 1;
+        while (x + run < width && run < 128 && tga_same_pixel(pixel, pixel + (size_t)run * bytes, bytes))
+        {
+            run++;
+        }
+
+        if (run > 1)
+        {
+            *o++ = (unsigned char)(0x80 | (run - 1));
+            memcpy(o, pixel, bytes);
+            o += bytes;
+            x += run;
+            continue;
+        }
+
+        // Raw packet up to the next pair of equal pixels
+        int count = 1;
+        while (x + count < width && count < 128)
+        {
+            const unsigned char* next = row + (size_t)(x + count) * bytes;
+            if (x + count + 1 < width && tga_same_pixel(next, next + bytes, bytes))
+            {
+                break;
+            }
+            count++;
+        }
+
+        *o++ = (unsigned char)(count - 1);
+        memcpy(o, pixel, (size_t)count * bytes);
+        o += (size_t)count * bytes;
+        x += count;
+    }
+
+    return (size_t)(o - out);
+}
+
+/*
+    A horizontal band of rows RLE encoded by one task.
+*/
+typedef struct tga_band_t
+{
+    unsigned char* encoded;
+    size_t encoded_size;
+} TGA_Band;
+
+typedef struct tga_rle_job_t
+{
+    const unsigned char* buffer;
+    int width;
+    int height;
+    int bytes;
+    int rows_per_band;
+    int first_band;         // Band of the current batch at index 0
+    TGA_Band* bands;
+} TGA_RLE_Job;
+
+static void tga_encode_band(void* data, int index)
+{
+    TGA_RLE_Job* job = (TGA_RLE_Job*)data;
+    TGA_Band* band = &job->bands[index];
+
+    int first_row = (job->first_band + index) * job->rows_per_band;
+    int last_row = first_row + job->rows_per_band;
+    if (last_row > job->height) last_row = job->height;
+
+    size_t row_bytes = (size_t)job->width * job->bytes;
+    size_t size = 0;
+
+    for (int y = first_row; y < last_row; y++)
+    {
+        size += tga_encode_rle_row(job->buffer + y * row_bytes, job->width, job->bytes, band->encoded + size);
+    }
+
+    band->encoded_size = size;
+}
+
+/*
+    Writes an RLE compressed (type 10) TGA file.  The image is cut in
+    bands of about TGA_BAND_BYTES, a batch of bands is encoded in
+    parallel and written in order before the next batch starts, so the
+    memory used stays bounded for any image size.  Flat images, like a
+    filled background, compress to a small fraction of write_tga_image.
+
+    @returns: 0 if the file couldn't be written
+*/
+static int write_tga_image_rle(const char *filename,
+                               const int width,
+                               const int height,
+                               const TGA_ImageDataType dataType,
+                               const unsigned char *buffer)
+{
+    assert(buffer != 0);
+
+    FILE* file = tga_open_for_write(filename);
+    if (!file)
+    {
+        return 0;
+    }
+
+    TGA_Header2 header = tga_make_header(10, width, height, dataType);
+    fwrite(&header, sizeof(TGA_Header2), 1, file);
+
+    TGA_RLE_Job job = {0};
+    job.buffer = buffer;
+    job.width = width;
+    job.height = height;
+    job.bytes = header.bitsperpixel / 8;
+
+    size_t row_bytes = (size_t)width * job.bytes;
+    size_t max_row_bytes = row_bytes + (width + 127) / 128;
+
+    job.rows_per_band = (int)(TGA_BAND_BYTES / row_bytes);
+    if (job.rows_per_band < 1) job.rows_per_band = 1;
+
+    int band_count = (height + job.rows_per_band - 1) / job.rows_per_band;
+    int batch_size = get_cpu_count();
+    if (batch_size > band_count) batch_size = band_count;
+
+    job.bands = (TGA_Band*)malloc(batch_size * sizeof(TGA_Band));
+    for (int i = 0; i < batch_size; i++)
+    {
+        job.bands[i].encoded = (unsigned char*)malloc(job.rows_per_band * max_row_bytes);
+    }
+
+    for (job.first_band = 0; job.first_band < band_count; job.first_band += batch_size)
+    {
+        int count = band_count - job.first_band;
+        if (count > batch_size) count = batch_size;
+
+        parallel_for(count, tga_encode_band, &job);
+
+        for (int i = 0; i < count; i++)
+        {
+            fwrite(job.bands[i].encoded, 1, job.bands[i].encoded_size, file);
+        }
+    }
+
+    for (int i = 0; i < batch_size; i++)
+    {
+        free(job.bands[i].encoded);
+    }
+    free(job.bands);
+
+    return tga_close_written(file);
+}
+
+/*
+    Streams the pixels of a TGA file into the output buffer, in file
+    order, placing each one according to the image origin so the buffer
+    always starts at the bottom-left pixel.
+*/
+typedef struct tga_decoder_t
+{
+    unsigned char* out;
+    int width;
+    int height;
+    int out_bytes;          // Bytes per output pixel
+    int top_origin;         // First stored row is the top one
+    int right_origin;       // First stored column is the right one
+
+    const unsigned char* colormap;  // NULL unless color mapped
+    int colormap_first;     // Index of the first colormap entry
+    int colormap_length;
+    int index_bytes;        // Bytes per color index
+
+    int x;                  // Cursor, in file order
+    int y;
+} TGA_Decoder;
+
+static int tga_store_pixel(TGA_Decoder* decoder, const unsigned char* pixel)
+{
+    int row = decoder->top_origin ? decoder->height - 1 - decoder->y : decoder->y;
+    int column = decoder->right_origin ? decoder->width - 1 - decoder->x : decoder->x;
+
+    unsigned char* out = decoder->out + ((size_t)row * decoder->width + column) * decoder->out_bytes;
+
+    if (decoder->colormap)
+    {
+        int index = decoder->index_bytes == 2 ? pixel[0] | pixel[1] << 8 : pixel[0];
+        index -= decoder->colormap_first;
+        if (index < 0 || index >= decoder->colormap_length)
+        {
+            return 0;
+        }
+        pixel = decoder->colormap + (size_t)index * decoder->out_bytes;
+    }
+
+    for (int i = 0; i < decoder->out_bytes; i++)
+    {
+        out[i] = pixel[i];
+    }
+
+    if (++decoder->x == decoder->width)
+    {
+        decoder->x = 0;
+        decoder->y++;
+    }
+
+    return 1;
+}
+
+static void free_tga_image(TGA_Image* image)
+{
+    if (image->owns_buffer)
+    {
+        free(image->imageBuffer);
+    }
+    unmap_file(&image->mapping);
 
-	fclose(file);
+    image->imageBuffer = NULL;
+    image->owns_buffer = 0;
 }
 
-// TODO - load is not implemented completely yet (impl rle)
+/*
+    Loads uncompressed (2, 3), color mapped (1) and RLE (9, 10, 11) TGA
+    images.  The pixels in imageBuffer always start at the bottom-left
+    and are stored as in the file, e.g. B, G, R, A for 32 bits, or gray
+    then alpha for 16 bit grayscale (3, 11) where 16 bit color (2, 10)
+    is RGB555; color mapped images are expanded to their palette format.
+
+    The file is memory mapped.  Uncompressed bottom-left images are used
+    in place, anything else is decoded from the mapping straight into
+    one allocation.  Release with free_tga_image.
+
+    @returns: image with a NULL imageBuffer if the file can't be read or
+              is damaged
+*/
 static TGA_Image load_tga_image(const char *filename)
 {
     TGA_Image result = {0};
 
-    char* mode = "rb";
-    long file_size = 0;
+    FileMapping mapping;
+    if (!map_file(filename, &mapping))
+    {
+        return result;
+    }
 
-    FILE* file;
+    const unsigned char* data = (const unsigned char*)mapping.data;
+    size_t size = mapping.size;
 
-    // Open file
-    file = fopen(filename, mode);
-    if (file == NULL)
-    {        
+    if (size < sizeof(TGA_Header2))
+    {
+        unmap_file(&mapping);
         return result;
     }
-       
-    // Get file size
-    int seek_result = fseek(file, 0, SEEK_END);
-    if (seek_result != 0)
+
+    TGA_Header2 header;
+    memcpy(&header, data, sizeof(TGA_Header2));
+
+    int type = (unsigned char)header.datatypecode;
+    int is_rle = type >= 9;
+    int base_type = is_rle ? type - 8 : type;
+
+    int width = (unsigned short)header.width;
+    int height = (unsigned short)header.height;
+    int bits = (unsigned char)header.bitsperpixel;
+    int in_bytes = (bits + 7) / 8;
+
+    size_t colormap_offset = sizeof(TGA_Header2) + (unsigned char)header.idlength;
+    int colormap_length = (unsigned short)header.colourmaplength;
+    int colormap_bytes = ((unsigned char)header.colourmapdepth + 7) / 8;
+    size_t data_offset = colormap_offset;
+    if (header.colourmaptype == 1)
+    {
+        data_offset += (size_t)colormap_length * colormap_bytes;
+    }
+
+    int valid =
+        (base_type == 1 || base_type == 2 || base_type == 3) &&
+        (type <= 3 || is_rle) &&
+        width > 0 && height > 0 &&
+        data_offset <= size &&
+        (base_type == 1 ?
+            header.colourmaptype == 1 && (bits == 8 || bits == 16) && colormap_bytes > 0 :
+         base_type == 3 ?
+            bits == 8 || bits == 16 :
+            bits == 15 || bits == 16 || bits == 24 || bits == 32);
+
+    if (!valid)
     {
+        unmap_file(&mapping);
         return result;
     }
-    file_size = ftell(file);
 
-    // Reset pointer to beginning of file
-    rewind(file);
+    int out_bytes = base_type == 1 ? colormap_bytes : in_bytes;
+    size_t pixel_count = (size_t)width * height;
+
+    int top_origin = (header.imagedescriptor & 0x20) != 0;
+    int right_origin = (header.imagedescriptor & 0x10) != 0;
 
-    // Allocate memory for file buffer
-    void* buffer = malloc(file_size);
-    if (buffer == NULL)
+    // The buffer is bottom-left, uncompressed and not color mapped
+    result.header = header;
+    result.header.idlength = 0;
+    result.header.colourmaptype = 0;
+    result.header.colourmaporigin = 0;
+    result.header.colourmaplength = 0;
+    result.header.colourmapdepth = 0;
+    result.header.datatypecode = base_type == 3 ? 3 : 2;
+    result.header.bitsperpixel = (char)(base_type == 1 ? (unsigned char)header.colourmapdepth : bits);
+    result.header.imagedescriptor &= ~0x30;
+
+    if (!is_rle && base_type != 1 && !top_origin && !right_origin)
     {
+        // Zero copy, the pixels are used where they are mapped
+        if (size - data_offset < pixel_count * in_bytes)
+        {
+            unmap_file(&mapping);
+            return result;
+        }
+
+        result.imageBuffer = (unsigned char*)data + data_offset;
+        result.mapping = mapping;
+        result.owns_buffer = 0;
+
         return result;
     }
 
-    fread(buffer, sizeof(char), file_size, file);
-   
-    TGA_Header2 *header = (TGA_Header2*)buffer;
+    TGA_Decoder decoder = {0};
+    decoder.out = (unsigned char*)malloc(pixel_count * out_bytes);
+    decoder.width = width;
+    decoder.height = height;
+    decoder.out_bytes = out_bytes;
+    decoder.top_origin = top_origin;
+    decoder.right_origin = right_origin;
+    if (base_type == 1)
+    {
+        decoder.colormap = data + colormap_offset;
+        decoder.colormap_first = (unsigned short)header.colourmaporigin;
+        decoder.colormap_length = colormap_length;
+        decoder.index_bytes = in_bytes;
+    }
+
+    const unsigned char* c = data + data_offset;
+    const unsigned char* end = data + size;
+    size_t decoded = 0;
+    int ok = 1;
+
+    while (ok && decoded < pixel_count)
+    {
+        // Uncompressed data is one long raw packet
+        size_t count = pixel_count - decoded;
+        int repeat = 0;
+
+        if (is_rle)
+        {
+            if (c >= end)
+            {
+                ok = 0;
+                break;
+            }
+
+            repeat = (*c & 0x80) != 0;
+            count = (size_t)(*c & 0x7F) + 1;
+            c++;
+
+            // Packets may cross rows, but not the end of the image
+            if (count > pixel_count - decoded) count = pixel_count - decoded;
+        }
+
+        size_t packet_bytes = repeat ? (size_t)in_bytes : count * in_bytes;
+        if ((size_t)(end - c) < packet_bytes)
+        {
+            ok = 0;
+            break;
+        }
+
+        for (size_t i = 0; i < count && ok; i++)
+        {
+            ok = tga_store_pixel(&decoder, repeat ? c : c + i * in_bytes);
+        }
+
+        c += packet_bytes;
+        decoded += count;
+    }
+
+    unmap_file(&mapping);
+
+    if (!ok)
+    {
+        free(decoder.out);
+        return result;
+    }
 
-    result.header.height = header->height;
-    result.header.width = header->width;
-    result.header.bitsperpixel = header->bitsperpixel;
-    // TODO - fill out the rest
+    result.imageBuffer = decoder.out;
+    result.owns_buffer = 1;
 
-    result.imageBuffer = (unsigned char*)(++header);
-    
-    fclose(file);
     return result;
 }
 
@@ -0,0 +1,368 @@
+#include <stdlib.h>
+
+#include "thread.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+typedef struct parallel_worker_t
+{
+	ParallelTask task;
+	void* data;
+	int first;
+	int count;
+	int stride;
+} ParallelWorker;
+
+/*
+	Threads of pooled_parallel_for(), the calling thread works along.
+	next and pending are guarded by lock, next >= count means there is
+	nothing to hand out.
+*/
+typedef struct worker_pool_t
+{
+	Mutex run_lock;				// Held for a whole call, so callers take turns
+	Mutex lock;
+	Condition work_ready;
+	Condition work_done;
+	Thread* threads;
+	int thread_count;
+
+	ParallelTask task;
+	void* data;
+	int count;
+	int next;
+	int pending;
+} WorkerPool;
+
+static WorkerPool worker_pool;
+
+#if defined(_WIN32) || defined(_WIN64)
+static INIT_ONCE worker_pool_once = INIT_ONCE_STATIC_INIT;
+#else
+static pthread_once_t worker_pool_once = PTHREAD_ONCE_INIT;
+#endif
+
+int get_cpu_count(void)
+{
+	int result;
+
+#if defined(_WIN32) || defined(_WIN64)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	result = (int)info.dwNumberOfProcessors;
+#else
+	result = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	if (result < 1) result = 1;
+
+	return result;
+}
+
+static void run_worker(ParallelWorker* worker)
+{
+	for (int i = worker->first; i < worker->count; i += worker->stride)
+	{
+		worker->task(worker->data, i);
+	}
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+static DWORD WINAPI worker_main(LPVOID argument)
+{
+	run_worker((ParallelWorker*)argument);
+	return 0;
+}
+#else
+static void* worker_main(void* argument)
+{
+	run_worker((ParallelWorker*)argument);
+	return NULL;
+}
+#endif
+
+void parallel_for(int count, ParallelTask task, void* data)
+{
+	int thread_count = get_cpu_count();
+	if (thread_count > count) thread_count = count;
+
+	if (thread_count <= 1)
+	{
+		for (int i = 0; i < count; i++) task(data, i);
+		return;
+	}
+
+	ParallelWorker* workers = (ParallelWorker*)malloc(thread_count * sizeof(ParallelWorker));
+
+#if defined(_WIN32) || defined(_WIN64)
+	HANDLE* threads = (HANDLE*)malloc(thread_count * sizeof(HANDLE));
+#else
+	pthread_t* threads = (pthread_t*)malloc(thread_count * sizeof(pthread_t));
+	int* started = (int*)calloc(thread_count, sizeof(int));
+#endif
+
+	for (int i = 0; i < thread_count; i++)
+	{
+		workers[i].task = task;
+		workers[i].data = data;
+		workers[i].first = i;
+		workers[i].count = count;
+		workers[i].stride = thread_count;
+	}
+
+	// Worker 0 runs on the calling thread, a thread that fails to start
+	// has its share run there as well
+	for (int i = 1; i < thread_count; i++)
+	{
+#if defined(_WIN32) || defined(_WIN64)
+		threads[i] = CreateThread(NULL, 0, worker_main, &workers[i], 0, NULL);
+		if (threads[i] == NULL) run_worker(&workers[i]);
+#else
+		started[i] = pthread_create(&threads[i], NULL, worker_main, &workers[i]) == 0;
+		if (!started[i]) run_worker(&workers[i]);
+#endif
+	}
+
+	run_worker(&workers[0]);
+
+	for (int i = 1; i < thread_count; i++)
+	{
+#if defined(_WIN32) || defined(_WIN64)
+		if (threads[i])
+		{
+			WaitForSingleObject(threads[i], INFINITE);
+			CloseHandle(threads[i]);
+		}
+#else
+		if (started[i]) pthread_join(threads[i], NULL);
+#endif
+	}
+
+#if !defined(_WIN32) && !defined(_WIN64)
+	free(started);
+#endif
+	free(threads);
+	free(workers);
+}
+
+static void run_pool_worker(void* data)
+{
+	WorkerPool* pool = (WorkerPool*)data;
+
+	lock_mutex(&pool->lock);
+	for (;;)
+	{
+		while (pool->next >= pool->count) wait_condition(&pool->work_ready, &pool->lock);
+
+		ParallelTask task = pool->task;
+		void* task_data = pool->data;
+		int index = pool->next++;
+		unlock_mutex(&pool->lock);
+
+		task(task_data, index);
+
+		lock_mutex(&pool->lock);
+		if (--pool->pending == 0) broadcast_condition(&pool->work_done);
+	}
+}
+
+static void start_worker_pool(void)
+{
+	WorkerPool* pool = &worker_pool;
+
+	init_mutex(&pool->run_lock);
+	init_mutex(&pool->lock);
+	init_condition(&pool->work_ready);
+	init_condition(&pool->work_done);
+
+	// The threads live as long as the process, they only ever wait
+	// for work, so nothing joins them
+	int thread_count = get_cpu_count() - 1;
+	pool->threads = thread_count > 0 ? (Thread*)malloc(thread_count * sizeof(Thread)) : NULL;
+	pool->thread_count = 0;
+
+	for (int i = 0; i < thread_count; i++)
+	{
+		if (!start_thread(&pool->threads[pool->thread_count], run_pool_worker, pool)) break;
+		pool->thread_count++;
+	}
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+static BOOL CALLBACK start_worker_pool_once(PINIT_ONCE once, PVOID parameter, PVOID* context)
+{
+	start_worker_pool();
+	return TRUE;
+}
+#endif
+
+void pooled_parallel_for(int count, ParallelTask task, void* data)
+{
+	if (count <= 1)
+	{
+		for (int i = 0; i < count; i++) task(data, i);
+		return;
+	}
+
+#if defined(_WIN32) || defined(_WIN64)
+	InitOnceExecuteOnce(&worker_pool_once, start_worker_pool_once, NULL, NULL);
+#else
+	pthread_once(&worker_pool_once, start_worker_pool);
+#endif
+
+	WorkerPool* pool = &worker_pool;
+	lock_mutex(&pool->run_lock);
+	lock_mutex(&pool->lock);
+
+	pool->task = task;
+	pool->data = data;
+	pool->count = count;
+	pool->next = 0;
+	pool->pending = count;
+	broadcast_condition(&pool->work_ready);
+
+	// Works along until nothing is left to hand out, then waits for the
+	// indices still running on the pool
+	while (pool->next < pool->count)
+	{
+		int index = pool->next++;
+		unlock_mutex(&pool->lock);
+
+		task(data, index);
+
+		lock_mutex(&pool->lock);
+		pool->pending--;
+	}
+
+	while (pool->pending > 0) wait_condition(&pool->work_done, &pool->lock);
+
+	unlock_mutex(&pool->lock);
+	unlock_mutex(&pool->run_lock);
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+static DWORD WINAPI thread_entry(LPVOID argument)
+{
+	Thread* thread = (Thread*)argument;
+	thread->main(thread->data);
+	return 0;
+}
+#else
+static void* thread_entry(void* argument)
+{
+	Thread* thread = (Thread*)argument;
+	thread->main(thread->data);
+	return NULL;
+}
+#endif
+
+int start_thread(Thread* thread, ThreadMain main, void* data)
+{
+	int result;
+
+	thread->main = main;
+	thread->data = data;
+
+#if defined(_WIN32) || defined(_WIN64)
+	thread->handle = CreateThread(NULL, 0, thread_entry, thread, 0, NULL);
+	result = thread->handle != NULL;
+#else
+	result = pthread_create(&thread->handle, NULL, thread_entry, thread) == 0;
+#endif
+
+	return result;
+}
+
+void join_thread(Thread* thread)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	WaitForSingleObject((HANDLE)thread->handle, INFINITE);
+	CloseHandle((HANDLE)thread->handle);
+	thread->handle = NULL;
+#else
+	pthread_join(thread->handle, NULL);
+#endif
+}
+
+void init_mutex(Mutex* mutex)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	InitializeSRWLock((PSRWLOCK)&mutex->lock);
+#else
+	pthread_mutex_init(&mutex->lock, NULL);
+#endif
+}
+
+void destroy_mutex(Mutex* mutex)
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+	pthread_mutex_destroy(&mutex->lock);
+#endif
+}
+
+void lock_mutex(Mutex* mutex)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	AcquireSRWLockExclusive((PSRWLOCK)&mutex->lock);
+#else
+	pthread_mutex_lock(&mutex->lock);
+#endif
+}
+
+void unlock_mutex(Mutex* mutex)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	ReleaseSRWLockExclusive((PSRWLOCK)&mutex->lock);
+#else
+	pthread_mutex_unlock(&mutex->lock);
+#endif
+}
+
+void init_condition(Condition* condition)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	InitializeConditionVariable((PCONDITION_VARIABLE)&condition->variable);
+#else
+	pthread_cond_init(&condition->variable, NULL);
+#endif
+}
+
+void destroy_condition(Condition* condition)
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+	pthread_cond_destroy(&condition->variable);
+#endif
+}
+
+void wait_condition(Condition* condition, Mutex* mutex)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	SleepConditionVariableSRW((PCONDITION_VARIABLE)&condition->variable, (PSRWLOCK)&mutex->lock, INFINITE, 0);
+#else
+	pthread_cond_wait(&condition->variable, &mutex->lock);
+#endif
+}
+
+void signal_condition(Condition* condition)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	WakeConditionVariable((PCONDITION_VARIABLE)&condition->variable);
+#else
+	pthread_cond_signal(&condition->variable);
+#endif
+}
+
+void broadcast_condition(Condition* condition)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	WakeAllConditionVariable((PCONDITION_VARIABLE)&condition->variable);
+#else
+	pthread_cond_broadcast(&condition->variable);
+#endif
+}
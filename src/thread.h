@@ -0,0 +1,90 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <pthread.h>
+#endif
+
+/*
+	Minimal threading over pthreads or Win32 threads.
+*/
+
+typedef void (*ParallelTask)(void* data, int index);
+typedef void (*ThreadMain)(void* data);
+
+/*
+	A thread must stay at the same address until it is joined.
+*/
+typedef struct thread_t
+{
+	ThreadMain main;
+	void* data;
+
+#if defined(_WIN32) || defined(_WIN64)
+	void* handle;
+#else
+	pthread_t handle;
+#endif
+} Thread;
+
+typedef struct mutex_t
+{
+#if defined(_WIN32) || defined(_WIN64)
+	void* lock;			// SRWLOCK
+#else
+	pthread_mutex_t lock;
+#endif
+} Mutex;
+
+typedef struct condition_t
+{
+#if defined(_WIN32) || defined(_WIN64)
+	void* variable;		// CONDITION_VARIABLE
+#else
+	pthread_cond_t variable;
+#endif
+} Condition;
+
+int get_cpu_count(void);
+
+/*
+	Runs task(data, i) for every i in [0, count), spread over up to
+	get_cpu_count() threads, and returns when all calls have finished.
+	Indices are handed out round-robin, so tasks should be of similar
+	cost.
+*/
+void parallel_for(int count, ParallelTask task, void* data);
+
+/*
+	Like parallel_for(), but on get_cpu_count() - 1 threads that are
+	started by the first call and then wait for the next ones, for work
+	too short to pay for starting threads every time.  Indices are
+	handed out as threads free up.  Calls from several threads take
+	turns, and tasks must not call it themselves.
+*/
+void pooled_parallel_for(int count, ParallelTask task, void* data);
+
+/*
+	@returns: 0 if the thread couldn't be started
+*/
+int start_thread(Thread* thread, ThreadMain main, void* data);
+void join_thread(Thread* thread);
+
+void init_mutex(Mutex* mutex);
+void destroy_mutex(Mutex* mutex);
+void lock_mutex(Mutex* mutex);
+void unlock_mutex(Mutex* mutex);
+
+void init_condition(Condition* condition);
+void destroy_condition(Condition* condition);
+
+/*
+	Atomically unlocks the mutex and sleeps until the condition is
+	signaled, the mutex is locked again on return.  Wake-ups may be
+	spurious, so always wait in a loop checking the guarded state.
+*/
+void wait_condition(Condition* condition, Mutex* mutex);
+void signal_condition(Condition* condition);
+void broadcast_condition(Condition* condition);
+
+#endif // !THREAD_H
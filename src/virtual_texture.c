@@ -0,0 +1,336 @@
+// Page files may be larger than 2 GB, also on 32-bit POSIX targets
+#define _FILE_OFFSET_BITS 64
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "virtual_texture.h"
+
+/*
+	@returns: 0 on success, like fseek
+*/
+static int seek_file(FILE* file, int64_t offset)
+{
+	int result;
+
+#if defined(_WIN32) || defined(_WIN64)
+	result = _fseeki64(file, offset, SEEK_SET);
+#else
+	result = fseeko(file, (off_t)offset, SEEK_SET);
+#endif
+
+	return result;
+}
+
+static int pages_for_size(int size)
+{
+	int result = (size + VIRTUAL_PAGE_MASK) >> VIRTUAL_PAGE_SHIFT;
+
+	return result;
+}
+
+/*
+	Splits an image and its mip chain into the page file read by
+	load_virtual_texture.  This is an offline step, the whole image
+	has to fit in memory once.
+
+	@returns: 1 on success, 0 if the image can't be read or the page
+	          file can't be written
+*/
+int build_virtual_texture(const char* image_path, const char* page_file_path)
+{
+	Texture texture = { 0 };
+	texture.bytes_per_pixel = TEXEL_BYTES;
+
+	int width;
+	int height;
+	uint32_t* texels = load_image_ARGB32(image_path, TEXTURE_LOAD_DEFAULT, &width, &height);
+	if (texels == NULL)
+	{
+		return 0;
+	}
+
+	texture.levels[0].memory = texels;
+	texture.levels[0].width = width;
+	texture.levels[0].height = height;
+	generate_mipmaps(&texture);
+
+	int result = 0;
+
+	FILE* file = fopen(page_file_path, "wb");
+	if (file)
+	{
+		uint32_t header[4] = { (uint32_t)width, (uint32_t)height, (uint32_t)texture.level_count, VIRTUAL_PAGE_SHIFT };
+		fwrite("VTEX", 1, 4, file);
+		fwrite(header, sizeof(uint32_t), 4, file);
+
+		uint32_t* page = (uint32_t*)malloc(VIRTUAL_PAGE_TEXELS * TEXEL_BYTES);
+
+		for (int i = 0; i < texture.level_count; i++)
+		{
+			const TextureLevel* level = &texture.levels[i];
+			const uint32_t* level_texels = (const uint32_t*)level->memory;
+
+			for (int page_y = 0; page_y < pages_for_size(level->height); page_y++)
+			{
+				for (int page_x = 0; page_x < pages_for_size(level->width); page_x++)
+				{
+					memset(page, 0, VIRTUAL_PAGE_TEXELS * TEXEL_BYTES);
+
+					int x0 = page_x << VIRTUAL_PAGE_SHIFT;
+					int y0 = page_y << VIRTUAL_PAGE_SHIFT;
+					int columns = level->width - x0 < VIRTUAL_PAGE_SIZE ? level->width - x0 : VIRTUAL_PAGE_SIZE;
+					int rows = level->height - y0 < VIRTUAL_PAGE_SIZE ? level->height - y0 : VIRTUAL_PAGE_SIZE;
+
+					for (int y = 0; y < rows; y++)
+					{
+						memcpy(page + y * VIRTUAL_PAGE_SIZE, level_texels + (y0 + y) * level->width + x0, columns * TEXEL_BYTES);
+					}
+
+					fwrite(page, TEXEL_BYTES, VIRTUAL_PAGE_TEXELS, file);
+				}
+			}
+		}
+
+		free(page);
+
+		result = ferror(file) == 0;
+		fclose(file);
+	}
+
+	for (int i = 0; i < texture.level_count; i++)
+	{
+		free(texture.levels[i].memory);
+	}
+
+	return result;
+}
+
+static void read_page(VirtualTexture* virtual_texture, int page, int slot)
+{
+	// long is 32 bits on 64-bit Windows
+	int64_t offset = VIRTUAL_TEXTURE_HEADER_BYTES + (int64_t)page * VIRTUAL_PAGE_TEXELS * TEXEL_BYTES;
+	uint32_t* memory = virtual_texture->slot_memory + (size_t)slot * VIRTUAL_PAGE_TEXELS;
+
+	if (seek_file(virtual_texture->file, offset) != 0 ||
+		fread(memory, TEXEL_BYTES, VIRTUAL_PAGE_TEXELS, virtual_texture->file) != VIRTUAL_PAGE_TEXELS)
+	{
+		memset(memory, 0, VIRTUAL_PAGE_TEXELS * TEXEL_BYTES);
+	}
+
+	virtual_texture->slot_pages[slot] = page;
+	virtual_texture->page_slots[page] = slot;
+}
+
+/*
+	Opens a page file written by build_virtual_texture.  Only the
+	single page levels at the end of the mip chain are read here.
+
+	@returns: texture with no levels if the file can't be read
+*/
+Texture* load_virtual_texture(const char* path)
+{
+	Texture* texture = (Texture*)calloc(1, sizeof(Texture));
+	texture->bytes_per_pixel = TEXEL_BYTES;
+
+	FILE* file = fopen(path, "rb");
+	if (file == NULL)
+	{
+		return texture;
+	}
+
+	char magic[4];
+	uint32_t header[4];
+	if (fread(magic, 1, 4, file) != 4 || memcmp(magic, "VTEX", 4) != 0 ||
+		fread(header, sizeof(uint32_t), 4, file) != 4 ||
+		header[2] < 1 || header[2] > MAX_MIP_LEVELS || header[3] != VIRTUAL_PAGE_SHIFT)
+	{
+		fclose(file);
+		return texture;
+	}
+
+	VirtualTexture* virtual_texture = (VirtualTexture*)calloc(1, sizeof(VirtualTexture));
+	virtual_texture->file = file;
+
+	texture->format = TEXTURE_FORMAT_VIRTUAL;
+	texture->virtual_texture = virtual_texture;
+	texture->width = (int)header[0];
+	texture->height = (int)header[1];
+	texture->level_count = (int)header[2];
+
+	int width = texture->width;
+	int height = texture->height;
+	int pinned_levels = 0;
+
+	for (int i = 0; i < texture->level_count; i++)
+	{
+		TextureLevel* level = &texture->levels[i];
+		level->width = width > 1 ? width : 1;
+		level->height = height > 1 ? height : 1;
+
+		int pages_x = pages_for_size(level->width);
+		int pages_y = pages_for_size(level->height);
+
+		virtual_texture->level_first_page[i] = virtual_texture->page_count;
+		virtual_texture->level_pages_x[i] = pages_x;
+		virtual_texture->page_count += pages_x * pages_y;
+
+		if (pages_x == 1 && pages_y == 1) pinned_levels++;
+
+		width /= 2;
+		height /= 2;
+	}
+
+	virtual_texture->page_slots = (int*)malloc(virtual_texture->page_count * sizeof(int));
+	virtual_texture->requested = (unsigned char*)calloc(virtual_texture->page_count, 1);
+	for (int i = 0; i < virtual_texture->page_count; i++)
+	{
+		virtual_texture->page_slots[i] = -1;
+	}
+
+	virtual_texture->pinned_slot_count = pinned_levels;
+	virtual_texture->slot_count = pinned_levels + VIRTUAL_TEXTURE_CACHE_PAGES;
+	virtual_texture->slot_memory = (uint32_t*)malloc((size_t)virtual_texture->slot_count * VIRTUAL_PAGE_TEXELS * TEXEL_BYTES);
+	virtual_texture->slot_pages = (int*)malloc(virtual_texture->slot_count * sizeof(int));
+	virtual_texture->slot_last_used = (unsigned int*)calloc(virtual_texture->slot_count, sizeof(unsigned int));
+	for (int i = 0; i < virtual_texture->slot_count; i++)
+	{
+		virtual_texture->slot_pages[i] = -1;
+	}
+
+	// Single page levels are the last pinned_levels of the chain
+	for (int i = 0; i < pinned_levels; i++)
+	{
+		int level = texture->level_count - pinned_levels + i;
+		read_page(virtual_texture, virtual_texture->level_first_page[level], i);
+	}
+
+	return texture;
+}
+
+/*
+	@returns: packed ARGB32 texel of the finest resident level at or
+	          above the given one
+*/
+uint32_t fetch_virtual_texel(const Texture* texture, int level, int x, int y)
+{
+	VirtualTexture* virtual_texture = texture->virtual_texture;
+
+	for (;;)
+	{
+		int page = virtual_texture->level_first_page[level] +
+			(y >> VIRTUAL_PAGE_SHIFT) * virtual_texture->level_pages_x[level] + (x >> VIRTUAL_PAGE_SHIFT);
+
+		int slot = virtual_texture->page_slots[page];
+		if (slot >= 0)
+		{
+			virtual_texture->slot_last_used[slot] = virtual_texture->frame;
+
+			const uint32_t* memory = virtual_texture->slot_memory + (size_t)slot * VIRTUAL_PAGE_TEXELS;
+			uint32_t result = memory[((y & VIRTUAL_PAGE_MASK) << VIRTUAL_PAGE_SHIFT) + (x & VIRTUAL_PAGE_MASK)];
+
+			return result;
+		}
+
+		virtual_texture->requested[page] = 1;
+
+		// Same spot one level up, odd sizes round down
+		level++;
+		x >>= 1;
+		y >>= 1;
+		if (x >= texture->levels[level].width) x = texture->levels[level].width - 1;
+		if (y >= texture->levels[level].height) y = texture->levels[level].height - 1;
+	}
+}
+
+/*
+	@returns: free slot, or the least recently used one that was not
+	          sampled this frame; -1 if every slot is in use
+*/
+static int find_slot(VirtualTexture* virtual_texture)
+{
+	int result = -1;
+	unsigned int oldest = virtual_texture->frame;
+
+	for (int i = virtual_texture->pinned_slot_count; i < virtual_texture->slot_count; i++)
+	{
+		if (virtual_texture->slot_pages[i] < 0)
+		{
+			return i;
+		}
+
+		unsigned int last_used = virtual_texture->slot_last_used[i];
+		if (last_used != virtual_texture->frame && (result < 0 || last_used < oldest))
+		{
+			result = i;
+			oldest = last_used;
+		}
+	}
+
+	return result;
+}
+
+/*
+	Streams in the pages requested since the last update, coarse levels
+	first so that missing detail fills in from the top of the chain.
+	Pages sampled in the current frame are never evicted; when all slots
+	are taken by them the remaining requests wait for a later frame.
+*/
+void update_virtual_texture(Texture* texture)
+{
+	if (texture == NULL || texture->format != TEXTURE_FORMAT_VIRTUAL) return;
+
+	VirtualTexture* virtual_texture = texture->virtual_texture;
+
+	for (int level = texture->level_count - 1; level >= 0; level--)
+	{
+		int first_page = virtual_texture->level_first_page[level];
+		int last_page = level + 1 < texture->level_count ? virtual_texture->level_first_page[level + 1] : virtual_texture->page_count;
+
+		for (int page = first_page; page < last_page; page++)
+		{
+			if (!virtual_texture->requested[page]) continue;
+
+			if (virtual_texture->page_slots[page] < 0)
+			{
+				int slot = find_slot(virtual_texture);
+				if (slot < 0)
+				{
+					virtual_texture->frame++;
+					return;
+				}
+
+				int evicted = virtual_texture->slot_pages[slot];
+				if (evicted >= 0)
+				{
+					virtual_texture->page_slots[evicted] = -1;
+				}
+
+				read_page(virtual_texture, page, slot);
+				virtual_texture->slot_last_used[slot] = virtual_texture->frame;
+			}
+
+			virtual_texture->requested[page] = 0;
+		}
+	}
+
+	virtual_texture->frame++;
+}
+
+void free_virtual_texture(VirtualTexture* virtual_texture)
+{
+	if (virtual_texture)
+	{
+		fclose(virtual_texture->file);
+
+		free(virtual_texture->page_slots);
+		free(virtual_texture->requested);
+		free(virtual_texture->slot_memory);
+		free(virtual_texture->slot_pages);
+		free(virtual_texture->slot_last_used);
+
+		free(virtual_texture);
+	}
+}
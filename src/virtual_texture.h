@@ -0,0 +1,70 @@
+#ifndef VIRTUAL_TEXTURE_H
+#define VIRTUAL_TEXTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "texture.h"
+
+/*
+	Virtual textures keep their mip chain on disk, split into square
+	pages, and hold only a fixed number of pages in memory.
+
+	Sampling a page that isn't resident records a request for it and
+	falls back to the same texel of the next coarser level.  The levels
+	that fit in a single page are loaded up front and never evicted,
+	so the fallback always ends on a resident page.
+
+	update_virtual_texture() then streams the requested pages into the
+	least recently used cache slots.  Pages asked for during a frame are
+	used from the next frame on, memory use stays bounded by the cache
+	size whatever the size of the texture.
+
+	Page file (.vtex), native byte order:
+		char magic[4] = "VTEX"
+		uint32 width, height, level_count, page_shift
+		pages, level 0 first, each level in row-major page order, bottom
+		row of pages first; every page is PAGE_SIZE x PAGE_SIZE ARGB32
+		texels in row-major order, padded at the right and top edges
+*/
+
+#define VIRTUAL_TEXTURE_EXTENSION ".vtex"
+
+#define VIRTUAL_PAGE_SHIFT 6
+#define VIRTUAL_PAGE_SIZE (1 << VIRTUAL_PAGE_SHIFT)
+#define VIRTUAL_PAGE_MASK (VIRTUAL_PAGE_SIZE - 1)
+#define VIRTUAL_PAGE_TEXELS (VIRTUAL_PAGE_SIZE * VIRTUAL_PAGE_SIZE)
+
+#define VIRTUAL_TEXTURE_HEADER_BYTES 20
+
+// Streamed pages held per texture, 16 KB each
+#define VIRTUAL_TEXTURE_CACHE_PAGES 256
+
+typedef struct virtual_texture_t
+{
+	FILE* file;
+
+	// Page i of level l is page number level_first_page[l] + i
+	int level_first_page[MAX_MIP_LEVELS];
+	int level_pages_x[MAX_MIP_LEVELS];
+	int page_count;
+
+	int* page_slots;			// Cache slot of every page, -1 if not resident
+	unsigned char* requested;	// Pages sampled while not resident
+
+	// The first pinned_slot_count slots hold the single page levels
+	uint32_t* slot_memory;		// VIRTUAL_PAGE_TEXELS per slot
+	int* slot_pages;			// Page held by every slot, -1 if free
+	unsigned int* slot_last_used;
+	int slot_count;
+	int pinned_slot_count;
+
+	unsigned int frame;
+} VirtualTexture;
+
+int build_virtual_texture(const char* image_path, const char* page_file_path);
+Texture* load_virtual_texture(const char* path);
+void update_virtual_texture(Texture* texture);
+void free_virtual_texture(VirtualTexture* virtual_texture);
+
+#endif // !VIRTUAL_TEXTURE_H